@@ -0,0 +1,744 @@
+#include <ctype.h>
+
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Assembler.
+ *
+ * One statement per line; ';' starts a comment.  Mnemonics are the names in
+ * synacor_instr[], and operands use the disassembler's syntax: r0..r7 name
+ * registers, anything else is an expression.  Expressions are sums and
+ * differences of numbers (C syntax), 'c' character constants and symbols.  A
+ * negative instruction operand wraps modulo 32768, so "add r0, r0, -1"
+ * decrements.  Symbols may be used before they are defined; those operands
+ * are patched at the end.
+ *
+ *	name:			Label the current address
+ *	00123:			Continue at address 123 (as printed by -D)
+ *	.org EXPR		Continue at address EXPR
+ *	.equ NAME, EXPR		Define a constant
+ *	.word EXPR, ...		Raw words (0..65535)
+ *	.fill N[, EXPR]		N copies of EXPR (default 0)
+ *	.string "text"		One word per character; .stringz adds a 0
+ *	.macro NAME [P, ...]	Define a macro, up to .endm.  In its body \P is
+ *				replaced by the argument and \@ by a number
+ *				unique to the expansion, for local labels.
+ */
+
+#define	ASM_MAXDEPTH	16	/* Macro nesting */
+#define	ASM_MAXARGS	8
+
+struct asm_sym {
+	char		*as_name;
+	uint32_t	 as_val;
+};
+
+struct asm_fixup {
+	uint32_t	 af_addr;
+	bool		 af_operand;	/* Instruction operand, not .word */
+	char		*af_expr;
+	unsigned	 af_line;
+};
+
+struct asm_macro {
+	char		*am_name;
+	char		*am_params[ASM_MAXARGS];
+	unsigned	 am_nparams;
+	char		*am_body;
+	size_t		 am_len;
+};
+
+struct asm_state {
+	const char		*a_file;
+	uint16_t		*a_mem;
+	uint32_t		 a_pc;
+	uint32_t		 a_end;		/* Highest address written + 1 */
+	unsigned		 a_line;
+	unsigned		 a_errors;
+	unsigned		 a_depth;
+	unsigned		 a_unique;
+
+	struct asm_sym		*a_syms;
+	size_t			 a_nsyms;
+	struct asm_fixup	*a_fixups;
+	size_t			 a_nfixups;
+	struct asm_macro	*a_macros;
+	size_t			 a_nmacros;
+	struct asm_macro	*a_defining;
+};
+
+static void asm_text(struct asm_state *as, char *text);
+
+static void __attribute__((format(printf, 2, 3)))
+asm_error(struct asm_state *as, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%u: ", as->a_file, as->a_line);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	as->a_errors++;
+}
+
+static void *
+asm_grow(void *p, size_t n, size_t sz)
+{
+
+	/* Grow at powers of two. */
+	if (n != 0 && (n & (n - 1)) != 0)
+		return (p);
+	p = realloc(p, (n ? n * 2 : 8) * sz);
+	ASSERT(p != NULL, "realloc");
+	return (p);
+}
+
+static char *
+asm_strndup(const char *s, size_t n)
+{
+	char *d;
+
+	d = strndup(s, n);
+	ASSERT(d != NULL, "strndup");
+	return (d);
+}
+
+static char *
+trim(char *s)
+{
+	char *e;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	e = s + strlen(s);
+	while (e > s && isspace((unsigned char)e[-1]))
+		e--;
+	*e = 0;
+	return (s);
+}
+
+static bool
+isident(int c, bool first)
+{
+
+	return (isalpha(c) || c == '_' || c == '.' ||
+	    (!first && (isdigit(c) || c == '$')));
+}
+
+static struct asm_sym *
+asm_lookup(struct asm_state *as, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < as->a_nsyms; i++)
+		if (strlen(as->a_syms[i].as_name) == len &&
+		    memcmp(as->a_syms[i].as_name, name, len) == 0)
+			return (&as->a_syms[i]);
+	return (NULL);
+}
+
+static void
+asm_define(struct asm_state *as, const char *name, size_t len, uint32_t val)
+{
+	struct asm_sym *sym;
+
+	if (asm_lookup(as, name, len) != NULL) {
+		asm_error(as, "`%.*s' redefined", (int)len, name);
+		return;
+	}
+	as->a_syms = asm_grow(as->a_syms, as->a_nsyms, sizeof(*as->a_syms));
+	sym = &as->a_syms[as->a_nsyms++];
+	sym->as_name = asm_strndup(name, len);
+	sym->as_val = val;
+}
+
+/* Parse a character constant body at 's'; returns chars consumed or 0. */
+static size_t
+asm_char(const char *s, char quote, uint32_t *val)
+{
+
+	if (s[0] == 0 || s[0] == quote)
+		return (0);
+	if (s[0] != '\\') {
+		*val = (unsigned char)s[0];
+		return (1);
+	}
+	switch (s[1]) {
+	case 'n':
+		*val = '\n';
+		break;
+	case 't':
+		*val = '\t';
+		break;
+	case '0':
+		*val = 0;
+		break;
+	case '\\':
+	case '\'':
+	case '"':
+		*val = (unsigned char)s[1];
+		break;
+	default:
+		return (0);
+	}
+	return (2);
+}
+
+/*
+ * Evaluate expression 's'.  Returns false on a syntax error; sets *undef if it
+ * names a symbol not yet defined.
+ */
+static bool
+asm_eval(struct asm_state *as, const char *s, int64_t *val, bool *undef)
+{
+	const struct asm_sym *sym;
+	const char *start;
+	uint32_t c;
+	int64_t term;
+	size_t n;
+	char *end;
+	int sign;
+
+	*val = 0;
+	*undef = false;
+	sign = 1;
+	for (;;) {
+		while (isspace((unsigned char)*s))
+			s++;
+		if (*s == '-' || *s == '+') {
+			sign = *s == '-' ? -sign : sign;
+			s++;
+			continue;
+		}
+
+		if (isdigit((unsigned char)*s)) {
+			term = strtoll(s, &end, 0);
+			s = end;
+		} else if (*s == '\'') {
+			n = asm_char(s + 1, '\'', &c);
+			if (n == 0 || s[1 + n] != '\'')
+				return (false);
+			term = c;
+			s += n + 2;
+		} else if (isident((unsigned char)*s, true)) {
+			start = s;
+			while (isident((unsigned char)*s, false))
+				s++;
+			sym = asm_lookup(as, start, s - start);
+			if (sym == NULL) {
+				*undef = true;
+				term = 0;
+			} else
+				term = sym->as_val;
+		} else
+			return (false);
+		*val += sign * term;
+
+		while (isspace((unsigned char)*s))
+			s++;
+		if (*s == 0)
+			return (true);
+		if (*s != '+' && *s != '-')
+			return (false);
+		sign = *s == '-' ? -1 : 1;
+		s++;
+	}
+}
+
+static void
+asm_emit(struct asm_state *as, uint16_t w)
+{
+
+	if (as->a_pc >= MEMWORDS) {
+		if (as->a_pc == MEMWORDS)
+			asm_error(as, "past the end of memory");
+		as->a_pc++;
+		return;
+	}
+	as->a_mem[as->a_pc++] = w;
+	if (as->a_pc > as->a_end)
+		as->a_end = as->a_pc;
+}
+
+/* Check 'v' as a value for an operand (or a .word) and encode it. */
+static bool
+asm_range(struct asm_state *as, int64_t v, bool operand, uint16_t *w)
+{
+
+	if (operand) {
+		if (v < 0 && v >= -32768)
+			v += 32768;
+		if (v < 0 || v > INT16_MAX) {
+			asm_error(as, "operand %jd out of range", (intmax_t)v);
+			return (false);
+		}
+	} else if (v < -32768 || v > UINT16_MAX) {
+		asm_error(as, "word %jd out of range", (intmax_t)v);
+		return (false);
+	}
+	*w = (uint16_t)v;
+	return (true);
+}
+
+/* Emit one operand or data word for expression 'e'. */
+static void
+asm_value(struct asm_state *as, const char *e, bool operand)
+{
+	struct asm_fixup *af;
+	int64_t v;
+	uint16_t w;
+	bool undef;
+
+	if (operand && (e[0] == 'r' || e[0] == 'R') && e[1] >= '0' &&
+	    e[1] <= '7' && e[2] == 0) {
+		asm_emit(as, 32768 + (e[1] - '0'));
+		return;
+	}
+	if (!asm_eval(as, e, &v, &undef)) {
+		asm_error(as, "bad expression `%s'", e);
+		asm_emit(as, 0);
+		return;
+	}
+	if (undef) {
+		as->a_fixups = asm_grow(as->a_fixups, as->a_nfixups,
+		    sizeof(*as->a_fixups));
+		af = &as->a_fixups[as->a_nfixups++];
+		af->af_addr = as->a_pc;
+		af->af_operand = operand;
+		af->af_expr = asm_strndup(e, strlen(e));
+		af->af_line = as->a_line;
+		asm_emit(as, 0);
+		return;
+	}
+	if (!asm_range(as, v, operand, &w))
+		w = 0;
+	asm_emit(as, w);
+}
+
+/*
+ * Cut the first top-level comma-separated field (not inside quotes) off '*sp'
+ * and return it; '*sp' becomes NULL after the last one.
+ */
+static char *
+asm_field(char **sp)
+{
+	char *s, *f;
+	char q;
+
+	f = s = *sp;
+	for (q = 0; *s != 0; s++) {
+		if (q != 0) {
+			if (*s == '\\' && s[1] != 0)
+				s++;
+			else if (*s == q)
+				q = 0;
+		} else if (*s == '"' || *s == '\'')
+			q = *s;
+		else if (*s == ',') {
+			*s = 0;
+			*sp = s + 1;
+			return (trim(f));
+		}
+	}
+	*sp = NULL;
+	return (trim(f));
+}
+
+/* Split 's' at top-level commas; returns the count, or max + 1 if more. */
+static unsigned
+asm_split(char *s, char **args, unsigned max)
+{
+	unsigned n;
+
+	s = trim(s);
+	if (*s == 0)
+		return (0);
+	for (n = 0; s != NULL; n++) {
+		if (n == max)
+			return (max + 1);
+		args[n] = asm_field(&s);
+	}
+	return (n);
+}
+
+static void
+asm_string(struct asm_state *as, const char *s, bool z)
+{
+	uint32_t c;
+	size_t n;
+
+	if (*s++ != '"')
+		goto bad;
+	while (*s != '"') {
+		n = asm_char(s, '"', &c);
+		if (n == 0)
+			goto bad;
+		asm_emit(as, c);
+		s += n;
+	}
+	if (s[1] != 0)
+		goto bad;
+	if (z)
+		asm_emit(as, 0);
+	return;
+bad:
+	asm_error(as, "bad string");
+}
+
+/* Evaluate an expression that must be defined now. */
+static bool
+asm_const(struct asm_state *as, const char *e, int64_t *v)
+{
+	bool undef;
+
+	if (!asm_eval(as, e, v, &undef)) {
+		asm_error(as, "bad expression `%s'", e);
+		return (false);
+	}
+	if (undef) {
+		asm_error(as, "`%s' must be defined before use here", e);
+		return (false);
+	}
+	return (true);
+}
+
+static void
+asm_macro_begin(struct asm_state *as, char *rest)
+{
+	struct asm_macro *am;
+	char *args[ASM_MAXARGS + 1], *name;
+	unsigned n, i;
+
+	name = rest;
+	while (*rest != 0 && !isspace((unsigned char)*rest))
+		rest++;
+	if (*rest != 0)
+		*rest++ = 0;
+	if (!isident((unsigned char)*name, true)) {
+		asm_error(as, "bad macro name `%s'", name);
+		return;
+	}
+	n = asm_split(rest, args, ASM_MAXARGS);
+	if (n > ASM_MAXARGS) {
+		asm_error(as, "too many macro parameters");
+		return;
+	}
+
+	as->a_macros = asm_grow(as->a_macros, as->a_nmacros,
+	    sizeof(*as->a_macros));
+	am = &as->a_macros[as->a_nmacros++];
+	memset(am, 0, sizeof(*am));
+	am->am_name = asm_strndup(name, strlen(name));
+	for (i = 0; i < n; i++)
+		am->am_params[i] = asm_strndup(args[i], strlen(args[i]));
+	am->am_nparams = n;
+	am->am_body = asm_strndup("", 0);
+	as->a_defining = am;
+}
+
+static void
+asm_macro_line(struct asm_state *as, const char *line)
+{
+	struct asm_macro *am;
+	size_t n;
+
+	am = as->a_defining;
+	n = strlen(line);
+	am->am_body = realloc(am->am_body, am->am_len + n + 2);
+	ASSERT(am->am_body != NULL, "realloc");
+	memcpy(am->am_body + am->am_len, line, n);
+	am->am_len += n;
+	am->am_body[am->am_len++] = '\n';
+	am->am_body[am->am_len] = 0;
+}
+
+static void
+asm_expand(struct asm_state *as, const struct asm_macro *am, char *rest)
+{
+	char *args[ASM_MAXARGS + 1], *out, *p, uniq[16];
+	const char *s, *rep;
+	size_t len, cap, rl, pl;
+	unsigned n, i, line;
+
+	n = asm_split(rest, args, ASM_MAXARGS);
+	if (n != am->am_nparams) {
+		asm_error(as, "macro %s takes %u arguments, not %u",
+		    am->am_name, am->am_nparams, n);
+		return;
+	}
+	if (as->a_depth == ASM_MAXDEPTH) {
+		asm_error(as, "macros nested too deeply");
+		return;
+	}
+	snprintf(uniq, sizeof(uniq), "%u", as->a_unique++);
+
+	cap = am->am_len + 1;
+	out = malloc(cap);
+	ASSERT(out != NULL, "malloc");
+	len = 0;
+	for (s = am->am_body; *s != 0; ) {
+		rep = NULL;
+		pl = 0;
+		if (s[0] == '\\' && s[1] == '@') {
+			rep = uniq;
+			pl = 2;
+		} else if (s[0] == '\\') {
+			for (i = 0; i < n; i++) {
+				p = am->am_params[i];
+				rl = strlen(p);
+				if (strncmp(s + 1, p, rl) == 0 &&
+				    !isident((unsigned char)s[1 + rl], false)) {
+					rep = args[i];
+					pl = 1 + rl;
+					break;
+				}
+			}
+		}
+		rl = rep != NULL ? strlen(rep) : 1;
+		if (len + rl + 1 > cap) {
+			cap = (len + rl + 1) * 2;
+			out = realloc(out, cap);
+			ASSERT(out != NULL, "realloc");
+		}
+		if (rep != NULL) {
+			memcpy(out + len, rep, rl);
+			s += pl;
+		} else
+			out[len] = *s++;
+		len += rl;
+	}
+	out[len] = 0;
+
+	/* Errors inside the expansion point at the invocation. */
+	line = as->a_line;
+	as->a_depth++;
+	asm_text(as, out);
+	as->a_depth--;
+	as->a_line = line;
+	free(out);
+}
+
+static void
+asm_directive(struct asm_state *as, char *dir, char *rest)
+{
+	char *args[ASM_MAXARGS + 1];
+	int64_t v, fill;
+	uint16_t w;
+	unsigned n;
+
+	if (strcmp(dir, ".macro") == 0) {
+		asm_macro_begin(as, rest);
+		return;
+	}
+	if (strcmp(dir, ".string") == 0 || strcmp(dir, ".stringz") == 0) {
+		asm_string(as, trim(rest), dir[7] == 'z');
+		return;
+	}
+
+	if (strcmp(dir, ".word") == 0) {
+		/* Any number of values, taken one at a time. */
+		rest = trim(rest);
+		if (*rest == 0)
+			asm_error(as, ".word takes at least one value");
+		else
+			while (rest != NULL)
+				asm_value(as, asm_field(&rest), false);
+		return;
+	}
+
+	n = asm_split(rest, args, ASM_MAXARGS);
+	if (strcmp(dir, ".org") == 0) {
+		if (n != 1)
+			asm_error(as, ".org takes an address");
+		else if (asm_const(as, args[0], &v)) {
+			if (v < 0 || v > (int64_t)MEMWORDS)
+				asm_error(as, "bad address %jd", (intmax_t)v);
+			else
+				as->a_pc = v;
+		}
+	} else if (strcmp(dir, ".equ") == 0) {
+		if (n != 2 || !isident((unsigned char)args[0][0], true))
+			asm_error(as, ".equ takes a name and a value");
+		else if (asm_const(as, args[1], &v))
+			asm_define(as, args[0], strlen(args[0]), v);
+	} else if (strcmp(dir, ".fill") == 0) {
+		fill = 0;
+		if (n < 1 || n > 2)
+			asm_error(as, ".fill takes a count and a value");
+		else if (asm_const(as, args[0], &v) &&
+		    (n == 1 || asm_const(as, args[1], &fill))) {
+			if (v < 0 || v > (int64_t)MEMWORDS)
+				asm_error(as, "bad count %jd", (intmax_t)v);
+			else if (asm_range(as, fill, false, &w))
+				while (v-- > 0)
+					asm_emit(as, w);
+		}
+	} else
+		asm_error(as, "unknown directive `%s'", dir);
+}
+
+static void
+asm_line(struct asm_state *as, char *line)
+{
+	char *args[4], *p, *word;
+	const struct asm_macro *am;
+	unsigned i, n;
+	char q;
+
+	/* Strip the comment. */
+	for (p = line, q = 0; *p != 0; p++) {
+		if (q != 0) {
+			if (*p == '\\' && p[1] != 0)
+				p++;
+			else if (*p == q)
+				q = 0;
+		} else if (*p == '"' || *p == '\'')
+			q = *p;
+		else if (*p == ';') {
+			*p = 0;
+			break;
+		}
+	}
+	line = trim(line);
+
+	if (as->a_defining != NULL) {
+		if (strcmp(line, ".endm") == 0)
+			as->a_defining = NULL;
+		else
+			asm_macro_line(as, line);
+		return;
+	}
+
+	/* Labels, and -D style "00123:" addresses. */
+	for (;;) {
+		p = line;
+		if (isdigit((unsigned char)*p)) {
+			while (isdigit((unsigned char)*p))
+				p++;
+			if (*p != ':')
+				break;
+			as->a_pc = strtoul(line, NULL, 10);
+			if (as->a_pc > MEMWORDS)
+				asm_error(as, "bad address %s", line);
+		} else if (isident((unsigned char)*p, true)) {
+			while (isident((unsigned char)*p, false))
+				p++;
+			if (*p != ':')
+				break;
+			asm_define(as, line, p - line, as->a_pc);
+		} else
+			break;
+		line = trim(p + 1);
+	}
+	if (*line == 0)
+		return;
+
+	word = line;
+	while (*line != 0 && !isspace((unsigned char)*line))
+		line++;
+	if (*line != 0)
+		*line++ = 0;
+
+	if (word[0] == '.') {
+		asm_directive(as, word, line);
+		return;
+	}
+	for (i = 0; i < as->a_nmacros; i++) {
+		am = &as->a_macros[i];
+		if (strcmp(am->am_name, word) == 0) {
+			asm_expand(as, am, line);
+			return;
+		}
+	}
+	for (i = 0; i < SYNACOR_NINSTR; i++)
+		if (strcmp(synacor_instr[i].name, word) == 0)
+			break;
+	if (i == SYNACOR_NINSTR) {
+		asm_error(as, "unknown instruction `%s'", word);
+		return;
+	}
+
+	n = asm_split(line, args, 3);
+	if (n != synacor_instr[i].arguments) {
+		asm_error(as, "%s takes %u operands, not %u",
+		    synacor_instr[i].name, (uns)synacor_instr[i].arguments, n);
+		return;
+	}
+	asm_emit(as, synacor_instr[i].icode);
+	for (i = 0; i < n; i++)
+		asm_value(as, args[i], true);
+}
+
+static void
+asm_text(struct asm_state *as, char *text)
+{
+	char *line, *next;
+	unsigned first;
+
+	first = as->a_line;
+	for (line = text; line != NULL; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = 0;
+		if (as->a_depth == 0)
+			as->a_line = ++first;
+		asm_line(as, line);
+	}
+}
+
+/*
+ * Assemble 'src' (named 'file' in messages) into 'mem', which must hold
+ * MEMWORDS words.  Returns the number of errors, printed to stderr; on
+ * success *nwords is the image size.
+ */
+unsigned
+assemble(const char *src, const char *file, uint16_t *mem, size_t *nwords)
+{
+	struct asm_state as;
+	struct asm_fixup *af;
+	int64_t v;
+	uint16_t w;
+	char *text;
+	size_t i;
+	bool undef;
+
+	memset(&as, 0, sizeof(as));
+	as.a_file = file;
+	as.a_mem = mem;
+	memset(mem, 0, MEMBYTES);
+
+	text = asm_strndup(src, strlen(src));
+	asm_text(&as, text);
+	free(text);
+	if (as.a_defining != NULL)
+		asm_error(&as, "missing .endm for %s", as.a_defining->am_name);
+
+	for (i = 0; i < as.a_nfixups; i++) {
+		af = &as.a_fixups[i];
+		as.a_line = af->af_line;
+		if (!asm_eval(&as, af->af_expr, &v, &undef) || undef)
+			asm_error(&as, "undefined symbol in `%s'", af->af_expr);
+		else if (af->af_addr < MEMWORDS &&
+		    asm_range(&as, v, af->af_operand, &w))
+			mem[af->af_addr] = w;
+		free(af->af_expr);
+	}
+
+	for (i = 0; i < as.a_nsyms; i++)
+		free(as.a_syms[i].as_name);
+	for (i = 0; i < as.a_nmacros; i++) {
+		free(as.a_macros[i].am_name);
+		free(as.a_macros[i].am_body);
+		while (as.a_macros[i].am_nparams > 0)
+			free(as.a_macros[i].am_params[
+			    --as.a_macros[i].am_nparams]);
+	}
+	free(as.a_syms);
+	free(as.a_fixups);
+	free(as.a_macros);
+
+	*nwords = as.a_end;
+	return (as.a_errors);
+}
@@ -0,0 +1,104 @@
+#include <unistd.h>
+
+#include "emu.h"
+
+/*
+ * synacor-asm: assemble a source file into a ROM image the emulator loads.
+ * The syntax is described in asm.c.
+ */
+
+static void
+ausage(void)
+{
+
+	printf("usage: synacor-asm [-o OUTPUT] source.s\n"
+		"\n"
+		"  Writes OUTPUT, or source.bin by default.\n");
+	exit(1);
+}
+
+static char *
+slurp(const char *name)
+{
+	char *buf;
+	size_t len, cap, rd;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+	len = 0;
+	cap = 4096;
+	buf = malloc(cap);
+	ASSERT(buf != NULL, "malloc");
+	while ((rd = fread(buf + len, 1, cap - len - 1, f)) > 0) {
+		len += rd;
+		if (len == cap - 1) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			ASSERT(buf != NULL, "realloc");
+		}
+	}
+	ASSERT(!ferror(f), "read %s", name);
+	fclose(f);
+	buf[len] = 0;
+	return (buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *in;
+	char *out, *src, *dot;
+	uint16_t *mem;
+	size_t nwords;
+	unsigned errors;
+	FILE *f;
+	int opt;
+
+	out = NULL;
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			ausage();
+			break;
+		}
+	}
+	if (optind != argc - 1)
+		ausage();
+	in = argv[optind];
+
+	if (out == NULL) {
+		out = malloc(strlen(in) + sizeof(".bin"));
+		ASSERT(out != NULL, "malloc");
+		strcpy(out, in);
+		dot = strrchr(out, '.');
+		if (dot != NULL && strchr(dot, '/') == NULL)
+			*dot = 0;
+		strcat(out, ".bin");
+		if (strcmp(out, in) == 0)
+			ausage();
+	}
+
+	src = slurp(in);
+	mem = malloc(MEMBYTES);
+	ASSERT(mem != NULL, "malloc");
+	errors = assemble(src, in, mem, &nwords);
+	if (errors != 0) {
+		fprintf(stderr, "%u error%s.\n", errors, errors == 1 ? "" : "s");
+		return (1);
+	}
+
+	f = fopen(out, "wb");
+	if (f == NULL || fwrite(mem, sizeof(*mem), nwords, f) != nwords ||
+	    fclose(f) != 0) {
+		fprintf(stderr, "%s: %s\n", out, strerror(errno));
+		return (1);
+	}
+	return (0);
+}
@@ -0,0 +1,658 @@
+#define	_GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "emu.h"
+
+/*
+ * Batch runner.
+ *
+ * A manifest lists jobs, one per line, as whitespace-separated fields:
+ *
+ *	rom=FILE or save=FILE	Machine to start from; one is required
+ *	input=FILE		Bytes for 'in' (default: none)
+ *	r7=N			Initial r7 (default: 0, or the save's)
+ *	limit=N			Instruction budget (default: none)
+ *	name=ID			Label in the report (default: the line number)
+ *
+ * Blank lines and lines starting with '#' are skipped.  Each distinct ROM,
+ * save and input file is read once; machines become vm.c images, and every
+ * job runs on its own copy-on-write instance of one.
+ *
+ * Each worker thread has a deque of jobs.  It takes the job at the front, runs
+ * it for BATCH_SLICE instructions and, unless the job is done, puts it back at
+ * the end, so a worker's jobs take turns and long ones don't hold up short
+ * ones.  A worker with nothing queued steals from the end of another's deque,
+ * and sleeps if there is nothing queued anywhere.  A job is done when it
+ * halts, runs out of input, faults or uses up its budget.  The report is one
+ * JSON object holding each job's result, output and statistics.
+ */
+
+#define	BATCH_SLICE	(1 << 20)
+
+enum bj_status {
+	BJ_RUNNING,
+	BJ_HALTED,
+	BJ_INPUT,
+	BJ_LIMIT,
+	BJ_FAULT,
+	BJ_ERROR,
+};
+
+static const char *const bj_statusname[] = {
+	[BJ_RUNNING] = "interrupted",
+	[BJ_HALTED] = "halted",
+	[BJ_INPUT] = "input",
+	[BJ_LIMIT] = "limit",
+	[BJ_FAULT] = "fault",
+	[BJ_ERROR] = "error",
+};
+
+enum bf_kind {
+	BF_ROM,
+	BF_SAVE,
+	BF_INPUT,
+};
+
+/* A file named by the manifest, loaded once. */
+struct batch_file {
+	char			*bf_path;
+	enum bf_kind		 bf_kind;
+	struct vm_image		*bf_image;
+	char			*bf_data;
+	size_t			 bf_len;
+	const char		*bf_error;
+	struct batch_file	*bf_next;
+};
+
+struct batch_job {
+	char			*bj_name;
+	unsigned		 bj_line;
+	struct batch_file	*bj_machine;
+	struct batch_file	*bj_input;
+	int32_t			 bj_r7;		/* -1: leave it alone */
+	uint64_t		 bj_limit;
+
+	struct vm		*bj_vm;
+	FILE			*bj_in;
+	FILE			*bj_out;
+	char			*bj_output;
+	size_t			 bj_outlen;
+	uint64_t		 bj_begin;	/* insns at the image */
+
+	enum bj_status		 bj_status;
+	const char		*bj_error;
+	uint64_t		 bj_insns;
+	uint32_t		 bj_pc;
+	unsigned		 bj_slices;
+	unsigned		 bj_steals;
+	uint64_t		 bj_first;	/* Start of first turn, us */
+	uint64_t		 bj_done;
+	uint64_t		 bj_run;	/* Time spent running, us */
+};
+
+struct batch_worker {
+	pthread_t		 bw_thread;
+	unsigned		 bw_id;
+	pthread_mutex_t		 bw_lock;
+	struct batch_job	**bw_q;		/* Ring of bt_njobs */
+	size_t			 bw_head;
+	size_t			 bw_len;
+};
+
+static struct batch_file	*bt_files;
+static struct batch_job		*bt_jobs;
+static size_t			 bt_njobs;
+static struct batch_worker	*bt_workers;
+static unsigned			 bt_nworkers;
+static uint64_t			 bt_t0;
+
+static atomic_size_t		 bt_left;	/* Jobs not done */
+static atomic_size_t		 bt_queued;	/* Jobs in some deque */
+static pthread_mutex_t		 bt_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 bt_idle_cv = PTHREAD_COND_INITIALIZER;
+
+static __thread jmp_buf		 bt_fault;
+
+static bool
+batch_readall(FILE *f, char **data, size_t *len)
+{
+	size_t alloc, rd;
+
+	alloc = 4096;
+	*len = 0;
+	*data = malloc(alloc);
+	ASSERT(*data != NULL, "malloc");
+	while ((rd = fread(*data + *len, 1, alloc - *len, f)) > 0) {
+		*len += rd;
+		if (*len == alloc) {
+			alloc *= 2;
+			*data = realloc(*data, alloc);
+			ASSERT(*data != NULL, "realloc");
+		}
+	}
+	return (!ferror(f));
+}
+
+/* Load 'bf' into the (main thread's) machine and capture it as an image. */
+static void
+batch_load(struct batch_file *bf)
+{
+	FILE *f;
+	size_t len;
+	char *data;
+
+	f = fopen(bf->bf_path, "rb");
+	if (f == NULL) {
+		bf->bf_error = strerror(errno);
+		return;
+	}
+	if (bf->bf_kind == BF_INPUT) {
+		if (!batch_readall(f, &bf->bf_data, &bf->bf_len))
+			bf->bf_error = "read error";
+		fclose(f);
+		return;
+	}
+
+	memset(memory, 0, MEMBYTES);
+	memset(regs, 0, sizeof(regs));
+	pc = 0;
+	insns = 0;
+	halted = false;
+	stack_depth = 0;
+	if (bf->bf_kind == BF_SAVE)
+		bf->bf_error = readsave(f);
+	else {
+		if (!batch_readall(f, &data, &len))
+			bf->bf_error = "read error";
+		memcpy(memory, data, min(len, (size_t)MEMBYTES));
+		free(data);
+	}
+	fclose(f);
+	if (bf->bf_error == NULL)
+		bf->bf_image = vm_image_create();
+}
+
+static struct batch_file *
+batch_file(const char *path, enum bf_kind kind)
+{
+	struct batch_file *bf;
+
+	for (bf = bt_files; bf != NULL; bf = bf->bf_next)
+		if (bf->bf_kind == kind && strcmp(bf->bf_path, path) == 0)
+			return (bf);
+
+	bf = calloc(1, sizeof(*bf));
+	ASSERT(bf != NULL, "calloc");
+	bf->bf_path = strdup(path);
+	ASSERT(bf->bf_path != NULL, "strdup");
+	bf->bf_kind = kind;
+	batch_load(bf);
+	bf->bf_next = bt_files;
+	bt_files = bf;
+	return (bf);
+}
+
+static bool
+batch_number(const char *s, uint64_t max, uint64_t *v)
+{
+	char *end;
+
+	errno = 0;
+	*v = strtoull(s, &end, 0);
+	return (end != s && *end == 0 && errno == 0 && *v <= max &&
+	    *s != '-');
+}
+
+/* Parse one manifest line into 'bj'.  Returns NULL or an error. */
+static const char *
+batch_parse(char *line, struct batch_job *bj)
+{
+	char *tok, *val, *save;
+	uint64_t v;
+
+	bj->bj_r7 = -1;
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+	    tok = strtok_r(NULL, " \t\r\n", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL || val[1] == 0)
+			return ("expected key=value");
+		*val++ = 0;
+
+		if (strcmp(tok, "rom") == 0 || strcmp(tok, "save") == 0) {
+			if (bj->bj_machine != NULL)
+				return ("more than one rom= or save=");
+			bj->bj_machine = batch_file(val,
+			    tok[0] == 'r' ? BF_ROM : BF_SAVE);
+		} else if (strcmp(tok, "input") == 0)
+			bj->bj_input = batch_file(val, BF_INPUT);
+		else if (strcmp(tok, "r7") == 0) {
+			if (!batch_number(val, INT16_MAX, &v))
+				return ("bad r7");
+			bj->bj_r7 = v;
+		} else if (strcmp(tok, "limit") == 0) {
+			if (!batch_number(val, UINT64_MAX, &v))
+				return ("bad limit");
+			bj->bj_limit = v;
+		} else if (strcmp(tok, "name") == 0) {
+			free(bj->bj_name);
+			bj->bj_name = strdup(val);
+			ASSERT(bj->bj_name != NULL, "strdup");
+		} else
+			return ("unknown key");
+	}
+	if (bj->bj_machine == NULL)
+		return ("no rom= or save=");
+	return (NULL);
+}
+
+static bool
+batch_manifest(const char *path)
+{
+	struct batch_job *bj;
+	const char *error;
+	size_t alloc, cap;
+	unsigned lineno;
+	char *line, *p;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (false);
+	}
+	line = NULL;
+	cap = 0;
+	alloc = 0;
+	lineno = 0;
+	while (getline(&line, &cap, f) != -1) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+			continue;
+
+		if (bt_njobs == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			bt_jobs = realloc(bt_jobs, alloc * sizeof(*bt_jobs));
+			ASSERT(bt_jobs != NULL, "realloc");
+		}
+		bj = &bt_jobs[bt_njobs];
+		memset(bj, 0, sizeof(*bj));
+		bj->bj_line = lineno;
+		error = batch_parse(p, bj);
+		if (error != NULL) {
+			fprintf(stderr, "%s:%u: %s\n", path, lineno, error);
+			free(bj->bj_name);
+			free(line);
+			fclose(f);
+			return (false);
+		}
+		bt_njobs++;
+	}
+	free(line);
+	fclose(f);
+	return (true);
+}
+
+static void
+batch_push(struct batch_worker *bw, struct batch_job *bj)
+{
+	size_t len;
+
+	pthread_mutex_lock(&bw->bw_lock);
+	bw->bw_q[(bw->bw_head + bw->bw_len) % bt_njobs] = bj;
+	len = ++bw->bw_len;
+	pthread_mutex_unlock(&bw->bw_lock);
+	atomic_fetch_add(&bt_queued, 1);
+
+	/* Its owner runs one of them next; the other is up for grabs. */
+	if (len > 1) {
+		pthread_mutex_lock(&bt_idle_lock);
+		pthread_cond_signal(&bt_idle_cv);
+		pthread_mutex_unlock(&bt_idle_lock);
+	}
+}
+
+/* Take from the front ('front') or, stealing, the back of bw's deque. */
+static struct batch_job *
+batch_take(struct batch_worker *bw, bool front)
+{
+	struct batch_job *bj;
+
+	bj = NULL;
+	pthread_mutex_lock(&bw->bw_lock);
+	if (bw->bw_len > 0) {
+		if (front) {
+			bj = bw->bw_q[bw->bw_head];
+			bw->bw_head = (bw->bw_head + 1) % bt_njobs;
+		} else
+			bj = bw->bw_q[(bw->bw_head + bw->bw_len - 1) %
+			    bt_njobs];
+		bw->bw_len--;
+	}
+	pthread_mutex_unlock(&bw->bw_lock);
+	if (bj != NULL)
+		atomic_fetch_sub(&bt_queued, 1);
+	return (bj);
+}
+
+static struct batch_job *
+batch_next(struct batch_worker *bw)
+{
+	struct batch_job *bj;
+	unsigned i;
+
+	bj = batch_take(bw, true);
+	for (i = 1; bj == NULL && i < bt_nworkers; i++) {
+		bj = batch_take(&bt_workers[(bw->bw_id + i) % bt_nworkers],
+		    false);
+		if (bj != NULL)
+			bj->bj_steals++;
+	}
+	return (bj);
+}
+
+static void
+batch_idle(void)
+{
+
+	pthread_mutex_lock(&bt_idle_lock);
+	if (atomic_load(&bt_queued) == 0 && atomic_load(&bt_left) > 0 &&
+	    !ctrlc)
+		pthread_cond_wait(&bt_idle_cv, &bt_idle_lock);
+	pthread_mutex_unlock(&bt_idle_lock);
+}
+
+static void
+batch_begin(struct batch_job *bj)
+{
+	struct batch_file *in;
+
+	bj->bj_vm = vm_create(bj->bj_machine->bf_image);
+	vm_switch(bj->bj_vm);
+	if (bj->bj_r7 >= 0)
+		regs[7] = bj->bj_r7;
+	bj->bj_begin = insns;
+	vm_switch(NULL);
+
+	in = bj->bj_input;
+	if (in != NULL && in->bf_len > 0)
+		bj->bj_in = fmemopen(in->bf_data, in->bf_len, "r");
+	else
+		bj->bj_in = fopen("/dev/null", "r");
+	ASSERT(bj->bj_in != NULL, "fmemopen: %s", strerror(errno));
+	bj->bj_out = open_memstream(&bj->bj_output, &bj->bj_outlen);
+	ASSERT(bj->bj_out != NULL, "open_memstream: %s", strerror(errno));
+}
+
+/* Run the installed machine up to 'end'.  False if the guest faulted. */
+static bool
+batch_exec(uint64_t end)
+{
+
+	if (setjmp(bt_fault) != 0)
+		return (false);
+	while (insns < end && !halted && !in_blocked)
+		emulate1();
+	return (true);
+}
+
+/* Give 'bj' one turn.  Returns true if it is done. */
+static bool
+batch_turn(struct batch_job *bj)
+{
+	uint64_t t0, end;
+	bool ok;
+
+	t0 = now();
+	if (bj->bj_vm == NULL) {
+		bj->bj_first = t0;
+		batch_begin(bj);
+	}
+
+	vm_switch(bj->bj_vm);
+	infile = bj->bj_in;
+	outfile = bj->bj_out;
+	end = insns + BATCH_SLICE;
+	if (bj->bj_limit)
+		end = min(end, bj->bj_begin + bj->bj_limit);
+	ok = batch_exec(end);
+
+	if (!ok)
+		bj->bj_status = BJ_FAULT;
+	else if (halted)
+		bj->bj_status = BJ_HALTED;
+	else if (in_blocked)
+		bj->bj_status = BJ_INPUT;
+	else if (bj->bj_limit && insns - bj->bj_begin >= bj->bj_limit)
+		bj->bj_status = BJ_LIMIT;
+	bj->bj_insns = insns - bj->bj_begin;
+	bj->bj_pc = pc;
+	infile = outfile = NULL;
+	vm_switch(NULL);
+
+	bj->bj_slices++;
+	bj->bj_run += now() - t0;
+	if (bj->bj_status == BJ_RUNNING)
+		return (false);
+
+	fclose(bj->bj_in);
+	fclose(bj->bj_out);
+	bj->bj_in = bj->bj_out = NULL;
+	vm_destroy(bj->bj_vm);
+	bj->bj_vm = NULL;
+	bj->bj_done = now();
+	return (true);
+}
+
+static void *
+batch_main(void *arg)
+{
+	struct batch_worker *bw = arg;
+	struct batch_job *bj;
+
+	guest_fault = &bt_fault;
+	/* Out of input: park rather than complain, and finish the job. */
+	in_yield = true;
+
+	while (atomic_load(&bt_left) > 0 && !ctrlc) {
+		bj = batch_next(bw);
+		if (bj == NULL) {
+			batch_idle();
+			continue;
+		}
+		if (!batch_turn(bj)) {
+			batch_push(bw, bj);
+			continue;
+		}
+		if (atomic_fetch_sub(&bt_left, 1) == 1) {
+			pthread_mutex_lock(&bt_idle_lock);
+			pthread_cond_broadcast(&bt_idle_cv);
+			pthread_mutex_unlock(&bt_idle_lock);
+		}
+	}
+
+	/* Idle workers sleep through ^C; wake them to see it. */
+	if (ctrlc) {
+		pthread_mutex_lock(&bt_idle_lock);
+		pthread_cond_broadcast(&bt_idle_cv);
+		pthread_mutex_unlock(&bt_idle_lock);
+	}
+	return (NULL);
+}
+
+static void
+batch_jstr(const char *s, size_t len)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+		case '"':
+		case '\\':
+			printf("\\%c", s[i]);
+			break;
+		case '\n':
+			printf("\\n");
+			break;
+		case '\t':
+			printf("\\t");
+			break;
+		default:
+			if ((unsigned char)s[i] < 0x20 ||
+			    (unsigned char)s[i] >= 0x7f)
+				printf("\\u%04x", (uns)(unsigned char)s[i]);
+			else
+				putchar(s[i]);
+			break;
+		}
+	}
+	putchar('"');
+}
+
+static void
+batch_report(uint64_t wall)
+{
+	struct batch_job *bj;
+	uint64_t total;
+	char num[16];
+	size_t i;
+
+	total = 0;
+	for (i = 0; i < bt_njobs; i++)
+		total += bt_jobs[i].bj_insns;
+	printf("{\"threads\": %u, \"slice\": %u, \"wall_us\": %ju, "
+	    "\"insns\": %ju, \"ips\": %ju, \"jobs\": [\n", bt_nworkers,
+	    (uns)BATCH_SLICE, (uintmax_t)wall, (uintmax_t)total,
+	    (uintmax_t)(wall ? total * sec / wall : 0));
+
+	for (i = 0; i < bt_njobs; i++) {
+		bj = &bt_jobs[i];
+		printf("  {\"name\": ");
+		if (bj->bj_name != NULL)
+			batch_jstr(bj->bj_name, strlen(bj->bj_name));
+		else {
+			snprintf(num, sizeof(num), "%u", bj->bj_line);
+			batch_jstr(num, strlen(num));
+		}
+		printf(", \"%s\": ", bj->bj_machine->bf_kind == BF_SAVE ?
+		    "save" : "rom");
+		batch_jstr(bj->bj_machine->bf_path,
+		    strlen(bj->bj_machine->bf_path));
+		printf(", \"status\": \"%s\"", bj_statusname[bj->bj_status]);
+		if (bj->bj_error != NULL) {
+			printf(", \"error\": ");
+			batch_jstr(bj->bj_error, strlen(bj->bj_error));
+		}
+		printf(", \"insns\": %ju, \"pc\": %u, \"turns\": %u, "
+		    "\"steals\": %u, \"run_us\": %ju, \"wait_us\": %ju, "
+		    "\"latency_us\": %ju, \"output\": ",
+		    (uintmax_t)bj->bj_insns, (uns)bj->bj_pc, bj->bj_slices,
+		    bj->bj_steals, (uintmax_t)bj->bj_run,
+		    (uintmax_t)(bj->bj_first ? bj->bj_first - bt_t0 : 0),
+		    (uintmax_t)(bj->bj_done ? bj->bj_done - bt_t0 : 0));
+		batch_jstr(bj->bj_output != NULL ? bj->bj_output : "",
+		    bj->bj_outlen);
+		printf("}%s\n", i + 1 < bt_njobs ? "," : "");
+	}
+	printf("]}\n");
+}
+
+/*
+ * Run the jobs in manifest 'path' on 'nthreads' workers and print the report.
+ * Returns false if the manifest is bad or any job failed to load or faulted.
+ */
+bool
+batch_run(const char *path, unsigned nthreads)
+{
+	struct batch_worker *bw;
+	struct batch_file *bf;
+	struct batch_job *bj;
+	uint64_t t;
+	size_t i;
+	bool ok;
+	int rc;
+
+	if (!batch_manifest(path))
+		return (false);
+
+	bt_nworkers = nthreads;
+	bt_workers = calloc(nthreads, sizeof(*bt_workers));
+	ASSERT(bt_workers != NULL, "calloc");
+	for (i = 0; i < nthreads; i++) {
+		bw = &bt_workers[i];
+		bw->bw_id = i;
+		pthread_mutex_init(&bw->bw_lock, NULL);
+		bw->bw_q = calloc(bt_njobs ? bt_njobs : 1, sizeof(*bw->bw_q));
+		ASSERT(bw->bw_q != NULL, "calloc");
+	}
+
+	/* Deal the jobs out in manifest order. */
+	atomic_store(&bt_left, 0);
+	atomic_store(&bt_queued, 0);
+	for (i = 0; i < bt_njobs; i++) {
+		bj = &bt_jobs[i];
+		bj->bj_error = bj->bj_machine->bf_error;
+		if (bj->bj_error == NULL && bj->bj_input != NULL)
+			bj->bj_error = bj->bj_input->bf_error;
+		if (bj->bj_error != NULL) {
+			bj->bj_status = BJ_ERROR;
+			continue;
+		}
+		bw = &bt_workers[atomic_load(&bt_left) % nthreads];
+		bw->bw_q[bw->bw_len++] = bj;
+		atomic_fetch_add(&bt_left, 1);
+		atomic_fetch_add(&bt_queued, 1);
+	}
+
+	bt_t0 = now();
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_create(&bt_workers[i].bw_thread, NULL, batch_main,
+		    &bt_workers[i]);
+		ASSERT(rc == 0, "pthread_create: %s", strerror(rc));
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(bt_workers[i].bw_thread, NULL);
+	t = now() - bt_t0;
+
+	/* Interrupted jobs report what they printed so far. */
+	for (i = 0; i < bt_njobs; i++) {
+		bj = &bt_jobs[i];
+		if (bj->bj_vm == NULL)
+			continue;
+		fclose(bj->bj_in);
+		fclose(bj->bj_out);
+		vm_destroy(bj->bj_vm);
+		bj->bj_vm = NULL;
+	}
+	batch_report(t);
+
+	ok = true;
+	for (i = 0; i < bt_njobs; i++) {
+		bj = &bt_jobs[i];
+		if (bj->bj_status == BJ_ERROR || bj->bj_status == BJ_FAULT ||
+		    bj->bj_status == BJ_RUNNING)
+			ok = false;
+		free(bj->bj_output);
+		free(bj->bj_name);
+	}
+	free(bt_jobs);
+	bt_jobs = NULL;
+	bt_njobs = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&bt_workers[i].bw_lock);
+		free(bt_workers[i].bw_q);
+	}
+	free(bt_workers);
+	bt_workers = NULL;
+	while ((bf = bt_files) != NULL) {
+		bt_files = bf->bf_next;
+		vm_image_destroy(bf->bf_image);
+		free(bf->bf_data);
+		free(bf->bf_path);
+		free(bf);
+	}
+	return (ok);
+}
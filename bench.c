@@ -0,0 +1,535 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * synacor-bench: run a corpus of synthetic workload ROMs under the emulator
+ * and report performance as JSON.
+ *
+ * The ROMs are generated here, so the corpus is versioned with the code that
+ * runs it.  Each workload runs once to warm up and then -r times under every
+ * engine (a name plus extra emulator flags); the harness times each run with
+ * CLOCK_MONOTONIC and takes peak RSS from wait4().  The instruction count
+ * comes from the emulator's own "Total:" line.  With -b, results are compared
+ * against an earlier run's JSON and the exit status is 2 if any workload's
+ * median ips dropped by more than -t percent.
+ */
+
+#define	MEMWORDS	32768
+#define	R(n)		(32768 + (n))
+#define	MAXENGINES	8
+#define	MAXREPS		64
+
+enum { HALT, SET, PUSH, POP, EQ, GT, JMP, JT, JF, ADD, MULT, MOD, AND, OR,
+    NOT, RMEM, WMEM, CALL, RET, OUT, IN, NOOP };
+
+struct rom {
+	uint16_t	 w[MEMWORDS];
+	unsigned	 n;		/* Next address */
+};
+
+struct engine {
+	const char	*name;
+	char		*argv[16];	/* Extra emulator flags */
+};
+
+struct result {
+	const char	*workload;
+	const char	*engine;
+	uint64_t	 insns;
+	double		 ips[MAXREPS];
+	double		 wall[MAXREPS];	/* ms */
+	long		 maxrss;	/* KiB */
+};
+
+static unsigned		 scale = 1;
+
+static void
+emit(struct rom *r, unsigned n, ...)
+{
+	va_list ap;
+	unsigned i;
+
+	va_start(ap, n);
+	for (i = 0; i < n; i++)
+		r->w[r->n++] = va_arg(ap, unsigned);
+	va_end(ap);
+}
+
+/* Outer iterations for a workload: 'base' times the scale. */
+static unsigned
+passes(unsigned base)
+{
+
+	if ((uint64_t)base * scale >= 32768)
+		errx(1, "scale %u too large", scale);
+	return (base * scale);
+}
+
+/* Count r7 down around the code at 'top'; falls through to halt. */
+static void
+outer_loop(struct rom *r, unsigned top)
+{
+
+	emit(r, 4, ADD, R(7), R(7), 32767);
+	emit(r, 3, JT, R(7), top);
+	emit(r, 1, HALT);
+}
+
+/* Register arithmetic: 32768 inner iterations of eight ALU ops per pass. */
+static void
+gen_arith(struct rom *r)
+{
+	unsigned top, inner;
+
+	emit(r, 3, SET, R(7), passes(80));
+	top = r->n;
+	emit(r, 3, SET, R(6), 0);
+	inner = r->n;
+	emit(r, 4, ADD, R(1), R(1), R(6));
+	emit(r, 4, MULT, R(2), R(1), 3);
+	emit(r, 4, MOD, R(3), R(2), 1234);
+	emit(r, 4, AND, R(4), R(3), R(1));
+	emit(r, 4, OR, R(5), R(4), R(2));
+	emit(r, 3, NOT, R(5), R(5));
+	emit(r, 4, ADD, R(6), R(6), 1);
+	emit(r, 3, JT, R(6), inner);
+	outer_loop(r, top);
+}
+
+/* Naive recursive Fibonacci: call, ret, push and pop heavy. */
+static void
+gen_recurse(struct rom *r)
+{
+	unsigned fib, rec, top;
+
+	emit(r, 2, JMP, 0);		/* Patched to main */
+	fib = r->n;
+	emit(r, 4, GT, R(2), R(0), 1);
+	rec = r->n + 3 + 3 + 1;
+	emit(r, 3, JT, R(2), rec);
+	emit(r, 3, SET, R(1), R(0));
+	emit(r, 1, RET);
+	emit(r, 2, PUSH, R(0));
+	emit(r, 4, ADD, R(0), R(0), 32767);
+	emit(r, 2, CALL, fib);
+	emit(r, 2, PUSH, R(1));
+	emit(r, 4, ADD, R(0), R(0), 32767);
+	emit(r, 2, CALL, fib);
+	emit(r, 2, POP, R(2));
+	emit(r, 4, ADD, R(1), R(1), R(2));
+	emit(r, 2, POP, R(0));
+	emit(r, 1, RET);
+
+	r->w[1] = r->n;
+	emit(r, 3, SET, R(7), passes(48));
+	top = r->n;
+	emit(r, 3, SET, R(0), 22);
+	emit(r, 2, CALL, fib);
+	outer_loop(r, top);
+}
+
+/* rmem/wmem over a 4096-word array. */
+static void
+gen_memwalk(struct rom *r)
+{
+	unsigned top, loop;
+
+	emit(r, 3, SET, R(7), passes(700));
+	top = r->n;
+	emit(r, 3, SET, R(0), 0);
+	loop = r->n;
+	emit(r, 4, ADD, R(1), R(0), 16384);
+	emit(r, 3, RMEM, R(2), R(1));
+	emit(r, 4, ADD, R(2), R(2), R(0));
+	emit(r, 3, WMEM, R(1), R(2));
+	emit(r, 4, ADD, R(0), R(0), 1);
+	emit(r, 4, EQ, R(3), R(0), 4096);
+	emit(r, 3, JF, R(3), loop);
+	outer_loop(r, top);
+}
+
+/* Every iteration rewrites an operand of the instruction it runs next. */
+static void
+gen_selfmod(struct rom *r)
+{
+	unsigned top, loop, patch;
+
+	emit(r, 3, SET, R(7), passes(120));
+	top = r->n;
+	emit(r, 3, SET, R(6), 0);
+	loop = r->n;
+	emit(r, 4, ADD, R(1), R(1), 1);
+	patch = r->n + 3;
+	emit(r, 3, WMEM, patch + 3, R(1));
+	emit(r, 4, ADD, R(2), R(2), 0);
+	emit(r, 4, ADD, R(6), R(6), 1);
+	emit(r, 3, JT, R(6), loop);
+	outer_loop(r, top);
+}
+
+/* Text output: NUL-terminated text printed with rmem and out. */
+static void
+gen_output(struct rom *r)
+{
+	static const char line[] =
+	    "You are standing in a maze of twisty little passages.\n";
+	unsigned top, loop, done, str, i, n;
+
+	str = 30000;
+	for (n = 0; n < 8; n++)
+		for (i = 0; line[i] != 0; i++)
+			r->w[str + n * (sizeof(line) - 1) + i] = line[i];
+
+	emit(r, 3, SET, R(7), passes(8000));
+	top = r->n;
+	emit(r, 3, SET, R(0), str);
+	loop = r->n;
+	emit(r, 3, RMEM, R(1), R(0));
+	done = r->n + 3 + 2 + 4 + 2;
+	emit(r, 3, JF, R(1), done);
+	emit(r, 2, OUT, R(1));
+	emit(r, 4, ADD, R(0), R(0), 1);
+	emit(r, 2, JMP, loop);
+	outer_loop(r, top);
+}
+
+/* Process start to halt, for launch latency. */
+static void
+gen_startup(struct rom *r)
+{
+
+	emit(r, 1, HALT);
+}
+
+static const struct workload {
+	const char	*name;
+	void		(*gen)(struct rom *);
+} workloads[] = {
+	{ "arith", gen_arith },
+	{ "recurse", gen_recurse },
+	{ "memwalk", gen_memwalk },
+	{ "selfmod", gen_selfmod },
+	{ "output", gen_output },
+	{ "startup", gen_startup },
+};
+
+static double
+mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+/* Run the emulator once; returns wall ms, fills instructions and RSS. */
+static double
+run1(const char *emu, const struct engine *e, const char *rom,
+    uint64_t *insns, long *maxrss)
+{
+	char *argv[32], buf[65536], tail[256], *p;
+	struct rusage ru;
+	size_t tl, n;
+	ssize_t rd;
+	double t0, t1;
+	pid_t pid;
+	int pfd[2], st, dn;
+	unsigned i, j;
+
+	if (pipe(pfd) != 0)
+		err(1, "pipe");
+
+	j = 0;
+	argv[j++] = (char *)emu;
+	argv[j++] = "-n";
+	for (i = 0; e->argv[i] != NULL; i++)
+		argv[j++] = e->argv[i];
+	argv[j++] = (char *)rom;
+	argv[j] = NULL;
+
+	t0 = mono();
+	pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0) {
+		dn = open("/dev/null", O_RDWR);
+		dup2(dn, STDIN_FILENO);
+		dup2(dn, STDERR_FILENO);
+		dup2(pfd[1], STDOUT_FILENO);
+		close(pfd[0]);
+		execv(emu, argv);
+		_exit(127);
+	}
+	close(pfd[1]);
+
+	/* Keep the end of the output, where the Total: line is. */
+	tl = 0;
+	while ((rd = read(pfd[0], buf, sizeof(buf))) > 0) {
+		n = (size_t)rd;
+		if (n >= sizeof(tail) - 1) {
+			memcpy(tail, buf + n - (sizeof(tail) - 1),
+			    sizeof(tail) - 1);
+			tl = sizeof(tail) - 1;
+		} else {
+			if (tl + n > sizeof(tail) - 1) {
+				memmove(tail, tail + tl + n - (sizeof(tail) - 1),
+				    sizeof(tail) - 1 - n);
+				tl = sizeof(tail) - 1 - n;
+			}
+			memcpy(tail + tl, buf, n);
+			tl += n;
+		}
+	}
+	close(pfd[0]);
+	if (wait4(pid, &st, 0, &ru) != pid)
+		err(1, "wait4");
+	t1 = mono();
+	tail[tl] = 0;
+
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0)
+		errx(1, "%s failed on %s (status %#x)", emu, rom, st);
+	p = strstr(tail, "(Total: ");
+	if (p == NULL)
+		errx(1, "%s printed no instruction count for %s", emu, rom);
+	*insns = strtoull(p + strlen("(Total: "), NULL, 10);
+	*maxrss = ru.ru_maxrss;
+	return (t1 - t0);
+}
+
+static int
+dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static double
+median(double *v, unsigned n)
+{
+
+	qsort(v, n, sizeof(*v), dcmp);
+	return (n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2);
+}
+
+static void
+print_result(FILE *f, struct result *res, unsigned reps, bool last)
+{
+	double ips, wall;
+
+	ips = median(res->ips, reps);
+	wall = median(res->wall, reps);
+	fprintf(f, "    {\"workload\": \"%s\", \"engine\": \"%s\", "
+	    "\"insns\": %" PRIu64 ", \"ips\": %.0f, \"ips_min\": %.0f, "
+	    "\"ips_max\": %.0f, \"wall_ms\": %.3f, \"wall_ms_min\": %.3f, "
+	    "\"wall_ms_max\": %.3f, \"maxrss_kb\": %ld}%s\n",
+	    res->workload, res->engine, res->insns, ips, res->ips[0],
+	    res->ips[reps - 1], wall, res->wall[0], res->wall[reps - 1],
+	    res->maxrss, last ? "" : ",");
+}
+
+/* Median ips recorded in 'baseline' for a workload and engine, or 0. */
+static double
+baseline_ips(const char *baseline, const char *workload, const char *engine)
+{
+	char line[1024], key[256];
+	FILE *f;
+	double ips;
+	char *p;
+
+	f = fopen(baseline, "r");
+	if (f == NULL)
+		err(1, "%s", baseline);
+	snprintf(key, sizeof(key), "\"workload\": \"%s\", \"engine\": \"%s\",",
+	    workload, engine);
+	ips = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strstr(line, key) == NULL)
+			continue;
+		p = strstr(line, "\"ips\": ");
+		if (p != NULL)
+			ips = strtod(p + strlen("\"ips\": "), NULL);
+		break;
+	}
+	fclose(f);
+	return (ips);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: synacor-bench [FLAGS] emulator\n"
+		"\n"
+		"  FLAGS:\n"
+		"    -b=BASELINE   Compare against an earlier JSON result\n"
+		"    -e=NAME[=FLAGS]\n"
+		"                  Add an engine: NAME, run with emulator FLAGS\n"
+		"                  (default: interp, no flags)\n"
+		"    -o=OUT        Write JSON to OUT instead of stdout\n"
+		"    -r=<N>        Timed repetitions per workload (default 5)\n"
+		"    -s=<N>        Scale workload lengths by N (default 1)\n"
+		"    -t=<PCT>      Regression threshold for -b (default 10)\n"
+		"    -w=NAME       Only run workload NAME\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct engine engines[MAXENGINES];
+	struct result res;
+	struct rom *r;
+	char dir[] = "/tmp/synacor-bench.XXXXXX", path[4096], *s, *tok;
+	const char *emu, *baseline, *only;
+	unsigned nengines, reps, w, e, k, total, done;
+	double threshold, base, ms, tmp;
+	uint64_t insns;
+	long rss;
+	FILE *out, *f;
+	bool regressed;
+	int opt;
+
+	nengines = 0;
+	reps = 5;
+	threshold = 10;
+	baseline = only = NULL;
+	out = stdout;
+	while ((opt = getopt(argc, argv, "b:e:o:r:s:t:w:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'e':
+			if (nengines == MAXENGINES)
+				usage();
+			memset(&engines[nengines], 0, sizeof(engines[0]));
+			s = strdup(optarg);
+			if (s == NULL)
+				err(1, "strdup");
+			engines[nengines].name = strsep(&s, "=");
+			k = 0;
+			while (s != NULL && (tok = strsep(&s, " ")) != NULL)
+				if (*tok != 0 && k < 15)
+					engines[nengines].argv[k++] = tok;
+			nengines++;
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			if (reps == 0 || reps > MAXREPS)
+				usage();
+			break;
+		case 's':
+			scale = atoi(optarg);
+			if (scale == 0)
+				usage();
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	emu = argv[optind];
+	if (nengines == 0) {
+		memset(&engines[0], 0, sizeof(engines[0]));
+		engines[0].name = "interp";
+		nengines = 1;
+	}
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		err(1, "malloc");
+
+	total = 0;
+	for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+		if (only == NULL || strcmp(only, workloads[w].name) == 0)
+			total += nengines;
+
+	fprintf(out, "{\"emulator\": \"%s\", \"reps\": %u, \"scale\": %u, "
+	    "\"results\": [\n", emu, reps, scale);
+	regressed = false;
+	done = 0;
+	for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		if (only != NULL && strcmp(only, workloads[w].name) != 0)
+			continue;
+
+		memset(r, 0, sizeof(*r));
+		workloads[w].gen(r);
+		snprintf(path, sizeof(path), "%s/%s.bin", dir,
+		    workloads[w].name);
+		f = fopen(path, "wb");
+		if (f == NULL || fwrite(r->w, sizeof(r->w), 1, f) != 1 ||
+		    fclose(f) != 0)
+			err(1, "%s", path);
+
+		for (e = 0; e < nengines; e++) {
+			memset(&res, 0, sizeof(res));
+			res.workload = workloads[w].name;
+			res.engine = engines[e].name;
+
+			(void)run1(emu, &engines[e], path, &insns, &rss);
+			for (k = 0; k < reps; k++) {
+				ms = run1(emu, &engines[e], path, &insns, &rss);
+				res.insns = insns;
+				res.wall[k] = ms;
+				res.ips[k] = insns / (ms / 1e3);
+				if (rss > res.maxrss)
+					res.maxrss = rss;
+			}
+			/* Sorted, so [0] and [reps - 1] are the extremes. */
+			tmp = median(res.ips, reps);
+			print_result(out, &res, reps, ++done == total);
+
+			if (baseline == NULL)
+				continue;
+			base = baseline_ips(baseline, res.workload,
+			    res.engine);
+			if (base == 0)
+				continue;
+			fprintf(stderr, "%-8s %-8s %14.0f ips, baseline %14.0f: "
+			    "%+6.1f%%\n", res.workload, res.engine, tmp, base,
+			    100 * (tmp - base) / base);
+			if (tmp < base * (1 - threshold / 100))
+				regressed = true;
+		}
+		unlink(path);
+	}
+	fprintf(out, "]}\n");
+	if (out != stdout && fclose(out) != 0)
+		err(1, "close");
+	rmdir(dir);
+	free(r);
+
+	if (regressed) {
+		fprintf(stderr, "Regression beyond %.1f%%.\n", threshold);
+		return (2);
+	}
+	return (0);
+}
@@ -0,0 +1,118 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static unsigned
+asm_into_memory(const char *src, size_t *nwords)
+{
+
+	return (assemble(src, "test.s", memory, nwords));
+}
+
+START_TEST(test_asm_encoding)
+{
+	static const char src[] =
+	    "start:	mov r0, 'A'		; comment, with a comma\n"
+	    "	add r1, r0, -1\n"
+	    "	jmp end\n"
+	    "	.equ N, 3\n"
+	    "data:	.word N, data + 1, 0xffff, -2\n"
+	    "	.fill 2, 9\n"
+	    "	.stringz \"a;\\n\"\n"
+	    "end:	halt\n"
+	    "	.word 1, 2, 3, 4, 5, 6, 7, 8, 9, 10\n";
+	uint16_t expect[] = {
+		1, REG(0), 'A',
+		9, REG(1), REG(0), 32767,
+		6, 19,
+		3, 10, 0xffff, 0xfffe,
+		9, 9,
+		'a', ';', '\n', 0,
+		0,
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+	};
+	size_t nwords;
+
+	ck_assert_uint_eq(asm_into_memory(src, &nwords), 0);
+	ck_assert_uint_eq(nwords, ARRAYLEN(expect));
+	ck_assert_int_eq(memcmp(memory, expect, sizeof(expect)), 0);
+}
+END_TEST
+
+START_TEST(test_asm_macro)
+{
+	static const char src[] =
+	    ".macro countdown reg, n\n"
+	    "	mov \\reg, \\n\n"
+	    "top\\@:	add \\reg, \\reg, -1\n"
+	    "	jt \\reg, top\\@\n"
+	    ".endm\n"
+	    "	countdown r0, 5\n"
+	    "	countdown r1, 7\n"
+	    "	call sub\n"
+	    "	halt\n"
+	    "sub:	push r0\n"
+	    "	mov r2, 42\n"
+	    "	pop r0\n"
+	    "	ret\n";
+	size_t nwords;
+
+	ck_assert_uint_eq(asm_into_memory(src, &nwords), 0);
+	/* Each expansion gets its own loop label. */
+	ck_assert_uint_eq(memory[9], 3);
+	ck_assert_uint_eq(memory[11], REG(1));
+	ck_assert_uint_eq(memory[12], 7);
+	ck_assert_uint_eq(memory[19], 13);
+
+	while (!halted)
+		emulate1();
+	ck_assert_uint_eq(regs[0], 0);
+	ck_assert_uint_eq(regs[1], 0);
+	ck_assert_uint_eq(regs[2], 42);
+	ck_assert_uint_eq(insns, 2 * 1 + 5 * 2 + 7 * 2 + 1 + 4 + 1);
+}
+END_TEST
+
+START_TEST(test_asm_errors)
+{
+	static const char *bad[] = {
+		"	frob r0\n",
+		"	add r0, r1\n",
+		"	jmp nowhere\n",
+		"	mov r0, 40000\n",
+		"	mov r8, 1\n",
+		"x:	nop\nx:	nop\n",
+		".macro m a\n	nop\n",
+		"	.word 1 +\n",
+	};
+	size_t nwords;
+	unsigned i;
+
+	for (i = 0; i < ARRAYLEN(bad); i++)
+		ck_assert_uint_ne(asm_into_memory(bad[i], &nwords), 0);
+}
+END_TEST
+
+Suite *
+suite_asm(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("asm");
+
+	t = tcase_create("assemble");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_asm_encoding);
+	tcase_add_test(t, test_asm_macro);
+	tcase_add_test(t, test_asm_errors);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
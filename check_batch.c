@@ -0,0 +1,150 @@
+#include <check.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	REG(x)	(32768 + x)
+
+/* Echo one byte of input, then count r0 down from r7 and halt. */
+static uint16_t echo[] = {
+	20, REG(0),
+	19, REG(0),
+	1, REG(0), REG(7),
+	9, REG(0), REG(0), 32767,
+	7, REG(0), 7,
+	0,
+};
+
+static uint16_t fault[] = { 19, 'A', 99, };
+static uint16_t mod0[] = { 11, REG(0), REG(0), 0, 0, };
+/* Load 40000 into r0 and use it as an address. */
+static uint16_t rmem[] = { 15, REG(0), 7, 15, REG(1), REG(0), 0, 40000, };
+static uint16_t wmem[] = { 15, REG(0), 7, 16, REG(0), 1, 0, 40000, };
+/* Jumps to a nop in the last word, then runs off the end. */
+static uint16_t overflow[MEMWORDS] = {
+	6, MEMWORDS - 1,
+	[MEMWORDS - 1] = 21,
+};
+
+#define	BDIR_TEMPLATE	"/tmp/check_batch.XXXXXX"
+
+static char	 bdir[] = BDIR_TEMPLATE;
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static void
+write_file(const char *name, const void *data, size_t len)
+{
+	char path[64];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", bdir, name);
+	f = fopen(path, "wb");
+	ck_assert_ptr_ne(f, NULL);
+	ck_assert_uint_eq(fwrite(data, 1, len, f), len);
+	fclose(f);
+}
+
+static bool
+run_manifest(const char *text, unsigned nthreads)
+{
+	char path[64];
+
+	write_file("manifest", text, strlen(text));
+	snprintf(path, sizeof(path), "%s/manifest", bdir);
+	return (batch_run(path, nthreads));
+}
+
+static void
+batch_setup(void)
+{
+
+	init();
+	strcpy(bdir, BDIR_TEMPLATE);
+	ck_assert_ptr_ne(mkdtemp(bdir), NULL);
+	write_file("echo.bin", echo, sizeof(echo));
+	write_file("fault.bin", fault, sizeof(fault));
+	write_file("mod0.bin", mod0, sizeof(mod0));
+	write_file("rmem.bin", rmem, sizeof(rmem));
+	write_file("wmem.bin", wmem, sizeof(wmem));
+	write_file("overflow.bin", overflow, sizeof(overflow));
+	write_file("x.in", "x", 1);
+}
+
+static void
+batch_teardown(void)
+{
+	char cmd[64];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", bdir);
+	ck_assert_int_eq(system(cmd), 0);
+	destroy();
+}
+
+START_TEST(test_batch_jobs)
+{
+	char text[1024];
+
+	/* More jobs than workers. */
+	snprintf(text, sizeof(text),
+	    "# comment\n"
+	    "rom=%1$s/echo.bin input=%1$s/x.in r7=3\n"
+	    "\n"
+	    "rom=%1$s/echo.bin input=%1$s/x.in r7=32767 name=long\n"
+	    "rom=%1$s/echo.bin r7=5 name=noinput\n"
+	    "rom=%1$s/echo.bin input=%1$s/x.in limit=10\n"
+	    "rom=%1$s/echo.bin input=%1$s/x.in r7=100\n",
+	    bdir);
+	ck_assert(run_manifest(text, 2));
+	/* The main thread's machine is left alone. */
+	ck_assert_uint_eq(insns, 0);
+}
+END_TEST
+
+START_TEST(test_batch_fail)
+{
+	char text[1024];
+
+	snprintf(text, sizeof(text),
+	    "rom=%1$s/fault.bin\n"
+	    "rom=%1$s/echo.bin input=%1$s/x.in\n", bdir);
+	ck_assert(!run_manifest(text, 2));
+
+	snprintf(text, sizeof(text), "rom=%s/missing.bin\n", bdir);
+	ck_assert(!run_manifest(text, 1));
+
+	/* Each loads, so the failure is the job's fault status. */
+	snprintf(text, sizeof(text), "rom=%s/mod0.bin\n", bdir);
+	ck_assert(!run_manifest(text, 1));
+	snprintf(text, sizeof(text), "rom=%s/overflow.bin\n", bdir);
+	ck_assert(!run_manifest(text, 1));
+	snprintf(text, sizeof(text), "rom=%s/rmem.bin\n", bdir);
+	ck_assert(!run_manifest(text, 1));
+	snprintf(text, sizeof(text), "rom=%s/wmem.bin\n", bdir);
+	ck_assert(!run_manifest(text, 1));
+
+	ck_assert(!run_manifest("input=x\n", 1));
+	ck_assert(!run_manifest("rom=a rom=b\n", 1));
+	ck_assert(!run_manifest("rom=a r7=32768\n", 1));
+	ck_assert(!run_manifest("rom=a bogus\n", 1));
+}
+END_TEST
+
+Suite *
+suite_batch(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("batch");
+
+	t = tcase_create("batch");
+	tcase_add_checked_fixture(t, batch_setup, batch_teardown);
+	tcase_add_test(t, test_batch_jobs);
+	tcase_add_test(t, test_batch_fail);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
@@ -0,0 +1,76 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+START_TEST(test_flight_ring)
+{
+	uint16_t code[] = {
+		1, REG(0), 1,
+		9, REG(0), REG(0), 1,
+		9, REG(0), REG(0), 1,
+		16, 100, REG(0),
+		21,
+		0,
+	};
+	const struct flight_rec *fr;
+
+	install_words(code, PC_START, sizeof(code));
+	flight_init(3);
+	ck_assert_uint_eq(flight_mask, 3);
+
+	while (!halted)
+		emulate1();
+	ck_assert_uint_eq(flight_pos, 6);
+
+	/* The oldest two have been overwritten. */
+	fr = &flight[2 & flight_mask];
+	ck_assert_uint_eq(fr->fr_insn, 2);
+	ck_assert_uint_eq(fr->fr_pc, 7);
+	ck_assert_uint_eq(fr->fr_instr, 9);
+	ck_assert_uint_eq(fr->fr_wb, 3);
+	fr = &flight[3 & flight_mask];
+	ck_assert_uint_eq(fr->fr_pc, 11);
+	ck_assert_uint_eq(fr->fr_args[0], 100);
+	ck_assert_uint_eq(fr->fr_args[1], REG(0));
+	fr = &flight[5 & flight_mask];
+	ck_assert_uint_eq(fr->fr_insn, 5);
+	ck_assert_uint_eq(fr->fr_instr, 0);
+}
+END_TEST
+
+START_TEST(test_flight_off)
+{
+	uint16_t code[] = { 21, 0, };
+
+	install_words(code, PC_START, sizeof(code));
+	flight_init(0);
+	emulate1();
+	emulate1();
+	ck_assert_ptr_eq(flight, NULL);
+	ck_assert_uint_eq(flight_pos, 0);
+}
+END_TEST
+
+Suite *
+suite_flight(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("flight");
+
+	t = tcase_create("ring");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_flight_ring);
+	tcase_add_test(t, test_flight_off);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
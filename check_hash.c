@@ -0,0 +1,98 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static uint16_t code[] = {
+	1, REG(0), 5,
+	2, REG(0),
+	2, 9,
+	16, 100, REG(0),
+	3, REG(1),
+	9, REG(2), REG(1), REG(0),
+	3, REG(1),
+	2, 4,
+	0,
+};
+
+START_TEST(test_hash_incremental)
+{
+	unsigned i;
+
+	install_words(code, PC_START, sizeof(code));
+	statehash_enable(true);
+
+	for (i = 0; !halted; i++) {
+		emulate1();
+		ck_assert_uint_eq(statehash_acc, statehash_compute());
+	}
+	ck_assert_uint_eq(i, 9);
+}
+END_TEST
+
+START_TEST(test_hash_distinct)
+{
+	uint64_t h0, h1;
+
+	install_words(code, PC_START, sizeof(code));
+	statehash_enable(true);
+
+	h0 = statehash();
+	emulate1();
+	h1 = statehash();
+	ck_assert_uint_ne(h0, h1);
+
+	/* Same registers and memory, different pc. */
+	pc = PC_START;
+	regs[0] = 0;
+	statehash_enable(true);
+	ck_assert_uint_eq(statehash(), h0);
+}
+END_TEST
+
+START_TEST(test_hash_snapshot)
+{
+	uint64_t id, h0;
+
+	install_words(code, PC_START, sizeof(code));
+	statehash_enable(true);
+	emulate1();
+	emulate1();
+
+	snap_init(2);
+	id = snap_capture();
+	h0 = statehash();
+
+	while (!halted)
+		emulate1();
+	ck_assert_uint_ne(statehash(), h0);
+
+	ck_assert(snap_restore(id));
+	ck_assert_uint_eq(statehash_acc, statehash_compute());
+	ck_assert_uint_eq(statehash(), h0);
+}
+END_TEST
+
+Suite *
+suite_hash(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("hash");
+
+	t = tcase_create("statehash");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_hash_incremental);
+	tcase_add_test(t, test_hash_distinct);
+	tcase_add_test(t, test_hash_snapshot);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
@@ -9,13 +9,6 @@
 /* Make it harder to forget to add tests to suite. */
 #pragma GCC diagnostic error "-Wunused-function"
 
-static void
-install_words(uint16_t *code, uint32_t addr, size_t sz)
-{
-
-	memcpy(&memory[addr], code, sz);
-}
-
 START_TEST(test_halt)
 {
 	uint16_t code[] = {
@@ -0,0 +1,136 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+/* r0 += r1 for r1 = 10..1, by rewriting the add's immediate each pass. */
+static uint16_t selfmod[] = {
+	1, REG(1), 10,
+	16, 9, REG(1),
+	9, REG(0), REG(0), 0,
+	9, REG(1), REG(1), 32767,
+	7, REG(1), 3,
+	0,
+};
+
+START_TEST(test_dcache_selfmod)
+{
+
+	install_words(selfmod, PC_START, sizeof(selfmod));
+	dcache_on = true;
+	while (!halted)
+		emulate1_cached();
+	dcache_on = false;
+
+	ck_assert_uint_eq(regs[0], 55);
+	ck_assert_uint_eq(regs[1], 0);
+	ck_assert_uint_eq(memory[9], 1);
+	ck_assert_uint_eq(insns, 1 + 10 * 4 + 1);
+}
+END_TEST
+
+START_TEST(test_dcache_switch)
+{
+	uint16_t code[] = { 9, REG(0), REG(0), 1, 0, };
+	struct vm_image *vi;
+	struct vm *vm;
+
+	install_words(code, PC_START, sizeof(code));
+	vi = vm_image_create();
+	dcache_on = true;
+	emulate1_cached();
+	ck_assert_uint_eq(regs[0], 1);
+
+	/* Same address, different machine and code: not a stale decode. */
+	vm = vm_create(vi);
+	vm_switch(vm);
+	memory[3] = 5;
+	emulate1_cached();
+	ck_assert_uint_eq(regs[0], 5);
+	vm_switch(NULL);
+
+	/*
+	 * Switching back keeps this machine's decodes: an edit that skips
+	 * dcache_inval() isn't seen.
+	 */
+	pc = 0;
+	memory[3] = 7;
+	emulate1_cached();
+	ck_assert_uint_eq(regs[0], 2);
+	dcache_on = false;
+
+	vm_destroy(vm);
+	vm_image_destroy(vi);
+}
+END_TEST
+
+/* The cached engine, but it skips the effect of instruction 6 (an add). */
+static void
+skip_one(void)
+{
+
+	if (insns == 6) {
+		pc += 4;
+		insns++;
+		return;
+	}
+	emulate1_cached();
+}
+
+START_TEST(test_lockstep_agree)
+{
+
+	install_words(selfmod, PC_START, sizeof(selfmod));
+	ck_assert(lockstep_run(3, NULL));
+
+	ck_assert(halted);
+	ck_assert_uint_eq(regs[0], 55);
+	ck_assert_uint_eq(insns, 1 + 10 * 4 + 1);
+	ck_assert(!lockstep_on);
+	ck_assert(!dcache_on);
+}
+END_TEST
+
+START_TEST(test_lockstep_diverge)
+{
+	uint64_t where;
+
+	install_words(selfmod, PC_START, sizeof(selfmod));
+	lockstep_engine[1] = skip_one;
+	ck_assert(!lockstep_run(3, &where));
+	lockstep_engine[1] = emulate1_cached;
+
+	ck_assert_uint_eq(where, 6);
+	ck_assert(!lockstep_on);
+	ck_assert(!dcache_on);
+}
+END_TEST
+
+Suite *
+suite_lockstep(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("lockstep");
+
+	t = tcase_create("dcache");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_dcache_selfmod);
+	tcase_add_test(t, test_dcache_switch);
+	suite_add_tcase(s, t);
+
+	t = tcase_create("lockstep");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_lockstep_agree);
+	tcase_add_test(t, test_lockstep_diverge);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
@@ -0,0 +1,151 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+#define	PC_WIN			17
+
+/* Print "OK" if the input starts with 'x' and r7 is 300. */
+static uint16_t gate[] = {
+	20, REG(0),
+	4, REG(1), REG(0), 'x',
+	8, REG(1), 16,
+	4, REG(1), REG(7), 300,
+	7, REG(1), PC_WIN,
+	0,
+	19, 'O',
+	19, 'K',
+	0,
+};
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static void
+search_setup(const char *input)
+{
+
+	memcpy(&memory[PC_START], gate, sizeof(gate));
+	infile = fmemopen((void *)input, strlen(input), "r");
+	ck_assert_ptr_ne(infile, NULL);
+}
+
+START_TEST(test_search_out)
+{
+
+	search_setup("x\n");
+	ck_assert(search_goal("out=OK"));
+	ck_assert(search_run(0, 1000, 4));
+	/* The main thread's machine is left alone. */
+	ck_assert_uint_eq(insns, 0);
+	ck_assert_uint_eq(regs[7], 0);
+}
+END_TEST
+
+START_TEST(test_search_pc)
+{
+
+	search_setup("x\n");
+	ck_assert(search_goal("pc=17"));
+	ck_assert(search_run(250, 350, 3));
+	/* Same input again: only the r7 range rules out a win. */
+	rewind(infile);
+	ck_assert(!search_run(301, 2000, 3));
+	rewind(infile);
+	ck_assert(search_run(299, 2000, 3));
+}
+END_TEST
+
+START_TEST(test_search_fail)
+{
+
+	/* Wrong input: no candidate can win. */
+	search_setup("y\n");
+	ck_assert(search_goal("out=OK"));
+	ck_assert(!search_run(0, 1000, 2));
+
+	ck_assert(!search_goal("pc="));
+	ck_assert(!search_goal("pc=40000"));
+	ck_assert(!search_goal("out="));
+	ck_assert(!search_goal("r7=1"));
+}
+END_TEST
+
+START_TEST(test_search_fault)
+{
+
+	/* Candidates that jump to an illegal opcode fail, not the process. */
+	search_setup("x\n");
+	memory[PC_WIN] = 99;
+	ck_assert(search_goal("out=OK"));
+	ck_assert(!search_run(0, 1000, 2));
+}
+END_TEST
+
+START_TEST(test_search_overflow)
+{
+
+	/* A winning candidate that runs off the end of memory fails. */
+	search_setup("x\n");
+	memory[PC_WIN] = 6;
+	memory[PC_WIN + 1] = MEMWORDS - 1;
+	memory[MEMWORDS - 1] = 21;
+	ck_assert(search_goal("out=OK"));
+	ck_assert(!search_run(0, 1000, 2));
+}
+END_TEST
+
+START_TEST(test_search_mod0)
+{
+
+	/* Likewise one that divides by zero. */
+	search_setup("x\n");
+	memory[PC_WIN] = 11;
+	memory[PC_WIN + 1] = REG(0);
+	memory[PC_WIN + 2] = REG(0);
+	memory[PC_WIN + 3] = 0;
+	ck_assert(search_goal("out=OK"));
+	ck_assert(!search_run(0, 1000, 2));
+}
+END_TEST
+
+START_TEST(test_search_rmem)
+{
+
+	/* Likewise one that reads past memory through a register. */
+	search_setup("x\n");
+	memory[PC_WIN] = 15;
+	memory[PC_WIN + 1] = REG(0);
+	memory[PC_WIN + 2] = PC_WIN + 6;
+	memory[PC_WIN + 3] = 15;
+	memory[PC_WIN + 4] = REG(1);
+	memory[PC_WIN + 5] = REG(0);
+	memory[PC_WIN + 6] = 40000;
+	ck_assert(search_goal("out=OK"));
+	ck_assert(!search_run(0, 1000, 2));
+}
+END_TEST
+
+Suite *
+suite_search(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("search");
+
+	t = tcase_create("search");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_search_out);
+	tcase_add_test(t, test_search_pc);
+	tcase_add_test(t, test_search_fail);
+	tcase_add_test(t, test_search_fault);
+	tcase_add_test(t, test_search_overflow);
+	tcase_add_test(t, test_search_mod0);
+	tcase_add_test(t, test_search_rmem);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
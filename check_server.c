@@ -0,0 +1,164 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <check.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+#define	SDIR_TEMPLATE	"/tmp/check_server.XXXXXX"
+
+/*
+ * Prompt, then read: 'x' divides by zero, 'y' runs off the end of memory
+ * (through a nop in the last word), 'z' reads through an address past the
+ * end, anything else is read past.
+ */
+static uint16_t prompt[] = {
+	19, '>',
+	20, REG(0),
+	4, REG(1), REG(0), 'x',
+	7, REG(1), 27,
+	4, REG(1), REG(0), 'y',
+	7, REG(1), 31,
+	4, REG(1), REG(0), 'z',
+	7, REG(1), 33,
+	6, 2,
+	11, REG(0), REG(0), 0,
+	6, MEMWORDS - 1,
+	15, REG(0), 39,
+	15, REG(1), REG(0),
+	40000,
+};
+
+static char	 sdir[] = SDIR_TEMPLATE;
+static char	 spath[64];
+static pid_t	 spid;
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static void
+server_ctrlc(int s)
+{
+
+	(void)s;
+	ctrlc = true;
+}
+
+static int
+server_connect(void)
+{
+	struct sockaddr_un sun;
+	unsigned i;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, spath);
+
+	/* The server may still be booting. */
+	for (i = 0; i < 500; i++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		ck_assert_int_ge(fd, 0);
+		if (connect(fd, (void *)&sun, sizeof(sun)) == 0)
+			return (fd);
+		close(fd);
+		usleep(10 * 1000);
+	}
+	ck_abort_msg("connect %s: %s", spath, strerror(errno));
+	return (-1);
+}
+
+/* Send 'input', then read until the server closes; returns the bytes read. */
+static size_t
+server_session(const char *input, char *out, size_t outsz)
+{
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	fd = server_connect();
+	ck_assert_int_eq(write(fd, input, strlen(input)), strlen(input));
+	for (len = 0; len < outsz; len += n) {
+		n = read(fd, &out[len], outsz - len);
+		ck_assert_int_ge(n, 0);
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	return (len);
+}
+
+static void
+server_setup(void)
+{
+
+	init();
+	strcpy(sdir, SDIR_TEMPLATE);
+	ck_assert_ptr_ne(mkdtemp(sdir), NULL);
+	snprintf(spath, sizeof(spath), "%s/sock", sdir);
+	install_words(prompt, PC_START, sizeof(prompt));
+	memory[MEMWORDS - 1] = 21;
+
+	fflush(stdout);
+	spid = fork();
+	ck_assert_int_ge(spid, 0);
+	if (spid == 0) {
+		signal(SIGINT, server_ctrlc);
+		server_run(spath, 0);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+static void
+server_teardown(void)
+{
+
+	rmdir(sdir);
+	destroy();
+}
+
+START_TEST(test_server_fault)
+{
+	char out[64];
+	int status;
+
+	/* Each faulting session ends on its own... */
+	ck_assert_uint_eq(server_session("x\n", out, sizeof(out)), 1);
+	ck_assert_int_eq(out[0], '>');
+	ck_assert_uint_eq(server_session("y\n", out, sizeof(out)), 1);
+	ck_assert_int_eq(out[0], '>');
+	ck_assert_uint_eq(server_session("z\n", out, sizeof(out)), 1);
+	ck_assert_int_eq(out[0], '>');
+
+	/* ...and the server still takes new ones. */
+	ck_assert_uint_eq(server_session("x\n", out, sizeof(out)), 1);
+
+	ck_assert_int_eq(kill(spid, SIGINT), 0);
+	ck_assert_int_eq(waitpid(spid, &status, 0), spid);
+	ck_assert(WIFEXITED(status));
+	ck_assert_int_eq(WEXITSTATUS(status), 0);
+}
+END_TEST
+
+Suite *
+suite_server(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("server");
+
+	t = tcase_create("server");
+	tcase_add_checked_fixture(t, server_setup, server_teardown);
+	tcase_add_test(t, test_server_fault);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
@@ -0,0 +1,119 @@
+#include <sys/mman.h>
+
+#include <check.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "shm.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+#define	SHM_NAME		"/synacor-check"
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static const struct shm_state *
+map_export(void)
+{
+	const struct shm_state *ss;
+	int fd;
+
+	fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	ck_assert_int_ge(fd, 0);
+	ss = mmap(NULL, sizeof(*ss), PROT_READ, MAP_SHARED, fd, 0);
+	ck_assert_ptr_ne(ss, MAP_FAILED);
+	close(fd);
+	return (ss);
+}
+
+START_TEST(test_shm_wmem)
+{
+	uint16_t code[] = {
+		1, REG(0), 7,
+		2, REG(0),
+		16, 100, REG(0),
+		9, REG(0), REG(0), 1,
+		0,
+	};
+	const struct shm_state *ss;
+	struct shm_state *snap;
+
+	install_words(code, PC_START, sizeof(code));
+	memory[100] = 0;
+	shm_export(SHM_NAME, 1000);
+	ss = map_export();
+	snap = malloc(sizeof(*snap));
+	ck_assert_ptr_ne(snap, NULL);
+
+	shm_snapshot(ss, snap);
+	ck_assert_uint_eq(snap->ss_magic, SHM_MAGIC);
+	ck_assert_uint_eq(snap->ss_seq % 2, 0);
+	ck_assert_uint_eq(snap->ss_insns, 0);
+	ck_assert_uint_eq(snap->ss_memory[0], 1);
+
+	/* set; push; wmem: published as of the instruction after wmem. */
+	emulate1();
+	emulate1();
+	emulate1();
+	shm_snapshot(ss, snap);
+	ck_assert_uint_eq(snap->ss_insns, 3);
+	ck_assert_uint_eq(snap->ss_pc, 8);
+	ck_assert_uint_eq(snap->ss_regs[0], 7);
+	ck_assert_uint_eq(snap->ss_stack_depth, 1);
+	ck_assert_uint_eq(snap->ss_stack[0], 7);
+	ck_assert_uint_eq(snap->ss_memory[100], 7);
+
+	/* add isn't published until the next boundary. */
+	emulate1();
+	shm_snapshot(ss, snap);
+	ck_assert_uint_eq(snap->ss_regs[0], 7);
+	shm_publish();
+	shm_snapshot(ss, snap);
+	ck_assert_uint_eq(snap->ss_insns, 4);
+	ck_assert_uint_eq(snap->ss_regs[0], 8);
+
+	free(snap);
+	munmap((void *)ss, sizeof(*ss));
+}
+END_TEST
+
+START_TEST(test_shm_close)
+{
+	uint16_t code[] = { 16, 200, 5, 0, };
+	uint16_t *before;
+	int fd;
+
+	install_words(code, PC_START, sizeof(code));
+	before = memory;
+	shm_export(SHM_NAME, 1000);
+	ck_assert_ptr_ne(memory, before);
+	emulate1();
+	shm_close();
+
+	/* Memory comes back, with the write; the object is gone. */
+	ck_assert_ptr_eq(memory, before);
+	ck_assert_uint_eq(memory[200], 5);
+	fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	ck_assert_int_lt(fd, 0);
+}
+END_TEST
+
+Suite *
+suite_shm(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("shm");
+
+	t = tcase_create("export");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_shm_wmem);
+	tcase_add_test(t, test_shm_close);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
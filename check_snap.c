@@ -0,0 +1,173 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+static void
+push_words(unsigned n, uint16_t base)
+{
+	unsigned i;
+
+	stack_alloc = 4096 / sizeof(*stack);
+	stack = realloc(stack, stack_alloc * sizeof(*stack));
+	ck_assert_ptr_ne(stack, NULL);
+	for (i = 0; i < n; i++)
+		stack[stack_depth++] = base + i;
+}
+
+START_TEST(test_snap_mem)
+{
+	uint16_t code[] = {
+		16, 100, 7,
+		16, 101, 8,
+		16, 100, 9,
+		0,
+	};
+	uint64_t id;
+
+	install_words(code, PC_START, sizeof(code));
+	memory[100] = 1;
+	memory[101] = 2;
+	regs[3] = 42;
+
+	snap_init(4);
+	id = snap_capture();
+
+	emulate1();
+	emulate1();
+	emulate1();
+	regs[3] = 0;
+	ck_assert_uint_eq(memory[100], 9);
+	ck_assert_uint_eq(memory[101], 8);
+
+	ck_assert(snap_restore(id));
+	ck_assert_uint_eq(pc, PC_START);
+	ck_assert_uint_eq(insns, 0);
+	ck_assert_uint_eq(regs[3], 42);
+	ck_assert_uint_eq(memory[100], 1);
+	ck_assert_uint_eq(memory[101], 2);
+
+	/* The same snapshot can be restored repeatedly. */
+	emulate1();
+	ck_assert_uint_eq(memory[100], 7);
+	ck_assert(snap_restore(id));
+	ck_assert_uint_eq(memory[100], 1);
+}
+END_TEST
+
+START_TEST(test_snap_chain)
+{
+	uint16_t code[] = {
+		16, 100, 7,
+		16, 101, 8,
+		16, 100, 9,
+		0,
+	};
+	uint64_t id1, id2, id3;
+
+	install_words(code, PC_START, sizeof(code));
+	memory[100] = 1;
+	memory[101] = 2;
+
+	snap_init(4);
+	id1 = snap_capture();
+	emulate1();
+	id2 = snap_capture();
+	emulate1();
+	id3 = snap_capture();
+	emulate1();
+
+	ck_assert(snap_restore(id2));
+	ck_assert_uint_eq(pc, 3);
+	ck_assert_uint_eq(memory[100], 7);
+	ck_assert_uint_eq(memory[101], 2);
+
+	/* Newer snapshots are discarded by a restore. */
+	ck_assert(!snap_restore(id3));
+
+	ck_assert(snap_restore(id1));
+	ck_assert_uint_eq(pc, PC_START);
+	ck_assert_uint_eq(memory[100], 1);
+	ck_assert_uint_eq(memory[101], 2);
+}
+END_TEST
+
+START_TEST(test_snap_stack)
+{
+	uint16_t code[] = {
+		3, REG(0),
+		3, REG(0),
+		2, 5,
+		2, 6,
+		2, 7,
+		0,
+	};
+	uint64_t id1, id2;
+
+	install_words(code, PC_START, sizeof(code));
+	push_words(3, 100);
+
+	snap_init(4);
+	id1 = snap_capture();
+	emulate1();
+	emulate1();
+	emulate1();
+	id2 = snap_capture();
+	emulate1();
+	emulate1();
+	ck_assert_uint_eq(stack_depth, 4);
+	ck_assert_uint_eq(stack[1], 5);
+
+	ck_assert(snap_restore(id2));
+	ck_assert_uint_eq(stack_depth, 2);
+	ck_assert_uint_eq(stack[0], 100);
+	ck_assert_uint_eq(stack[1], 5);
+
+	ck_assert(snap_restore(id1));
+	ck_assert_uint_eq(stack_depth, 3);
+	ck_assert_uint_eq(stack[0], 100);
+	ck_assert_uint_eq(stack[1], 101);
+	ck_assert_uint_eq(stack[2], 102);
+}
+END_TEST
+
+START_TEST(test_snap_ring)
+{
+	uint64_t ids[4];
+	unsigned i;
+
+	snap_init(2);
+	for (i = 0; i < ARRAYLEN(ids); i++)
+		ids[i] = snap_capture();
+
+	/* Only the two newest snapshots survive. */
+	ck_assert(!snap_restore(ids[0]));
+	ck_assert(!snap_restore(ids[1]));
+	ck_assert(snap_restore(ids[2]));
+}
+END_TEST
+
+Suite *
+suite_snap(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("snap");
+
+	t = tcase_create("ring");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_snap_mem);
+	tcase_add_test(t, test_snap_chain);
+	tcase_add_test(t, test_snap_stack);
+	tcase_add_test(t, test_snap_ring);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
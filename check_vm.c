@@ -0,0 +1,73 @@
+#include <check.h>
+
+#include "emu.h"
+#include "test.h"
+
+#define	PC_START		0
+#define	REG(x)	(32768 + x)
+
+/* Make it harder to forget to add tests to suite. */
+#pragma GCC diagnostic error "-Wunused-function"
+
+START_TEST(test_vm_cow)
+{
+	uint16_t code[] = {
+		16, 100, REG(0),
+		2, REG(0),
+		0,
+	};
+	struct vm_image *vi;
+	struct vm *a, *b;
+
+	install_words(code, PC_START, sizeof(code));
+	memory[100] = 1;
+	vi = vm_image_create();
+
+	a = vm_create(vi);
+	b = vm_create(vi);
+
+	vm_switch(a);
+	ck_assert_uint_eq(memory[100], 1);
+	regs[0] = 7;
+	emulate1();
+	emulate1();
+	ck_assert_uint_eq(memory[100], 7);
+	ck_assert_uint_eq(stack_depth, 1);
+
+	vm_switch(b);
+	ck_assert_uint_eq(pc, PC_START);
+	ck_assert_uint_eq(regs[0], 0);
+	ck_assert_uint_eq(memory[100], 1);
+	ck_assert_uint_eq(stack_depth, 0);
+
+	vm_switch(a);
+	ck_assert_uint_eq(pc, 5);
+	ck_assert_uint_eq(memory[100], 7);
+	ck_assert_uint_eq(stack[0], 7);
+
+	/* The default machine and the image are untouched. */
+	vm_switch(NULL);
+	ck_assert_uint_eq(memory[100], 1);
+	ck_assert_uint_eq(pc, PC_START);
+
+	vm_destroy(a);
+	vm_destroy(b);
+	vm_image_destroy(vi);
+}
+END_TEST
+
+Suite *
+suite_vm(void)
+{
+	Suite *s;
+	TCase *t;
+
+	s = suite_create("vm");
+
+	t = tcase_create("cow");
+	tcase_add_checked_fixture(t, init, destroy);
+	tcase_add_test(t, test_vm_cow);
+	suite_add_tcase(s, t);
+
+	return (s);
+}
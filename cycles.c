@@ -0,0 +1,107 @@
+#ifdef EMU_CYCLES
+
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Host cycle accounting, built with `make CYCLES=1`.
+ *
+ * emulate1() takes a timestamp at each boundary between the phases of running
+ * an instruction and charges the time since the previous one to the phase
+ * just finished: the loop checks in emulate() (and the tail of the previous
+ * emulate1()), decode, the instruction's handler, and the post-execution
+ * hooks.  Timestamps are TSC ticks where rdtsc exists and CLOCK_MONOTONIC_RAW
+ * nanoseconds elsewhere.  The cost of taking a timestamp is measured once and
+ * subtracted from every charge.
+ *
+ * Search, batch and server workers run emulate1() too, so the counters are
+ * per thread; the report covers the thread that prints it.
+ */
+
+__thread uint64_t	 cyc_acc[CYC_OP + SYNACOR_NINSTR];
+__thread uint64_t	 cyc_ops[SYNACOR_NINSTR];
+__thread uint64_t	 cyc_last;
+
+static uint64_t		 cyc_cost;
+static bool		 cyc_calibrated;
+
+static const char	*cyc_names[CYC_OP] = {
+	"loop", "decode", "hooks", "trace",
+};
+
+/* Restart timing; called when emulate() (re)enters its loop. */
+void
+cyc_start(void)
+{
+	uint64_t t, best;
+	unsigned i;
+
+	if (!cyc_calibrated) {
+		best = UINT64_MAX;
+		for (i = 0; i < 10000; i++) {
+			t = cyc_now();
+			t = cyc_now() - t;
+			if (t < best)
+				best = t;
+		}
+		cyc_cost = best;
+		cyc_calibrated = true;
+	}
+	cyc_last = cyc_now();
+}
+
+/* Charge the time since the last lap, less the timer's own cost, to 'b'. */
+void
+cyc_charge(unsigned b, uint64_t t)
+{
+	uint64_t d;
+
+	/* A worker's first lap only starts its clock. */
+	if (unlikely(cyc_last == 0)) {
+		cyc_last = t;
+		return;
+	}
+	d = t - cyc_last;
+	cyc_acc[b] += d > cyc_cost ? d - cyc_cost : 0;
+	cyc_last = t;
+}
+
+static void
+cyc_line(FILE *f, const char *name, uint64_t n, uint64_t c, uint64_t total,
+    uint64_t ninsns)
+{
+
+	fprintf(f, "%-8s %14ju %16ju %10.2f %6.2f%%\n", name, (uintmax_t)n,
+	    (uintmax_t)c, ninsns ? (double)c / ninsns : 0.,
+	    total ? 100. * c / total : 0.);
+}
+
+/* Print cycles per guest instruction by opcode and overhead category. */
+void
+cyc_report(FILE *f)
+{
+	uint64_t total, n;
+	unsigned i;
+
+	total = n = 0;
+	for (i = 0; i < CYC_OP + SYNACOR_NINSTR; i++)
+		total += cyc_acc[i];
+	for (i = 0; i < SYNACOR_NINSTR; i++)
+		n += cyc_ops[i];
+
+	fprintf(f, "Host %s by phase over %ju instructions (timer cost %ju, "
+	    "subtracted):\n", CYC_UNIT, (uintmax_t)n, (uintmax_t)cyc_cost);
+	fprintf(f, "%-8s %14s %16s %10s %7s\n", "phase", "insns", CYC_UNIT,
+	    "per insn", "share");
+	for (i = 0; i < CYC_OP; i++)
+		cyc_line(f, cyc_names[i], n, cyc_acc[i], total, n);
+	for (i = 0; i < SYNACOR_NINSTR; i++) {
+		if (cyc_ops[i] == 0)
+			continue;
+		cyc_line(f, synacor_instr[i].name, cyc_ops[i],
+		    cyc_acc[CYC_OP + i], total, cyc_ops[i]);
+	}
+	cyc_line(f, "total", n, total, total, n);
+}
+
+#endif
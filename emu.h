@@ -4,6 +4,7 @@
 #include <sys/cdefs.h>
 
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -20,6 +21,9 @@
 #ifndef	__dead2
 #define	__dead2		__attribute__((__noreturn__))
 #endif
+#ifndef	__aligned
+#define	__aligned(x)	__attribute__((__aligned__(x)))
+#endif
 
 #define	ARRAYLEN(arr)	((sizeof(arr)) / sizeof((arr)[0]))
 
@@ -28,9 +32,18 @@
 	typeof(y) _min2 = (y);						\
 	(void) (&_min1 == &_min2);					\
 	_min1 < _min2 ? _min1 : _min2; })
+#define	max(x, y)	({						\
+	typeof(x) _max1 = (x);						\
+	typeof(y) _max2 = (y);						\
+	(void) (&_max1 == &_max2);					\
+	_max1 > _max2 ? _max1 : _max2; })
 
 typedef unsigned int uns;
 
+/* 64kB, word addressed */
+#define	MEMBYTES	0x10000
+#define	MEMWORDS	(MEMBYTES / sizeof(uint16_t))
+
 #define	sec		1000000ULL
 #define	ptr(X)		((void*)((uintptr_t)X))
 
@@ -43,28 +56,69 @@ typedef unsigned int uns;
 	abort_nodump();							\
 } while (0)
 
-extern uint32_t		 pc;
-extern uint32_t		 pc_start;
-extern uint32_t		 instr_size;
-extern bool		 halted;
-extern uint16_t		 regs[8];
-extern uint16_t		 memory[0x10000 / sizeof(uint16_t)];
-extern uint16_t		*stack;
-extern size_t		 stack_depth;
-extern size_t		 stack_alloc;
+/* An ASSERT on guest behaviour; a worker's machine faults instead. */
+#define GUEST_ASSERT(cond, args...) do {				\
+	if (likely(!!(cond)))						\
+		break;							\
+	if (guest_fault != NULL)					\
+		longjmp(*guest_fault, 1);				\
+	printf("%s:%u: ASSERT %s failed: ", __FILE__, __LINE__, #cond);	\
+	printf(args);							\
+	printf("\n");							\
+	abort_nodump();							\
+} while (0)
+
+extern __thread uint32_t	 pc;
+extern __thread uint32_t	 pc_start;
+extern __thread uint32_t	 instr_size;
+extern __thread bool		 halted;
+extern __thread uint16_t	 regs[8];
+extern __thread uint16_t	*memory;
+extern __thread uint16_t	*stack;
+extern __thread size_t		 stack_depth;
+extern __thread size_t		 stack_alloc;
 extern bool		 replay_mode;
-extern uint64_t		 insns;
+extern __thread bool		 in_yield;
+extern __thread bool		 in_blocked;
+/* Set by worker threads: guest faults longjmp here instead of aborting. */
+extern __thread jmp_buf		*guest_fault;
+extern volatile bool	 ctrlc;
+extern __thread uint64_t	 insns;
 extern uint64_t		 insnreplaylim;
 extern uint64_t		 insnlimit;
-extern FILE		*infile;
-extern FILE		*outfile;
+extern __thread FILE		*infile;
+extern __thread FILE		*outfile;
 extern FILE		*coutfile;
+extern bool		 snap_tracking;
+extern size_t		 stack_lowat;
+extern bool		 onlydisas;
+extern FILE		*tracefile;
+extern bool		 tracehex;
+extern bool		 tracedisas;
+extern bool		 tracez;
+extern bool		 tracepc;
+extern bool		 traceidx;
+extern bool		 tracecols;
+extern bool		 trace_on;
+extern uint64_t		 trace_next;
+extern int32_t		 trace_callee;
+extern bool		 trace_incall;
+extern size_t		 trace_calldepth;
+extern FILE		*btracefile;
+extern bool		 btrace_active;
+extern bool		 btrace_decoding;
+extern FILE		*recfile;
+extern FILE		*replayfile;
+extern uint64_t		 rec_next_ckpt;
+extern __thread bool		 statehash_on;
+extern __thread uint64_t	 statehash_acc;
 
 void		 abort_nodump(void) __dead2;
 void		 init(void);
 void		 destroy(void);
 void		 emulate(void);
 void		 emulate1(void);
+void		 emulate1_cached(void);
 #define	unhandled(instr)	_unhandled(__FILE__, __LINE__, instr)
 void		 _unhandled(const char *f, unsigned l, uint16_t instr) __dead2;
 #define	illins(instr)		_illins(__FILE__, __LINE__, instr)
@@ -74,5 +128,226 @@ void		 print_regs(void);
 uint64_t	 now(void);
 
 void		 print_ips(void);
+/* Save files: */
+const char	*readsave(FILE *);
+int		 writesave(int fd);
+int		 writeall(int fd, const void *buf, size_t len);
+
+/* Flight recorder: */
+struct flight_rec {
+	uint64_t	 fr_insn;
+	uint16_t	 fr_pc;
+	uint16_t	 fr_instr;
+	uint16_t	 fr_args[3];
+	uint16_t	 fr_wb;		/* Register args[0] names, after */
+};
+
+extern __thread struct flight_rec	*flight;
+extern __thread size_t		 flight_mask;
+extern __thread uint64_t	 flight_pos;
+
+void		 flight_init(unsigned n);
+void		 flight_dump(int fd);
+
+static inline void
+flight_insn(uint16_t addr, uint16_t instr, const uint16_t *args)
+{
+	struct flight_rec *fr;
+
+	fr = &flight[flight_pos++ & flight_mask];
+	fr->fr_insn = insns;
+	fr->fr_pc = addr;
+	fr->fr_instr = instr;
+	memcpy(fr->fr_args, args, sizeof(fr->fr_args));
+	fr->fr_wb = regs[args[0] & 7];
+}
+
+/* Execution profiler: */
+extern bool		 prof_on;
+void		 prof_open(FILE *f);
+void		 prof_start(void);
+void		 prof_branch(unsigned op);
+void		 prof_close(void);
+
+/* Sampling profiler: */
+extern bool		 shadow_on;
+void		 shadow_call(uint16_t target);
+void		 shadow_ret(void);
+void		 sample_start(FILE *f, unsigned hz);
+void		 sample_stop(void);
+
+/* Memory heatmap: */
+extern bool		 heat_enabled;
+extern bool		 heat_on;	/* Counting this instruction */
+void		 heat_open(const char *name, unsigned rate);
+void		 heat_insn(uint16_t addr, unsigned size);
+void		 heat_read(uint16_t addr);
+void		 heat_write(uint16_t addr);
+void		 heat_close(void);
+
+/* Assembler: */
+unsigned	 assemble(const char *src, const char *file, uint16_t *mem,
+		    size_t *nwords);
+
+/* Live statistics: */
+extern __thread uint64_t	 stats_ops[];	/* Executed, by opcode */
+extern __thread size_t		 stack_hwm;
+extern __thread uint64_t	 in_wait;
+extern __thread uint64_t	 in_since;
+void		 stats_start(const char *name, unsigned period_ms);
+void		 stats_stop(void);
+
+/* Shared memory export: */
+extern bool		 shm_on;
+extern uint64_t		 shm_next;
+void		 shm_export(const char *name, uint64_t interval);
+void		 shm_begin(void);
+void		 shm_end(uint32_t npc, uint64_t ninsns);
+void		 shm_publish(void);
+void		 shm_close(void);
+
+/* Host cycle accounting (make CYCLES=1): */
+#ifdef EMU_CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	CYC_UNIT	"cycles"
+#else
+#define	CYC_UNIT	"ns"
+#endif
+
+enum { CYC_LOOP, CYC_DECODE, CYC_HOOKS, CYC_TRACE, CYC_OP };
+
+extern __thread uint64_t	 cyc_ops[];	/* Handler runs, by opcode */
+extern __thread uint64_t	 cyc_last;
+
+void		 cyc_start(void);
+void		 cyc_charge(unsigned b, uint64_t t);
+void		 cyc_report(FILE *f);
+
+static inline uint64_t
+cyc_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+#define	CYC_LAP(b)	cyc_charge((b), cyc_now())
+#define	CYC_OPLAP(i)	do {						\
+	cyc_ops[(i)]++;							\
+	cyc_charge(CYC_OP + (i), cyc_now());				\
+} while (0)
+#else
+#define	CYC_LAP(b)	do { } while (0)
+#define	CYC_OPLAP(i)	do { } while (0)
+#endif
+
+/* In-memory snapshot ring: */
+void		 snap_init(unsigned nsnaps);
+void		 snap_destroy(void);
+uint64_t	 snap_capture(void);
+bool		 snap_restore(uint64_t id);
+void		 snap_dirty(uint16_t addr);
+void		 snap_stackpop(uint16_t val);
+
+/*
+ * Incremental machine state hash.  statehash_acc is the XOR of one term per
+ * memory word, register and live stack slot; writers XOR out the old term and
+ * XOR in the new one.
+ */
+#define	SH_MEM		0
+#define	SH_REG		1
+#define	SH_STK		2
+#define	SH_PC		3
+
+static inline uint64_t
+statehash_term(uint64_t kind, uint64_t idx, uint16_t val)
+{
+	uint64_t z;
+
+	/* splitmix64 finalizer */
+	z = (kind << 56) ^ (idx << 16) ^ val;
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+static inline void
+statehash_set(uint64_t kind, uint64_t idx, uint16_t old, uint16_t new)
+{
+
+	statehash_acc ^= statehash_term(kind, idx, old) ^
+	    statehash_term(kind, idx, new);
+}
+
+void		 statehash_enable(bool on);
+uint64_t	 statehash_compute(void);
+uint64_t	 statehash(void);
+
+/* VM instances sharing a copy-on-write base image: */
+struct vm;
+struct vm_image;
+struct vm_image	*vm_image_create(void);
+void		 vm_image_destroy(struct vm_image *);
+struct vm	*vm_create(const struct vm_image *);
+void		 vm_destroy(struct vm *);
+void		 vm_switch(struct vm *);
+
+/* Decode-cached engine, and lockstep comparison with the interpreter: */
+extern __thread bool		 dcache_on;
+struct dcache_ent;
+extern __thread struct dcache_ent *dcache;	/* The running machine's */
+extern __thread uint16_t	*dcache_mem;	/* The memory it decodes */
+void		 dcache_flush(void);
+void		 dcache_inval(uint32_t addr);
+extern bool		 lockstep_on;
+extern void		(*lockstep_engine[2])(void);
+int		 lockstep_getc(void);
+bool		 lockstep_run(uint64_t interval, uint64_t *where);
+
+/* Parallel r7 search: */
+bool		 search_goal(const char *spec);
+bool		 search_run(uint32_t lo, uint32_t hi, unsigned nthreads);
+
+/* Batch jobs: */
+bool		 batch_run(const char *manifest, unsigned nthreads);
+
+/* Multi-session server: */
+void		 server_run(const char *path, unsigned idle_sec);
+
+/* Instruction tracing: */
+void		 trace_open(void);
+void		 trace_start(void);
+bool		 trace_filter(const char *spec);
+bool		 trace_contiguous(void);
+void		 trace_update(void);
+void		 trace_close(void);
+void		 trace_insn(uint32_t addr, unsigned op, unsigned size);
+struct instr_decode_common;
+void		 btrace_start(void);
+void		 btrace_close(void);
+void		 btrace_insn(const struct instr_decode_common *);
+int		 btrace_getc(void);
+void		 btrace_decode_open(FILE *f);
+
+/* Input record and replay: */
+void		 record_start(FILE *f, uint64_t interval);
+void		 record_input(uint8_t c);
+void		 record_checkpoint(void);
+void		 ckpt_write(FILE *f);
+const char	*ckpt_read(FILE *f);
+void		 record_stop(void);
+void		 replay_open(FILE *f, uint64_t target);
+int		 replay_getc(void);
+
+/* Scripted session fan-out: */
+void		 trie_run(char **scripts, unsigned nscripts);
 
 #endif
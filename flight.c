@@ -0,0 +1,107 @@
+#include <unistd.h>
+
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Flight recorder.
+ *
+ * emulate1() stores each executed instruction (pc, operands, and the value of
+ * the register its first operand names, after execution) in a small ring.
+ * It is cheap enough to leave on, and gives some history when something goes
+ * wrong: abort_nodump() dumps it, as does SIGQUIT at any time.  Dumping only
+ * uses write(2), so it is safe from a signal handler.
+ */
+
+__thread struct flight_rec	*flight;
+__thread size_t			 flight_mask;
+__thread uint64_t		 flight_pos;
+
+/* Keep the last 'n' (rounded up to a power of two) instructions; 0 is off. */
+void
+flight_init(unsigned n)
+{
+	size_t sz;
+
+	free(flight);
+	flight = NULL;
+	flight_mask = 0;
+	flight_pos = 0;
+	if (n == 0)
+		return;
+
+	for (sz = 1; sz < n; sz <<= 1)
+		;
+	flight = calloc(sz, sizeof(*flight));
+	ASSERT(flight != NULL, "calloc");
+	flight_mask = sz - 1;
+}
+
+static size_t
+fmtu64(char *buf, uint64_t v)
+{
+	char tmp[20];
+	size_t n, i;
+
+	n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	for (i = 0; i < n; i++)
+		buf[i] = tmp[n - 1 - i];
+	return (n);
+}
+
+static size_t
+fmtrec(char *buf, const struct flight_rec *fr)
+{
+	const struct instr_decode *id;
+	unsigned j, v;
+	size_t n;
+
+	n = fmtu64(buf, fr->fr_insn);
+	buf[n++] = ' ';
+	for (j = 5, v = fr->fr_pc; j > 0; j--, v /= 10)
+		buf[n + j - 1] = '0' + v % 10;
+	n += 5;
+	buf[n++] = ':';
+	buf[n++] = ' ';
+
+	id = &synacor_instr[fr->fr_instr];
+	memcpy(buf + n, id->name, strlen(id->name));
+	n += strlen(id->name);
+	for (j = 0; j < id->arguments; j++)
+		n += fmtarg(buf + n, fr->fr_args[j], j == id->arguments - 1u);
+
+	if (INSTR_SETSREG(fr->fr_instr) && fr->fr_args[0] > INT16_MAX) {
+		memcpy(buf + n, "  ->", 4);
+		n += 4;
+		n += fmtarg(buf + n, fr->fr_args[0], false) - 1;
+		buf[n++] = ' ';
+		buf[n++] = '=';
+		n += fmtarg(buf + n, fr->fr_wb, true);
+	}
+	buf[n++] = '\n';
+	return (n);
+}
+
+/* Write the recorded instructions, oldest first, to 'fd'. */
+void
+flight_dump(int fd)
+{
+	static const char hdr[] = "Last instructions executed:\n";
+	char line[128];
+	uint64_t i, first;
+
+	if (flight == NULL || flight_pos == 0)
+		return;
+
+	if (writeall(fd, hdr, sizeof(hdr) - 1) < 0)
+		return;
+	first = flight_pos > flight_mask ? flight_pos - flight_mask - 1 : 0;
+	for (i = first; i < flight_pos; i++)
+		if (writeall(fd, line,
+		    fmtrec(line, &flight[i & flight_mask])) < 0)
+			return;
+}
@@ -0,0 +1,53 @@
+#include "emu.h"
+
+/*
+ * Incremental machine state hash.
+ *
+ * The fingerprint covers memory, registers, the stack and pc.  Each memory
+ * word, register and live stack slot contributes an independent term to
+ * statehash_acc, so setreg(), instr_wmem(), pushval() and popval() keep it
+ * current in O(1) while statehash_on is set.  pc changes on every instruction
+ * and is folded in only when the hash is read.
+ */
+
+__thread bool		 statehash_on;
+__thread uint64_t	 statehash_acc;
+
+/* Hash the machine from scratch. */
+uint64_t
+statehash_compute(void)
+{
+	uint64_t acc;
+	size_t i;
+
+	acc = 0;
+	for (i = 0; i < MEMWORDS; i++)
+		acc ^= statehash_term(SH_MEM, i, memory[i]);
+	for (i = 0; i < ARRAYLEN(regs); i++)
+		acc ^= statehash_term(SH_REG, i, regs[i]);
+	for (i = 0; i < stack_depth; i++)
+		acc ^= statehash_term(SH_STK, i, stack[i]);
+	return (acc);
+}
+
+/*
+ * Start or stop tracking.  Enabling (re)computes the accumulator, so it is
+ * also the way to resynchronize after modifying the machine directly.
+ */
+void
+statehash_enable(bool on)
+{
+
+	if (on)
+		statehash_acc = statehash_compute();
+	statehash_on = on;
+}
+
+/* The current fingerprint; valid at any instruction boundary. */
+uint64_t
+statehash(void)
+{
+
+	ASSERT(statehash_on, "statehash_enable() not called");
+	return (statehash_acc ^ statehash_term(SH_PC, stack_depth, pc));
+}
@@ -0,0 +1,210 @@
+#include "emu.h"
+
+/*
+ * Memory access heatmap.
+ *
+ * emulate1() calls heat_insn() before each instruction runs.  Every
+ * heat_rate'th instruction is sampled: its fetched words are counted, and
+ * heat_on stays set while it runs so that instr_rmem() and instr_wmem() count
+ * the word they touch.  Counts are raw sample counts; multiply by the rate for
+ * an estimate of the whole run.
+ *
+ * Binary heatmap layout:
+ *
+ * heat_header || fetch:u64[MEMWORDS] || read:u64[MEMWORDS] ||
+ *     write:u64[MEMWORDS]
+ *
+ * The text report (<heatmap>.txt) ranks the hottest words and HEAT_REGION-word
+ * regions.
+ */
+
+#define	HEAT_MAGIC	0x484e5953	/* "SYNH" */
+#define	HEAT_REGION	64
+#define	HEAT_TOP	20
+
+struct heat_header {
+	uint32_t	 hh_magic;
+	uint32_t	 hh_words;
+	uint32_t	 hh_rate;	/* One instruction in hh_rate sampled */
+	uint32_t	 hh_pad;
+	uint64_t	 hh_insns;	/* Instructions executed */
+};
+
+enum { HEAT_FETCH, HEAT_READ, HEAT_WRITE, HEAT_NKINDS };
+
+static const char *heat_kinds[HEAT_NKINDS] = { "fetch", "read", "write" };
+
+bool			 heat_enabled;
+bool			 heat_on;
+
+static char		*heatname;
+static uint32_t		 heat_rate;
+static uint32_t		 heat_countdown;
+static uint64_t		 heat_first;
+static uint64_t		(*heat)[MEMWORDS];
+
+/* Count memory accesses of one instruction in 'rate', writing to 'name'. */
+void
+heat_open(const char *name, unsigned rate)
+{
+
+	ASSERT(rate > 0, "bad heatmap rate");
+	heatname = strdup(name);
+	ASSERT(heatname != NULL, "strdup");
+	heat = calloc(HEAT_NKINDS, sizeof(*heat));
+	ASSERT(heat != NULL, "calloc");
+	heat_rate = heat_countdown = rate;
+	heat_first = insns;
+	heat_enabled = true;
+}
+
+/* Called by emulate1() before the instruction at 'addr' runs. */
+void
+heat_insn(uint16_t addr, unsigned size)
+{
+	unsigned j;
+
+	if (--heat_countdown != 0) {
+		heat_on = false;
+		return;
+	}
+	heat_countdown = heat_rate;
+	heat_on = true;
+	for (j = 0; j < size && addr + j < MEMWORDS; j++)
+		heat[HEAT_FETCH][addr + j]++;
+}
+
+void
+heat_read(uint16_t addr)
+{
+
+	heat[HEAT_READ][addr]++;
+}
+
+void
+heat_write(uint16_t addr)
+{
+
+	heat[HEAT_WRITE][addr]++;
+}
+
+static uint64_t
+heat_total(uint32_t a, uint32_t n)
+{
+	uint64_t t;
+	uint32_t e;
+	unsigned k;
+
+	t = 0;
+	for (e = a + n; a < e; a++)
+		for (k = 0; k < HEAT_NKINDS; k++)
+			t += heat[k][a];
+	return (t);
+}
+
+/* Print the HEAT_TOP busiest 'n'-word units of memory. */
+static void
+heat_top(FILE *f, uint32_t n)
+{
+	uint64_t *tot, best, sum[HEAT_NKINDS];
+	uint32_t a, besta, units;
+	unsigned i, k;
+
+	units = MEMWORDS / n;
+	tot = malloc(units * sizeof(*tot));
+	ASSERT(tot != NULL, "malloc");
+	for (a = 0; a < units; a++)
+		tot[a] = heat_total(a * n, n);
+
+	fprintf(f, "%-11s %14s %14s %14s %14s\n", n == 1 ? "word" : "region",
+	    "total", heat_kinds[HEAT_FETCH], heat_kinds[HEAT_READ],
+	    heat_kinds[HEAT_WRITE]);
+	for (i = 0; i < HEAT_TOP; i++) {
+		best = 0;
+		besta = 0;
+		for (a = 0; a < units; a++)
+			if (tot[a] > best) {
+				best = tot[a];
+				besta = a;
+			}
+		if (best == 0)
+			break;
+
+		memset(sum, 0, sizeof(sum));
+		for (a = besta * n; a < (besta + 1) * n; a++)
+			for (k = 0; k < HEAT_NKINDS; k++)
+				sum[k] += heat[k][a];
+		if (n == 1)
+			fprintf(f, "%05u      ", (uns)besta);
+		else
+			fprintf(f, "%05u-%05u", (uns)(besta * n),
+			    (uns)((besta + 1) * n - 1));
+		fprintf(f, " %14ju %14ju %14ju %14ju\n", (uintmax_t)best,
+		    (uintmax_t)sum[HEAT_FETCH], (uintmax_t)sum[HEAT_READ],
+		    (uintmax_t)sum[HEAT_WRITE]);
+		tot[besta] = 0;
+	}
+	free(tot);
+}
+
+/* Write the heatmap and its report, and stop counting. */
+void
+heat_close(void)
+{
+	struct heat_header hh;
+	uint64_t sum;
+	char *txtname;
+	FILE *f;
+	uint32_t a;
+	unsigned k;
+
+	if (!heat_enabled)
+		return;
+	heat_enabled = heat_on = false;
+
+	memset(&hh, 0, sizeof(hh));
+	hh.hh_magic = HEAT_MAGIC;
+	hh.hh_words = MEMWORDS;
+	hh.hh_rate = heat_rate;
+	hh.hh_insns = insns - heat_first;
+
+	f = fopen(heatname, "wb");
+	if (f == NULL ||
+	    fwrite(&hh, sizeof(hh), 1, f) != 1 ||
+	    fwrite(heat, sizeof(*heat), HEAT_NKINDS, f) != HEAT_NKINDS ||
+	    fclose(f) != 0)
+		fprintf(stderr, "Failed to write heatmap `%s': %s\n",
+		    heatname, strerror(errno));
+
+	txtname = malloc(strlen(heatname) + sizeof(".txt"));
+	ASSERT(txtname != NULL, "malloc");
+	sprintf(txtname, "%s.txt", heatname);
+	f = fopen(txtname, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open `%s': %s\n", txtname,
+		    strerror(errno));
+		goto out;
+	}
+	fprintf(f, "Memory accesses over %ju instructions, sampling 1 in "
+	    "%u.\n", (uintmax_t)hh.hh_insns, (uns)heat_rate);
+	for (k = 0; k < HEAT_NKINDS; k++) {
+		sum = 0;
+		for (a = 0; a < MEMWORDS; a++)
+			sum += heat[k][a];
+		fprintf(f, "%-6s %14ju\n", heat_kinds[k], (uintmax_t)sum);
+	}
+	fprintf(f, "\nHottest words:\n");
+	heat_top(f, 1);
+	fprintf(f, "\nHottest %u-word regions:\n", (uns)HEAT_REGION);
+	heat_top(f, HEAT_REGION);
+	if (fclose(f) != 0)
+		fprintf(stderr, "Failed to write `%s': %s\n", txtname,
+		    strerror(errno));
+
+out:
+	free(txtname);
+	free(heatname);
+	free(heat);
+	heatname = NULL;
+	heat = NULL;
+}
@@ -20,6 +20,8 @@ setreg(uint16_t instr, uint16_t dst, uint16_t src)
 		illins(instr);
 
 	dst -= 32768;
+	if (unlikely(statehash_on))
+		statehash_set(SH_REG, dst, regs[dst], src);
 	regs[dst] = src;
 }
 
@@ -33,10 +35,16 @@ modmath(uint16_t val)
 static uint16_t
 popval(uint16_t instr)
 {
+	uint16_t val;
 
 	if (stack_depth == 0)
 		illins(instr);
-	return (stack[--stack_depth]);
+	val = stack[--stack_depth];
+	if (unlikely(stack_depth < stack_lowat))
+		snap_stackpop(val);
+	if (unlikely(statehash_on))
+		statehash_acc ^= statehash_term(SH_STK, stack_depth, val);
+	return (val);
 }
 
 static void
@@ -52,7 +60,11 @@ pushval(uint16_t val)
 		stack = realloc(stack, stack_alloc * sizeof(*stack));
 		ASSERT(stack != NULL, "realloc");
 	}
+	if (unlikely(statehash_on))
+		statehash_acc ^= statehash_term(SH_STK, stack_depth, val);
 	stack[stack_depth++] = val;
+	if (unlikely(stack_depth > stack_hwm))
+		stack_hwm = stack_depth;
 }
 
 void
@@ -87,6 +99,14 @@ instr_call(struct instr_decode_common *idc)
 	dst = getinput(idc->instr, idc->args[0]);
 
 	pushval(pc + 2);
+	if (unlikely(trace_callee == dst) && !trace_incall) {
+		/* Start tracing with the callee's first instruction. */
+		trace_incall = true;
+		trace_calldepth = stack_depth - 1;
+		trace_next = 0;
+	}
+	if (unlikely(shadow_on))
+		shadow_call(dst);
 
 	/* Decrement by size of jmp <a> instruction */
 	pc = dst - 2;
@@ -134,8 +154,28 @@ instr_in(struct instr_decode_common *idc)
 {
 	int rc;
 
-	rc = fgetc(infile);
-	if (rc == EOF) {
+	if (unlikely(lockstep_on))
+		rc = lockstep_getc();
+	else if (unlikely(replayfile != NULL))
+		rc = replay_getc();
+	else if (unlikely(btrace_decoding))
+		rc = btrace_getc();
+	else {
+		if (unlikely(shm_on))
+			shm_publish();
+		in_since = now();
+		rc = fgetc(infile);
+		in_wait += now() - in_since;
+		in_since = 0;
+	}
+	if (unlikely(recfile != NULL) && rc != EOF)
+		record_input(rc);
+	if (rc == EOF && in_yield) {
+		/* Park on this instruction until more input arrives. */
+		clearerr(infile);
+		in_blocked = true;
+		return;
+	} else if (rc == EOF) {
 		fprintf(stderr, "Cannot proceed without input.\n");
 		halted = true;
 	}
@@ -200,6 +240,7 @@ instr_mod(struct instr_decode_common *idc)
 	src1 = getinput(idc->instr, idc->args[1]);
 	src2 = getinput(idc->instr, idc->args[2]);
 
+	GUEST_ASSERT(src2 != 0, "mod by zero");
 	setreg(idc->instr, dst, src1 % src2);
 }
 
@@ -277,6 +318,11 @@ instr_ret(struct instr_decode_common *idc)
 
 	if (stack_depth != 0) {
 		dst = popval(idc->instr);
+		/* Stop tracing after the callee returns. */
+		if (unlikely(trace_incall))
+			trace_next = 0;
+		if (unlikely(shadow_on))
+			shadow_ret();
 		/* Decrement by size of ret instruction */
 		pc = dst - 1;
 	} else
@@ -291,7 +337,9 @@ instr_rmem(struct instr_decode_common *idc)
 	dst = idc->args[0];
 	src = getinput(idc->instr, idc->args[1]);
 
-	ASSERT(src < ARRAYLEN(memory), "overflow");
+	GUEST_ASSERT(src < MEMWORDS, "overflow");
+	if (unlikely(heat_on))
+		heat_read(src);
 	setreg(idc->instr, dst, memory[src]);
 }
 
@@ -303,8 +351,22 @@ instr_wmem(struct instr_decode_common *idc)
 	dst = getinput(idc->instr, idc->args[0]);
 	src = getinput(idc->instr, idc->args[1]);
 
-	ASSERT(dst < ARRAYLEN(memory), "overflow");
-	memory[dst] = src;
+	GUEST_ASSERT(dst < MEMWORDS, "overflow");
+	if (unlikely(heat_on))
+		heat_write(dst);
+	if (unlikely(snap_tracking))
+		snap_dirty(dst);
+	if (unlikely(statehash_on))
+		statehash_set(SH_MEM, dst, memory[dst], src);
+	if (unlikely(dcache_on))
+		dcache_inval(dst);
+	if (unlikely(shm_on)) {
+		/* Publish the state after this wmem with the store. */
+		shm_begin();
+		memory[dst] = src;
+		shm_end(pc + 3, insns + 1);
+	} else
+		memory[dst] = src;
 }
 
 void
@@ -314,6 +376,83 @@ instr_unimp(struct instr_decode_common *idc __unused)
 	unhandled(idc->instr);
 }
 
+// Could easily sort by popularity over time.
+struct instr_decode synacor_instr[SYNACOR_NINSTR] = {
+	{  0, 0, instr_halt, trans_halt, "halt", },
+	{  1, 2, instr_ld,   trans_ld,   "mov", },
+	{  2, 1, instr_push, trans_push, "push", },
+	{  3, 1, instr_pop,  trans_pop,  "pop", },
+	{  4, 3, instr_eq,   trans_eq,   "eq", },
+	{  5, 3, instr_gt,   trans_gt,   "gt", },
+	{  6, 1, instr_jmp,  trans_jmp,  "jmp", },
+	{  7, 2, instr_jt,   trans_jt,   "jt", },
+	{  8, 2, instr_jf,   trans_jf,   "jf", },
+	{  9, 3, instr_add,  trans_add,  "add", },
+	{ 10, 3, instr_mult, trans_mult, "mult", },
+	{ 11, 3, instr_mod,  trans_mod,  "mod", },
+	{ 12, 3, instr_and,  trans_and,  "and", },
+	{ 13, 3, instr_or,   trans_or,   "or", },
+	{ 14, 2, instr_not,  trans_not,  "not", },
+	{ 15, 2, instr_rmem, trans_rmem, "rmem", },
+	{ 16, 2, instr_wmem, trans_wmem, "wmem", },
+	{ 17, 1, instr_call, trans_call, "call", },
+	{ 18, 0, instr_ret,  trans_ret,  "ret", },
+	{ 19, 1, instr_out,  trans_out,  "out", },
+	{ 20, 1, instr_in,   trans_in,   "in", },
+	{ 21, 0, instr_nop,  trans_nop,  "nop", },
+};
+
+static int
+fmtuns(char *buf, unsigned val)
+{
+	char tmp[10];
+	int n, i;
+
+	n = 0;
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val != 0);
+	for (i = 0; i < n; i++)
+		buf[i] = tmp[n - 1 - i];
+	return (n);
+}
+
+/*
+ * Format one disassembled operand into 'buf', which must hold at least
+ * FMTARG_MAX bytes; returns its length (not NUL terminated).  Trace writers
+ * call this for every operand, so it avoids snprintf().
+ */
+int
+fmtarg(char *buf, uint16_t val, bool last)
+{
+	int n;
+
+	n = 0;
+	buf[n++] = ' ';
+	if (val <= INT16_MAX)
+		n += fmtuns(buf + n, val);
+	else if (val < 32776) {
+		buf[n++] = 'r';
+		n += fmtuns(buf + n, (uns)val - 32768);
+	} else {
+		memcpy(buf + n, "invalid#", 8);
+		n += 8;
+		n += fmtuns(buf + n, val);
+	}
+	if (!last)
+		buf[n++] = ',';
+	return (n);
+}
+
+void
+printarg(FILE *f, uint16_t val, bool last)
+{
+	char buf[FMTARG_MAX];
+
+	fwrite(buf, 1, fmtarg(buf, val, last), f);
+}
+
 static const char *
 fmt_dst(char *out, unsigned literal)
 {
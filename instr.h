@@ -16,6 +16,24 @@ struct instr_decode {
 	const char	 *name;
 };
 
+#define	SYNACOR_NINSTR	22
+
+/*
+ * Instructions whose first operand names the register they write: set, pop,
+ * eq, gt, add, mult, mod, and, or, not, rmem and in.
+ */
+#define	INSTR_SETSREG(op)						\
+	((op) < SYNACOR_NINSTR && ((0x10fe3aUL >> (op)) & 1))
+
+/* Control transfers: jmp, jt, jf, call and ret. */
+#define	INSTR_ENDSBLOCK(op)						\
+	((op) < SYNACOR_NINSTR && ((0x601c0UL >> (op)) & 1))
+extern struct instr_decode synacor_instr[SYNACOR_NINSTR];
+
+#define	FMTARG_MAX	20
+int  fmtarg(char *buf, uint16_t val, bool last);
+void printarg(FILE *f, uint16_t val, bool last);
+
 
 void instr_add(struct instr_decode_common *);
 void instr_and(struct instr_decode_common *);
@@ -0,0 +1,304 @@
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Lockstep differential execution.
+ *
+ * The interpreter (emulate1()) and the decode-cached engine
+ * (emulate1_cached()) run the same program on two vm.c instances cloned from
+ * one image.  They take turns running a window of N instructions, and at the
+ * end of each window their incremental state hashes (hash.c) must agree; that
+ * costs a few XORs per store, not a trace.  The interpreter reads the real
+ * input and logs it, the cached engine is fed the log, so both see the same
+ * bytes.  Only the interpreter's output is kept.
+ *
+ * When a window disagrees, both engines restart from the image taken at the
+ * last agreeing boundary and advance one instruction at a time, comparing
+ * hashes after each.  The first mismatch is the divergent instruction; it is
+ * printed with both resulting states and the run stops.
+ */
+
+#define	LS_SHOWMAX	8
+
+struct ls_state {
+	uint64_t	 ls_hash;
+	uint64_t	 ls_insns;
+	uint32_t	 ls_pc;
+	bool		 ls_halted;
+	uint16_t	 ls_regs[8];
+	const uint16_t	*ls_stack;
+	size_t		 ls_stack_depth;
+	const uint16_t	*ls_memory;
+};
+
+bool		 lockstep_on;
+
+/* The engines compared; a test may swap in a broken one. */
+void		(*lockstep_engine[2])(void) = { emulate1, emulate1_cached };
+static const char *const ls_name[2] = { "interp", "cached" };
+
+/* Input the interpreter consumed since the current window began. */
+static uint8_t	*ls_in;
+static size_t	 ls_in_len, ls_in_alloc;
+static size_t	 ls_in_pos[2];
+static unsigned	 ls_side;
+static bool	 ls_live;	/* The interpreter reads infile */
+static FILE	*ls_null;
+
+int
+lockstep_getc(void)
+{
+	int rc;
+
+	if (ls_side == 0 && ls_live) {
+		rc = fgetc(infile);
+		if (rc == EOF)
+			return (EOF);
+		if (ls_in_len == ls_in_alloc) {
+			ls_in_alloc = ls_in_alloc ? ls_in_alloc * 2 : 256;
+			ls_in = realloc(ls_in, ls_in_alloc);
+			ASSERT(ls_in != NULL, "realloc");
+		}
+		ls_in[ls_in_len++] = rc;
+		ls_in_pos[0] = ls_in_len;
+		return (rc);
+	}
+
+	if (ls_in_pos[ls_side] == ls_in_len)
+		return (EOF);
+	return (ls_in[ls_in_pos[ls_side]++]);
+}
+
+static void
+ls_capture(struct ls_state *st)
+{
+
+	st->ls_hash = statehash();
+	st->ls_insns = insns;
+	st->ls_pc = pc;
+	st->ls_halted = halted;
+	memcpy(st->ls_regs, regs, sizeof(st->ls_regs));
+	st->ls_stack = stack;
+	st->ls_stack_depth = stack_depth;
+	st->ls_memory = memory;
+}
+
+static bool
+ls_agree(const struct ls_state *a, const struct ls_state *b)
+{
+
+	return (a->ls_hash == b->ls_hash && a->ls_halted == b->ls_halted &&
+	    a->ls_insns == b->ls_insns);
+}
+
+/* Run the installed machine on engine 'side' until 'end' or a halt. */
+static void
+ls_run(unsigned side, uint64_t end)
+{
+	void (*step)(void);
+
+	step = lockstep_engine[side];
+	ls_side = side;
+	while (!halted && insns < end) {
+		if (ctrlc) {
+			printf("Got ^C, stopping...\n");
+			abort_nodump();
+		}
+		step();
+	}
+}
+
+static void
+ls_disas(char *buf, size_t sz, const uint16_t *mem, uint32_t addr)
+{
+	size_t n;
+	unsigned i, j;
+
+	for (i = 0; i < ARRAYLEN(synacor_instr); i++)
+		if (synacor_instr[i].icode == mem[addr])
+			break;
+	if (i == ARRAYLEN(synacor_instr)) {
+		snprintf(buf, sz, "illegal %u", (uns)mem[addr]);
+		return;
+	}
+	n = snprintf(buf, sz, "%s", synacor_instr[i].name);
+	for (j = 0; j < synacor_instr[i].arguments && addr + 1 + j < MEMWORDS;
+	    j++)
+		n += fmtarg(buf + n, mem[addr + 1 + j],
+		    j == synacor_instr[i].arguments - 1u);
+	buf[n] = 0;
+}
+
+static void
+ls_row(const char *what, unsigned long a, unsigned long b)
+{
+
+	printf("  %-14s %-8lu %lu%s\n", what, a, b, a != b ? "  <--" : "");
+}
+
+static void
+ls_report(uint64_t n, uint32_t addr, const char *insn,
+    const struct ls_state *st)
+{
+	const struct ls_state *a = &st[0], *b = &st[1];
+	char what[32];
+	size_t i, shown;
+
+	printf("Lockstep: engines diverge at instruction %ju:\n",
+	    (uintmax_t)n);
+	printf("  %05u: %s\n\n", (uns)addr, insn);
+	printf("  %-14s %-8s %s\n", "", ls_name[0], ls_name[1]);
+	ls_row("insns", a->ls_insns, b->ls_insns);
+	ls_row("pc", a->ls_pc, b->ls_pc);
+	ls_row("halted", a->ls_halted, b->ls_halted);
+	for (i = 0; i < ARRAYLEN(a->ls_regs); i++) {
+		snprintf(what, sizeof(what), "r%zu", i);
+		ls_row(what, a->ls_regs[i], b->ls_regs[i]);
+	}
+	ls_row("stack depth", a->ls_stack_depth, b->ls_stack_depth);
+
+	shown = 0;
+	for (i = 0; i < min(a->ls_stack_depth, b->ls_stack_depth) &&
+	    shown < LS_SHOWMAX; i++) {
+		if (a->ls_stack[i] == b->ls_stack[i])
+			continue;
+		snprintf(what, sizeof(what), "stack[%zu]", i);
+		ls_row(what, a->ls_stack[i], b->ls_stack[i]);
+		shown++;
+	}
+	shown = 0;
+	for (i = 0; i < MEMWORDS && shown < LS_SHOWMAX; i++) {
+		if (a->ls_memory[i] == b->ls_memory[i])
+			continue;
+		snprintf(what, sizeof(what), "mem[%05zu]", i);
+		ls_row(what, a->ls_memory[i], b->ls_memory[i]);
+		shown++;
+	}
+}
+
+/*
+ * The window that began at image 'vi' disagreed by instruction 'end'.  Replay
+ * it on fresh instances one instruction at a time to find where.  Returns the
+ * divergent instruction, or UINT64_MAX if single steps all agree.
+ */
+static uint64_t
+ls_narrow(const struct vm_image *vi, uint64_t end)
+{
+	struct ls_state st[2];
+	struct vm *vm[2];
+	char insn[64];
+	uint64_t n;
+	uint32_t addr;
+	unsigned s;
+
+	for (s = 0; s < 2; s++)
+		vm[s] = vm_create(vi);
+	n = 0;
+	addr = 0;
+	outfile = ls_null;
+	ls_live = false;
+	ls_in_pos[0] = ls_in_pos[1] = 0;
+
+	while (true) {
+		for (s = 0; s < 2; s++) {
+			vm_switch(vm[s]);
+			if (s == 0) {
+				n = insns;
+				addr = pc;
+				ls_disas(insn, sizeof(insn), memory, pc);
+			}
+			ls_run(s, insns + 1);
+			ls_capture(&st[s]);
+		}
+		if (!ls_agree(&st[0], &st[1])) {
+			ls_report(n, addr, insn, st);
+			break;
+		}
+		if (st[0].ls_halted || st[0].ls_insns >= end) {
+			printf("Lockstep: engines disagreed by instruction %ju "
+			    "but agree when single-stepped.\n", (uintmax_t)end);
+			n = UINT64_MAX;
+			break;
+		}
+	}
+
+	vm_switch(NULL);
+	for (s = 0; s < 2; s++)
+		vm_destroy(vm[s]);
+	return (n);
+}
+
+/*
+ * Run the loaded machine to completion on both engines, comparing them every
+ * 'interval' instructions.  Returns with the interpreter's machine installed:
+ * true if the engines agreed throughout, false if they diverged (reported,
+ * and its instruction stored to 'where' if not NULL).
+ */
+bool
+lockstep_run(uint64_t interval, uint64_t *where)
+{
+	struct ls_state st[2];
+	struct vm_image *vi;
+	struct vm *vm[2];
+	uint64_t end, n;
+	FILE *out;
+	unsigned s;
+	bool cached, agreed;
+
+	ls_null = fopen("/dev/null", "w");
+	ASSERT(ls_null != NULL, "fopen: %s", strerror(errno));
+	out = outfile;
+	cached = dcache_on;
+	lockstep_on = true;
+	dcache_on = true;
+	statehash_enable(true);
+
+	vi = vm_image_create();
+	for (s = 0; s < 2; s++)
+		vm[s] = vm_create(vi);
+
+	agreed = true;
+	while (true) {
+		end = insns + interval;
+		if (insnlimit && end > insnlimit)
+			end = insnlimit;
+		ls_in_len = 0;
+		ls_in_pos[0] = ls_in_pos[1] = 0;
+		ls_live = true;
+		for (s = 0; s < 2; s++) {
+			vm_switch(vm[s]);
+			outfile = s == 0 ? out : ls_null;
+			ls_run(s, end);
+			ls_capture(&st[s]);
+		}
+		outfile = out;
+
+		if (!ls_agree(&st[0], &st[1])) {
+			n = ls_narrow(vi, end);
+			if (where != NULL)
+				*where = n;
+			outfile = out;
+			agreed = false;
+			break;
+		}
+		if (st[0].ls_halted)
+			break;
+		if (insnlimit && insns >= insnlimit) {
+			printf("\nXXX Hit insn limit, halting XXX\n");
+			break;
+		}
+
+		/* This boundary is the new restart point. */
+		vm_image_destroy(vi);
+		vi = vm_image_create();
+	}
+
+	vm_switch(vm[0]);
+	vm_destroy(vm[1]);
+	vm_image_destroy(vi);
+	fclose(ls_null);
+	ls_null = NULL;
+	lockstep_on = false;
+	dcache_on = cached;
+	return (agreed);
+}
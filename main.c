@@ -1,5 +1,9 @@
+#define	_GNU_SOURCE
+#include <sys/stat.h>
+
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -8,72 +12,44 @@
 #include "emu.h"
 #include "instr.h"
 
-struct inprec {
-	uint64_t	 ir_insn;
-	size_t		 ir_len;
-	char		 ir_inp[0];
-};
-
-/* Machine state */
-uint32_t	 pc,
-		 pc_start,
-		 instr_size;
-bool		 halted;
-/* 64kB, word addressed  */
-uint16_t	 regs[8];
-uint16_t	 memory[0x10000 / sizeof(uint16_t)];
-uint16_t	*stack;
-size_t		 stack_depth;
-size_t		 stack_alloc;
+/*
+ * Machine state.  It is per-thread so that search workers (search.c) can each
+ * run a machine; everything else runs on the main thread.
+ */
+__thread uint32_t	 pc,
+			 pc_start,
+			 instr_size;
+__thread bool		 halted;
+__thread uint16_t	 regs[8];
+/* 64kB, word addressed; may point at a vm_create() mapping */
+static uint16_t		 memory_store[MEMWORDS];
+__thread uint16_t	*memory = memory_store;
+__thread uint16_t	*stack;
+__thread size_t		 stack_depth;
+__thread size_t		 stack_alloc;
 
 /* Emulater auxiliary info */
-uint64_t	 start;		/* Start time in us */
-uint64_t	 insns;
-uint64_t	 insnlimit;
-uint64_t	 insnreplaylim;
-bool		 replay_mode;
-volatile bool	 ctrlc;
-
-bool		 tracehex;
-bool		 tracedisas;
-bool		 onlydisas;
-bool		 onlytranspile;
-FILE		*tracefile;
-FILE		*outfile;
-FILE		*coutfile;
-char		*cout_stream;
-size_t		 cout_size;
-FILE		*orig_coutfile;
-FILE		*infile;
+uint64_t		 start;		/* Start time in us */
+__thread uint64_t	 insns;
+uint64_t		 insnlimit;
+uint64_t		 insnreplaylim;
+bool			 replay_mode;
+__thread bool		 in_yield;	/* 'in' at EOF blocks, not halts */
+__thread bool		 in_blocked;
+__thread jmp_buf	*guest_fault;
+volatile bool		 ctrlc;
+
+bool			 onlydisas;
+bool			 onlytranspile;
+__thread FILE		*outfile;
+FILE			*coutfile;
+char			*cout_stream;
+size_t			 cout_size;
+FILE			*orig_coutfile;
+__thread FILE		*infile;
 
 static bool jmplabels[32*1024];
 
-// Could easily sort by popularity over time.
-static struct instr_decode synacor_instr[] = {
-	{  0, 0, instr_halt, trans_halt, "halt", },
-	{  1, 2, instr_ld,   trans_ld,   "mov", },
-	{  2, 1, instr_push, trans_push, "push", },
-	{  3, 1, instr_pop,  trans_pop,  "pop", },
-	{  4, 3, instr_eq,   trans_eq,   "eq", },
-	{  5, 3, instr_gt,   trans_gt,   "gt", },
-	{  6, 1, instr_jmp,  trans_jmp,  "jmp", },
-	{  7, 2, instr_jt,   trans_jt,   "jt", },
-	{  8, 2, instr_jf,   trans_jf,   "jf", },
-	{  9, 3, instr_add,  trans_add,  "add", },
-	{ 10, 3, instr_mult, trans_mult, "mult", },
-	{ 11, 3, instr_mod,  trans_mod,  "mod", },
-	{ 12, 3, instr_and,  trans_and,  "and", },
-	{ 13, 3, instr_or,   trans_or,   "or", },
-	{ 14, 2, instr_not,  trans_not,  "not", },
-	{ 15, 2, instr_rmem, trans_rmem, "rmem", },
-	{ 16, 2, instr_wmem, trans_wmem, "wmem", },
-	{ 17, 1, instr_call, trans_call, "call", },
-	{ 18, 0, instr_ret,  trans_ret,  "ret", },
-	{ 19, 1, instr_out,  trans_out,  "out", },
-	{ 20, 1, instr_in,   trans_in,   "in", },
-	{ 21, 0, instr_nop,  trans_nop,  "nop", },
-};
-
 void
 print_ips(void)
 {
@@ -86,20 +62,6 @@ print_ips(void)
 	    (uintmax_t)insns * 1000000 / (end - start), (uintmax_t)insns);
 }
 
-static void
-printarg(FILE *f, uint16_t val, bool last)
-{
-
-	if (val <= INT16_MAX)
-		fprintf(f, " %u", (uns)val);
-	else if (val < 32776)
-		fprintf(f, " r%u", (uns)val - 32768);
-	else
-		fprintf(f, " invalid#%u", (uns)val);
-	if (!last)
-		fprintf(f, ",");
-}
-
 void
 init(void)
 {
@@ -112,51 +74,94 @@ init(void)
 	memset(regs, 0, sizeof(regs));
 	stack_depth = stack_alloc = 0;
 	start = now();
-	//memset(memory, 0, sizeof(memory));
+	//memset(memory, 0, MEMBYTES);
 }
 
 void
 destroy(void)
 {
 
+	shm_close();
 	free(stack);
 	stack = NULL;
+	snap_destroy();
+	statehash_enable(false);
+	flight_init(0);
+	free(dcache);
+	dcache = NULL;
+	dcache_mem = NULL;
 }
 
-#ifndef EMU_CHECK
-static void
-ctrlc_handler(int s)
+static size_t
+freadall(void *buf, size_t sz, size_t nelm, FILE *f)
 {
+	size_t rd, idx;
 
-	(void)s;
-	ctrlc = true;
+	for (idx = 0; idx < nelm; idx += rd) {
+		rd = fread((char *)buf + (idx * sz), sz, nelm - idx, f);
+		if (rd == 0)
+			break;
+	}
+	return (idx);
 }
 
-static void
-writes(int fd, const char *str)
+/*
+ * Read a save file image from 'romfile' into the machine.  Returns NULL on
+ * success or a description of the problem.
+ */
+const char *
+readsave(FILE *romfile)
 {
+	size_t rd;
+	uint64_t sd;
+	uint32_t crc, computed, pc_tmp;
 
-	(void)write(fd, str, strlen(str));
-}
+	/*
+	 * File format is:
+	 *
+	 * stack_depth:u64 || pc:u32 || crc32:u32 || memory[] || regs[] || stack[]
+	 */
 
-static void
-write_errno(int fd)
-{
-	char buf[11];
-	size_t len;
-	int error;
+	rd = freadall(&sd, sizeof(sd), 1, romfile);
+	if (rd != 1)
+		return ("short save file");
+	rd = freadall(&pc_tmp, sizeof(pc_tmp), 1, romfile);
+	if (rd != 1)
+		return ("short save file");
+	pc = pc_tmp;
+	rd = freadall(&crc, sizeof(crc), 1, romfile);
+	if (rd != 1)
+		return ("short save file");
+	rd = freadall(memory, sizeof(memory[0]), MEMWORDS, romfile);
+	if (rd != MEMWORDS)
+		return ("short save file");
+	rd = freadall(regs, sizeof(regs[0]), ARRAYLEN(regs), romfile);
+	if (rd != ARRAYLEN(regs))
+		return ("short save file");
 
-	error = errno;
-	for (len = 0; error != 0; len++) {
-		buf[len] = "0123456789"[error % 10];
-		error /= 10;
-	}
+	stack_depth = stack_alloc = sd;
+	stack = realloc(stack, stack_alloc * sizeof(*stack));
+	ASSERT(stack != NULL || stack_alloc == 0, "realloc");
 
-	for (; len > 0; len--)
-		(void)write(fd, &buf[len - 1], 1);
+	rd = freadall(stack, sizeof(*stack), stack_depth, romfile);
+	if (rd != stack_depth)
+		return ("short save file");
+
+	computed = crc32(0, (void *)&sd, sizeof(sd));
+	computed = crc32(computed, (void *)&pc_tmp, sizeof(pc_tmp));
+	computed = crc32(computed, (void *)memory, MEMBYTES);
+	computed = crc32(computed, (void *)regs, sizeof(regs));
+	if (stack_depth > 0)
+		computed = crc32(computed, (void *)stack,
+		    stack_depth * sizeof(*stack));
+	if (computed != crc)
+		return ("checksum error");
+
+	return (NULL);
 }
 
-static int
+/* write(2) all of 'buf', or return -1.  Async-signal safe. */
+int
 writeall(int fd, const void *buf, size_t len)
 {
 	size_t written;
@@ -171,28 +176,15 @@ writeall(int fd, const void *buf, size_t len)
 	return (0);
 }
 
-static void
-save_handler(int s)
+/*
+ * Write the machine state to 'fd' in save file format.  Async-signal safe.
+ */
+int
+writesave(int fd)
 {
-	size_t written;
 	ssize_t rc;
 	uint64_t sd_tmp;
 	uint32_t crc, pc_tmp;
-	int fd;
-
-	(void)s;
-
-	fd = open("synacor.save", O_CREAT | O_EXCL | O_WRONLY, 0600);
-	if (fd < 0) {
-		writes(STDERR_FILENO, "Failed to open synacor.save: ");
-		if (errno == EEXIST)
-			writes(STDERR_FILENO,
-			    "file already exists; refusing to overwrite.");
-		else
-			write_errno(STDERR_FILENO);
-		writes(STDERR_FILENO, "\n");
-		return;
-	}
 
 	/*
 	 * File format is:
@@ -202,42 +194,101 @@ save_handler(int s)
 	sd_tmp = stack_depth;
 	rc = writeall(fd, &sd_tmp, sizeof(sd_tmp));
 	if (rc < 0)
-		goto out;
+		return (rc);
 	pc_tmp = pc;
 	rc = writeall(fd, &pc_tmp, sizeof(pc_tmp));
 	if (rc < 0)
-		goto out;
+		return (rc);
 
 	/* Checksum over: stack_depth || pc || memory || regs || stack */
 	crc = crc32(0, (void *)&sd_tmp, sizeof(sd_tmp));
 	crc = crc32(crc, (void *)&pc_tmp, sizeof(pc_tmp));
-	crc = crc32(crc, (void *)memory, sizeof(memory));
+	crc = crc32(crc, (void *)memory, MEMBYTES);
 	crc = crc32(crc, (void *)regs, sizeof(regs));
-	crc = crc32(crc, (void *)stack, stack_depth * sizeof(*stack));
+	/* crc32() treats a NULL buffer as a request for the initial value. */
+	if (stack_depth > 0)
+		crc = crc32(crc, (void *)stack, stack_depth * sizeof(*stack));
 	rc = writeall(fd, &crc, sizeof(crc));
 	if (rc < 0)
-		goto out;
+		return (rc);
 
-	rc = writeall(fd, memory, sizeof(memory));
+	rc = writeall(fd, memory, MEMBYTES);
 	if (rc < 0)
-		goto out;
+		return (rc);
 	rc = writeall(fd, regs, sizeof(regs));
 	if (rc < 0)
-		goto out;
-	rc = writeall(fd, stack, stack_depth * sizeof(*stack));
-	if (rc < 0)
-		goto out;
+		return (rc);
+	return (writeall(fd, stack, stack_depth * sizeof(*stack)));
+}
 
-	writes(STDERR_FILENO, "Saved synacor.save.\n");
+#ifndef EMU_CHECK
+static void
+ctrlc_handler(int s)
+{
 
-out:
+	(void)s;
+	ctrlc = true;
+}
+
+static void
+flight_handler(int s)
+{
+
+	(void)s;
+	flight_dump(STDERR_FILENO);
+}
+
+static void
+writes(int fd, const char *str)
+{
+
+	(void)write(fd, str, strlen(str));
+}
+
+static void
+write_errno(int fd)
+{
+	char buf[11];
+	size_t len;
+	int error;
+
+	error = errno;
+	for (len = 0; error != 0; len++) {
+		buf[len] = "0123456789"[error % 10];
+		error /= 10;
+	}
+
+	for (; len > 0; len--)
+		(void)write(fd, &buf[len - 1], 1);
+}
+
+static void
+save_handler(int s)
+{
+	int fd, rc;
+
+	(void)s;
+
+	fd = open("synacor.save", O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd < 0) {
+		writes(STDERR_FILENO, "Failed to open synacor.save: ");
+		if (errno == EEXIST)
+			writes(STDERR_FILENO,
+			    "file already exists; refusing to overwrite.");
+		else
+			write_errno(STDERR_FILENO);
+		writes(STDERR_FILENO, "\n");
+		return;
+	}
+
+	rc = writesave(fd);
 	if (rc < 0) {
 		writes(STDERR_FILENO, "Failed to write synacor.save: ");
 		write_errno(STDERR_FILENO);
 		writes(STDERR_FILENO, "\n");
-	}
+	} else
+		writes(STDERR_FILENO, "Saved synacor.save.\n");
 	close(fd);
-	return;
 }
 
 void
@@ -246,103 +297,322 @@ usage(void)
 	printf("usage: synacor-emu FLAGS [binaryimage]\n"
 		"\n"
 		"  FLAGS:\n"
+		"    -a=REPORT     Profile blocks, branches and calls; write an\n"
+		"                  annotated listing to REPORT\n"
+		"    -B=BTRACE     Emit compact branch trace\n"
+		"    -b=MANIFEST   Run the jobs in MANIFEST on worker threads and\n"
+		"                  print a JSON report (no binaryimage)\n"
+		"    -C            Write a columnar trace for synacor-query\n"
 		"    -c=OUTPUT.c   Recompile memory to C\n"
 		"    -d            Trace output, disassembled\n"
 		"    -D            Disassemble memory\n"
+		"    -e=STATS      Export live statistics to STATS as JSON\n"
+		"    -E=<MS>       Export interval for -e (default 1000)\n"
+		"    -F=<N>        Keep the last N instructions for crash dumps\n"
+		"                  (default 64, 0 to disable)\n"
+		"    -G=GOAL       Goal for -R: pc=ADDR (reach ADDR) or out=TEXT\n"
+		"                  (print TEXT)\n"
+		"    -g=STACKS     Sample guest call stacks; write collapsed\n"
+		"                  stacks for flame graphs to STACKS\n"
+		"    -H=<HZ>       Sampling rate for -g (default 1000)\n"
+		"    -I=<SEC>      Save -U sessions idle for SEC seconds to disk\n"
+		"                  (default 60, 0 to keep them in memory)\n"
+		"    -i            Write an indexed, seekable trace\n"
+		"    -j=<N>        Threads for -R and -b (default: one per CPU)\n"
+		"    -k=<N>        Checkpoint the input log every N instructions\n"
+		"    -L=<N>        Run the interpreter and the decode-cached\n"
+		"                  engine in lockstep, comparing state every N\n"
+		"                  instructions\n"
 		"    -l=<N>        Limit execution to N instructions\n"
+		"    -m=HEATMAP    Count memory fetches, reads and writes per\n"
+		"                  word; report in HEATMAP.txt\n"
+		"    -M=<N>        Sample one instruction in N for -m\n"
+		"    -n            Don't use the post-boot state cache\n"
+		"    -N            Refresh the post-boot state cache\n"
+		"    -o=NAME       Export live machine state to POSIX shared\n"
+		"                  memory object NAME (e.g. /synacor)\n"
+		"    -O=<N>        Publish registers for -o at least every N\n"
+		"                  instructions (default 100000)\n"
+		"    -P            Replay input log binaryimage\n"
+		"    -p            Run input scripts named after binaryimage,\n"
+		"                  sharing work across common input prefixes\n"
+		"    -R=LO[:HI]    Search r7 values LO..HI for one that meets the\n"
+		"                  -G goal, from the post-boot state; -l limits\n"
+		"                  each candidate\n"
 		"    -r            Restore save file binaryimage\n"
 		"    -s=<N>        Set initial value of r7\n"
+		"    -S=<N>        Replay silently up to instruction N and stop;\n"
+		"                  -l sets a later stop\n"
 		"    -t=TRACEFILE  Emit instruction trace\n"
-		"    -x            Trace output in hex\n");
+		"    -T=FILTER     Only trace instructions matching FILTER:\n"
+		"                  pc=LO[:HI], insn=START:[END], op=NAME[,NAME],\n"
+		"                  call=ADDR (inside calls to ADDR)\n"
+		"    -U=SOCKET     Serve sessions of the image on UNIX socket\n"
+		"                  SOCKET\n"
+		"    -u            Decode branch trace binaryimage to -t\n"
+		"    -w=INPUTLOG   Record input log\n"
+		"    -X            Use the decode-cached engine\n"
+		"    -x            Trace output in hex\n"
+		"    -z            Compress trace output with zlib\n");
 	exit(1);
 }
 
+static void
+loadrestore(FILE *romfile)
+{
+	const char *error;
+
+	error = readsave(romfile);
+	if (error != NULL) {
+		fprintf(stderr, "Couldn't read restore file: %s\n", error);
+		exit(1);
+	} else
+		printf("Loaded save file successfully.\n");
+}
+
 static size_t
-freadall(void *buf, size_t sz, size_t nelm, FILE *f)
+loadrom(FILE *romfile)
 {
 	size_t rd, idx;
 
-	for (idx = 0; idx < nelm; idx += rd) {
-		rd = fread((char *)buf + (idx * sz), sz, nelm - idx, f);
+	idx = 0;
+	while (true) {
+		rd = fread(&memory[idx], sizeof(memory[0]),
+		    MEMWORDS - idx, romfile);
 		if (rd == 0)
 			break;
+		idx += rd;
 	}
+	printf("Loaded %zu words from image.\n", idx);
 	return (idx);
 }
 
-static void
-loadrestore(FILE *romfile)
+/*
+ * Post-boot state cache.  The first run of an image executes until the first
+ * 'in' and stores the resulting machine state, along with the output produced
+ * on the way there, keyed by a hash of the image and initial r7.  Later runs
+ * restore that state instead of re-running the self-test and decryption.
+ *
+ * File format is:
+ *
+ * magic:u32 || insns:u64 || outlen:u64 || out[] || <save file>
+ */
+#define	BOOTCACHE_MAGIC		0x424e5953	/* "SYNB" */
+
+static bool
+mkdirs(char *path)
 {
-	const char *error;
-	size_t rd;
-	uint64_t sd;
-	uint32_t crc, computed, pc_tmp;
+	char *p;
+	int rc;
 
-	/*
-	 * File format is:
-	 *
-	 * stack_depth:u64 || crc32:u32 || memory[] || regs[] || stack[]
-	 */
+	for (p = path + 1; *p != '\0'; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		rc = mkdir(path, 0700);
+		*p = '/';
+		if (rc < 0 && errno != EEXIST)
+			return (false);
+	}
+	return (mkdir(path, 0700) == 0 || errno == EEXIST);
+}
 
-	error = "short save file";
-	rd = freadall(&sd, sizeof(sd), 1, romfile);
-	if (rd != 1)
+static bool
+bootcache_path(char *buf, size_t len, size_t nwords, uint16_t r7)
+{
+	const char *base, *sub;
+	uint32_t crc, adler;
+	int n;
+
+	base = getenv("XDG_CACHE_HOME");
+	sub = "synacor-emu";
+	if (base == NULL || base[0] == '\0') {
+		base = getenv("HOME");
+		sub = ".cache/synacor-emu";
+	}
+	if (base == NULL || base[0] == '\0')
+		return (false);
+
+	n = snprintf(buf, len, "%s/%s", base, sub);
+	if (n < 0 || (size_t)n >= len || !mkdirs(buf))
+		return (false);
+
+	crc = crc32(0, (void *)memory, nwords * sizeof(memory[0]));
+	adler = adler32(1, (void *)memory, nwords * sizeof(memory[0]));
+	n = snprintf(buf, len, "%s/%s/%08x%08x-%u.boot", base, sub,
+	    (uns)crc, (uns)adler, (uns)r7);
+	return (n >= 0 && (size_t)n < len);
+}
+
+static bool
+bootcache_load(const char *path)
+{
+	FILE *f;
+	char *out;
+	uint64_t insns_tmp, outlen;
+	uint32_t magic;
+	bool ok;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return (false);
+
+	ok = false;
+	out = NULL;
+	if (freadall(&magic, sizeof(magic), 1, f) != 1 ||
+	    magic != BOOTCACHE_MAGIC)
 		goto out;
-	rd = freadall(&pc_tmp, sizeof(pc_tmp), 1, romfile);
-	if (rd != 1)
+	if (freadall(&insns_tmp, sizeof(insns_tmp), 1, f) != 1)
 		goto out;
-	pc = pc_tmp;
-	rd = freadall(&crc, sizeof(crc), 1, romfile);
-	if (rd != 1)
+	if (freadall(&outlen, sizeof(outlen), 1, f) != 1 ||
+	    outlen > SIZE_MAX)
 		goto out;
-	rd = freadall(memory, sizeof(memory[0]), ARRAYLEN(memory), romfile);
-	if (rd != ARRAYLEN(memory))
+	out = malloc(outlen + 1);
+	ASSERT(out != NULL, "malloc");
+	if (freadall(out, 1, outlen, f) != outlen)
 		goto out;
-	rd = freadall(regs, sizeof(regs[0]), ARRAYLEN(regs), romfile);
-	if (rd != ARRAYLEN(regs))
+	if (readsave(f) != NULL)
 		goto out;
 
-	stack_depth = stack_alloc = sd;
-	stack = realloc(stack, stack_alloc * sizeof(*stack));
-	ASSERT(stack != NULL, "realloc");
-
-	rd = freadall(stack, sizeof(*stack), stack_depth, romfile);
-	if (rd != stack_depth)
-		goto out;
-
-	error = "checksum error";
-	computed = crc32(0, (void *)&sd, sizeof(sd));
-	computed = crc32(computed, (void *)&pc_tmp, sizeof(pc_tmp));
-	computed = crc32(computed, (void *)memory, sizeof(memory));
-	computed = crc32(computed, (void *)regs, sizeof(regs));
-	computed = crc32(computed, (void *)stack, stack_depth * sizeof(*stack));
-	if (computed != crc)
-		goto out;
-
-	error = NULL;
+	insns = insns_tmp;
+	fwrite(out, 1, outlen, outfile);
+	ok = true;
 
 out:
-	if (error != NULL) {
-		fprintf(stderr, "Couldn't read restore file: %s\n", error);
-		exit(1);
-	} else
-		printf("Loaded save file successfully.\n");
+	free(out);
+	fclose(f);
+	return (ok);
 }
 
 static void
-loadrom(FILE *romfile)
+bootcache_store(const char *path, const char *out, size_t outlen)
 {
-	size_t rd, idx;
+	char tmp[PATH_MAX];
+	uint64_t insns_tmp, outlen_tmp;
+	uint32_t magic;
+	int fd, n, rc;
 
-	idx = 0;
-	while (true) {
-		rd = fread(&memory[idx], sizeof(memory[0]),
-		    ARRAYLEN(memory) - idx, romfile);
-		if (rd == 0)
-			break;
-		idx += rd;
+	n = snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return;
+
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open boot cache %s: %s\n", tmp,
+		    strerror(errno));
+		return;
 	}
-	printf("Loaded %zu words from image.\n", idx);
+
+	magic = BOOTCACHE_MAGIC;
+	insns_tmp = insns;
+	outlen_tmp = outlen;
+	rc = writeall(fd, &magic, sizeof(magic));
+	if (rc == 0)
+		rc = writeall(fd, &insns_tmp, sizeof(insns_tmp));
+	if (rc == 0)
+		rc = writeall(fd, &outlen_tmp, sizeof(outlen_tmp));
+	if (rc == 0)
+		rc = writeall(fd, out, outlen);
+	if (rc == 0)
+		rc = writesave(fd);
+	if (close(fd) < 0)
+		rc = -1;
+
+	if (rc == 0)
+		rc = rename(tmp, path);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to write boot cache %s: %s\n", path,
+		    strerror(errno));
+		(void)unlink(tmp);
+	}
+}
+
+/*
+ * Boot output goes to stdout as it is produced, and is kept for the cache
+ * entry unless it grows past BOOTCACHE_MAXOUT.
+ */
+#define	BOOTCACHE_MAXOUT	(1024 * 1024)
+
+struct boottee {
+	char	*tee_buf;
+	size_t	 tee_len;
+	bool	 tee_overflow;
+};
+
+static ssize_t
+boottee_write(void *cookie, const char *buf, size_t len)
+{
+	struct boottee *tee;
+
+	tee = cookie;
+	if (fwrite(buf, 1, len, stdout) != len)
+		return (-1);
+	if (tee->tee_overflow)
+		return (len);
+	if (tee->tee_len + len > BOOTCACHE_MAXOUT) {
+		tee->tee_overflow = true;
+		return (len);
+	}
+	memcpy(&tee->tee_buf[tee->tee_len], buf, len);
+	tee->tee_len += len;
+	return (len);
+}
+
+/*
+ * Bring a freshly loaded image of 'nwords' words to its first input request,
+ * from the cache if possible.  Returns true if the machine stopped (halt,
+ * ^C or the insn limit) before it got there.
+ */
+static bool
+bootcache_boot(size_t nwords, uint16_t r7, bool refresh)
+{
+	static uint16_t rom[MEMWORDS];
+	static const cookie_io_functions_t teeio = {
+		.write = boottee_write,
+	};
+	char path[PATH_MAX];
+	struct boottee tee;
+	FILE *bootin;
+
+	if (!bootcache_path(path, sizeof(path), nwords, r7))
+		return (false);
+
+	memcpy(rom, memory, sizeof(rom));
+	if (!refresh && bootcache_load(path))
+		return (false);
+
+	/* Miss, or a corrupt entry clobbered part of the machine. */
+	memcpy(memory, rom, MEMBYTES);
+	memset(regs, 0, sizeof(regs));
+	regs[7] = r7;
+	pc = 0;
+	insns = 0;
+	stack_depth = 0;
+
+	memset(&tee, 0, sizeof(tee));
+	tee.tee_buf = malloc(BOOTCACHE_MAXOUT);
+	ASSERT(tee.tee_buf != NULL, "malloc");
+	bootin = fopen("/dev/null", "rb");
+	ASSERT(bootin != NULL, "fopen: %s", strerror(errno));
+	outfile = fopencookie(&tee, "w", teeio);
+	ASSERT(outfile != NULL, "fopencookie");
+	/* Nothing may sit in our buffer if the guest faults. */
+	setvbuf(outfile, NULL, _IONBF, 0);
+	infile = bootin;
+	in_yield = true;
+
+	emulate();
+
+	fclose(outfile);
+	fclose(bootin);
+	outfile = stdout;
+	infile = stdin;
+	in_yield = false;
+
+	if (in_blocked && !tee.tee_overflow)
+		bootcache_store(path, tee.tee_buf, tee.tee_len);
+	free(tee.tee_buf);
+	return (!in_blocked);
 }
 
 static void
@@ -358,8 +628,8 @@ write_c_header(void)
 
 	/* Machine state */
 	fprintf(coutfile, "static uint16_t memory[%zu] = {\n\t",
-	    ARRAYLEN(memory));
-	for (i = 0; i < ARRAYLEN(memory); i++)
+	    MEMWORDS);
+	for (i = 0; i < MEMWORDS; i++)
 		fprintf(coutfile, "%u, ", (uns)memory[i]);
 	fprintf(coutfile, "\n};\n");
 	fprintf(coutfile, "static uintptr_t stack[1024 * 1024] = {\n\t");
@@ -434,19 +704,75 @@ write_c_footer(void)
 int
 main(int argc, char **argv)
 {
-	const char *romfname;
-	FILE *romfile;
+	const char *romfname, *heatname, *statsname, *shmname, *batchname;
+	const char *servename;
+	FILE *romfile, *logfile, *proffile, *stackfile;
+	size_t nwords;
+	uint64_t interval, seek, shmint, lockstep;
+	unsigned flightn, samplehz, heatrate, statsms, nthreads, idlesec;
+	long searchlo, searchhi;
+	char *end;
 	uint16_t r7;
-	bool restore;
-	int opt;
+	bool restore, replay, bootcache, bootrefresh, bootended, scripted;
+	bool unpack, searchgoal;
+	int opt, rc;
 
 	if (argc < 2)
 		usage();
 
 	restore = false;
+	replay = false;
+	logfile = NULL;
+	proffile = NULL;
+	stackfile = NULL;
+	heatname = NULL;
+	heatrate = 1;
+	statsname = NULL;
+	statsms = 1000;
+	shmname = NULL;
+	shmint = 100000;
+	lockstep = 0;
+	searchlo = searchhi = -1;
+	searchgoal = false;
+	batchname = NULL;
+	servename = NULL;
+	idlesec = 60;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	interval = 100000000;
+	seek = 0;
+	bootcache = true;
+	bootrefresh = false;
+	scripted = false;
+	unpack = false;
+	nwords = 0;
+	flightn = 64;
+	samplehz = 1000;
 	r7 = 0;
-	while ((opt = getopt(argc, argv, "c:Ddl:rs:t:x")) != -1) {
+	while ((opt = getopt(argc, argv,
+	    "a:B:b:Cc:DdE:e:F:G:g:H:I:ij:k:L:l:m:M:nNo:O:PpR:rs:S:t:T:U:uw:Xxz")) != -1) {
 		switch (opt) {
+		case 'a':
+			proffile = fopen(optarg, "w");
+			if (!proffile) {
+				printf("Failed to open profile `%s'\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'B':
+			btracefile = fopen(optarg, "wb");
+			if (!btracefile) {
+				printf("Failed to open branch trace `%s'\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'b':
+			batchname = optarg;
+			break;
+		case 'C':
+			tracecols = true;
+			break;
 		case 'c':
 			onlytranspile = true;
 			coutfile = fopen(optarg, "wb");
@@ -467,15 +793,107 @@ main(int argc, char **argv)
 			onlydisas = true;
 			tracedisas = true;
 			break;
+		case 'e':
+			statsname = optarg;
+			break;
+		case 'E':
+			statsms = atoi(optarg);
+			if (statsms == 0)
+				usage();
+			break;
+		case 'F':
+			flightn = atoi(optarg);
+			break;
+		case 'G':
+			if (!search_goal(optarg)) {
+				printf("Bad search goal `%s'\n", optarg);
+				exit(1);
+			}
+			searchgoal = true;
+			break;
+		case 'g':
+			stackfile = fopen(optarg, "w");
+			if (!stackfile) {
+				printf("Failed to open stack samples `%s'\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			samplehz = atoi(optarg);
+			if (samplehz == 0 || samplehz > 1000000)
+				usage();
+			break;
+		case 'I':
+			idlesec = atoi(optarg);
+			break;
+		case 'i':
+			traceidx = true;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads == 0)
+				usage();
+			break;
+		case 'k':
+			interval = atoll(optarg);
+			if (interval == 0)
+				usage();
+			break;
+		case 'L':
+			lockstep = atoll(optarg);
+			if (lockstep == 0)
+				usage();
+			break;
 		case 'l':
 			insnlimit = atoll(optarg);
 			break;
+		case 'm':
+			heatname = optarg;
+			break;
+		case 'M':
+			heatrate = atoi(optarg);
+			if (heatrate == 0)
+				usage();
+			break;
+		case 'n':
+			bootcache = false;
+			break;
+		case 'N':
+			bootrefresh = true;
+			break;
+		case 'o':
+			shmname = optarg;
+			break;
+		case 'O':
+			shmint = atoll(optarg);
+			if (shmint == 0)
+				usage();
+			break;
+		case 'P':
+			replay = true;
+			break;
+		case 'p':
+			scripted = true;
+			break;
+		case 'R':
+			searchlo = strtol(optarg, &end, 0);
+			searchhi = searchlo;
+			if (*end == ':')
+				searchhi = strtol(end + 1, &end, 0);
+			if (*end != 0 || searchlo < 0 || searchhi < searchlo ||
+			    searchhi > INT16_MAX)
+				usage();
+			break;
 		case 'r':
 			restore = true;
 			break;
 		case 's':
 			r7 = atoll(optarg);
 			break;
+		case 'S':
+			seek = atoll(optarg);
+			break;
 		case 't':
 			tracefile = fopen(optarg, "wb");
 			if (!tracefile) {
@@ -484,6 +902,29 @@ main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'T':
+			if (!trace_filter(optarg)) {
+				printf("Bad trace filter `%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'U':
+			servename = optarg;
+			break;
+		case 'u':
+			unpack = true;
+			break;
+		case 'w':
+			logfile = fopen(optarg, "wb");
+			if (!logfile) {
+				printf("Failed to open input log `%s'\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'X':
+			dcache_on = true;
+			break;
 		case 'x':
 			if (tracedisas) {
 				printf("-d and -x are mutually exclusive.\n");
@@ -491,14 +932,78 @@ main(int argc, char **argv)
 			}
 			tracehex = true;
 			break;
+		case 'z':
+			tracez = true;
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
-	if (optind >= argc)
+	if (optind >= argc && batchname == NULL)
 		usage();
+	if ((traceidx || tracecols) && (tracefile == NULL || tracehex ||
+	    tracedisas || onlydisas)) {
+		printf("-i and -C need -t and write binary records.\n");
+		exit(1);
+	}
+	if ((traceidx || tracecols) && !trace_contiguous()) {
+		printf("-i and -C traces only take the insn filter.\n");
+		exit(1);
+	}
+	if (traceidx && tracecols) {
+		printf("-i and -C are mutually exclusive.\n");
+		exit(1);
+	}
+	/* Hooks would see every instruction twice. */
+	if (lockstep && (tracefile != NULL || btracefile != NULL ||
+	    logfile != NULL || proffile != NULL || stackfile != NULL ||
+	    heatname != NULL || shmname != NULL || replay || unpack ||
+	    scripted || onlydisas || onlytranspile)) {
+		printf("-L can't be combined with traces, profiles, input logs, "
+		    "exports or -p.\n");
+		exit(1);
+	}
+	/* Search workers run bare machines, without the hooks. */
+	if (searchlo >= 0 && (lockstep || tracefile != NULL ||
+	    btracefile != NULL || logfile != NULL || proffile != NULL ||
+	    stackfile != NULL || heatname != NULL || shmname != NULL ||
+	    replay || unpack || scripted || onlydisas || onlytranspile)) {
+		printf("-R can't be combined with traces, profiles, input logs, "
+		    "exports, -L or -p.\n");
+		exit(1);
+	}
+	if (searchlo >= 0 && !searchgoal) {
+		printf("-R needs a goal (-G).\n");
+		exit(1);
+	}
+	/* Server sessions run bare machines too. */
+	if (servename != NULL && (lockstep || searchlo >= 0 ||
+	    tracefile != NULL || btracefile != NULL || logfile != NULL ||
+	    proffile != NULL || stackfile != NULL || heatname != NULL ||
+	    shmname != NULL || replay || unpack || scripted || onlydisas ||
+	    onlytranspile)) {
+		printf("-U can't be combined with traces, profiles, input logs, "
+		    "exports, -L, -R or -p.\n");
+		exit(1);
+	}
+	/* Batch jobs, too, and each one names its own machine. */
+	if (batchname != NULL) {
+		if (lockstep || searchlo >= 0 || servename != NULL ||
+		    tracefile != NULL || btracefile != NULL || logfile != NULL ||
+		    proffile != NULL || stackfile != NULL || heatname != NULL ||
+		    shmname != NULL || statsname != NULL || replay || unpack ||
+		    scripted || restore || onlydisas || onlytranspile ||
+		    optind < argc) {
+			printf("-b takes no image, and can't be combined with "
+			    "traces, profiles, input logs, exports, -L, -R, -U, "
+			    "-r or -p.\n");
+			exit(1);
+		}
+		signal(SIGINT, ctrlc_handler);
+		return (batch_run(batchname, nthreads) ? 0 : 1);
+	}
 
 	romfname = argv[optind];
 
@@ -506,11 +1011,21 @@ main(int argc, char **argv)
 	ASSERT(romfile, "fopen");
 
 	init();
-	if (restore)
+	if (!onlydisas && !onlytranspile)
+		flight_init(flightn);
+	if (replay) {
+		/* Stop where we were asked to seek, unless -l says otherwise. */
+		if (seek != 0 && insnlimit == 0)
+			insnlimit = seek;
+		replay_open(romfile, seek);
+	} else if (unpack)
+		btrace_decode_open(romfile);
+	else if (restore)
 		loadrestore(romfile);
 	else
-		loadrom(romfile);
-	fclose(romfile);
+		nwords = loadrom(romfile);
+	if (!replay && !unpack)
+		fclose(romfile);
 
 #if 0
 	/*
@@ -530,13 +1045,78 @@ main(int argc, char **argv)
 	} else if (onlydisas) {
 		pc = 0;
 		tracefile = stdout;
-	} else
+	} else if (unpack) {
+		/* The trace is the point; the guest's output isn't. */
+		tracepc = true;
+		outfile = fopen("/dev/null", "w");
+		ASSERT(outfile != NULL, "fopen: %s", strerror(errno));
+	} else if (!replay)
 		regs[7] = r7;
 
+	if (!onlytranspile && !onlydisas)
+		stats_start(statsname, statsms);
+	trace_open();
+
 	signal(SIGINT, ctrlc_handler);
 	signal(SIGUSR1, save_handler);
+	signal(SIGQUIT, flight_handler);
 
-	emulate();
+#ifndef QUIET
+	printf("Initial register state:\n");
+	print_regs();
+	printf("============================================\n\n");
+#endif
+
+	/*
+	 * A trace, profile or heatmap must cover boot, so it can't come from
+	 * the cache.
+	 */
+	bootended = false;
+	if (bootcache && !restore && !replay && !unpack && !onlytranspile &&
+	    !onlydisas && tracefile == NULL && proffile == NULL &&
+	    stackfile == NULL && heatname == NULL && !scripted &&
+	    servename == NULL)
+		bootended = bootcache_boot(nwords, r7, bootrefresh);
+
+	if (logfile != NULL)
+		record_start(logfile, interval);
+	if (proffile != NULL && !onlytranspile && !onlydisas)
+		prof_open(proffile);
+	if (stackfile != NULL && !onlytranspile && !onlydisas)
+		sample_start(stackfile, samplehz);
+	if (heatname != NULL && !onlytranspile && !onlydisas)
+		heat_open(heatname, heatrate);
+	if (shmname != NULL && !onlytranspile && !onlydisas) {
+		/* Scripted runs switch memory between machines. */
+		if (scripted) {
+			printf("-o and -p are mutually exclusive.\n");
+			exit(1);
+		}
+		shm_export(shmname, shmint);
+	}
+	if (!replay_mode) {
+		trace_start();
+		if (!onlytranspile && !onlydisas) {
+			btrace_start();
+			prof_start();
+		}
+	}
+
+	if (scripted && !onlytranspile && !onlydisas)
+		trie_run(&argv[optind + 1], argc - optind - 1);
+	else if (lockstep) {
+		if (!lockstep_run(lockstep, NULL))
+			exit(1);
+	} else if (searchlo >= 0) {
+		rc = search_run(searchlo, searchhi, nthreads) ? 0 : 1;
+		stats_stop();
+		return (rc);
+	} else if (servename != NULL) {
+		server_run(servename, idlesec);
+		stats_stop();
+		return (0);
+	} else if (!bootended)
+		emulate();
 
 	if (onlytranspile)
 		write_c_footer();
@@ -546,8 +1126,17 @@ main(int argc, char **argv)
 	print_regs();
 	print_ips();
 
-	if (tracefile)
-		fclose(tracefile);
+#ifdef EMU_CYCLES
+	cyc_report(stderr);
+#endif
+	record_stop();
+	stats_stop();
+	shm_close();
+	sample_stop();
+	heat_close();
+	prof_close();
+	btrace_close();
+	trace_close();
 	if (coutfile)
 		fclose(coutfile);
 
@@ -555,6 +1144,43 @@ main(int argc, char **argv)
 }
 #endif
 
+/*
+ * Run decoded instruction 'i'.  Returns false if it is an 'in' that blocked,
+ * leaving pc on it so that it is retried.
+ */
+static inline bool
+emulate1_exec(size_t i, struct instr_decode_common *idc)
+{
+
+	if (unlikely(heat_enabled))
+		heat_insn(pc, instr_size);
+	CYC_LAP(CYC_DECODE);
+	synacor_instr[i].code(idc);
+	CYC_OPLAP(i);
+
+	if (unlikely(in_blocked))
+		return (false);
+	stats_ops[i]++;
+	return (true);
+}
+
+/* Per-instruction hooks, run after pc has advanced. */
+static inline void
+emulate1_hooks(size_t i, const struct instr_decode_common *idc)
+{
+
+	if (likely(flight != NULL))
+		flight_insn(pc_start, idc->instr, idc->args);
+	if (unlikely(prof_on) && INSTR_ENDSBLOCK(i))
+		prof_branch(i);
+	CYC_LAP(CYC_HOOKS);
+	if (unlikely(trace_on))
+		trace_insn(pc_start, i, instr_size);
+	if (unlikely(btrace_active))
+		btrace_insn(idc);
+	CYC_LAP(CYC_TRACE);
+}
+
 void
 emulate1(void)
 {
@@ -562,6 +1188,7 @@ emulate1(void)
 	uint16_t instr;
 	size_t i, j;
 
+	CYC_LAP(CYC_LOOP);
 	pc_start = pc;
 	instr_size = 1;
 
@@ -601,48 +1228,112 @@ emulate1(void)
 			fprintf(coutfile, "\tabort();\n");
 		else
 			synacor_instr[i].transpile(&idc);
-	} else if (!onlydisas)
-		synacor_instr[i].code(&idc);
-	pc += instr_size;
-
-	if (!replay_mode && tracefile) {
-		ASSERT(instr_size > 0 && instr_size < 5, "instr_size: %u",
-		    (uns)instr_size);
-
-		if (onlydisas)
-			fprintf(tracefile, "%05u: ", (uns)pc_start);
-		for (j = 0; j < instr_size; j++) {
-			uint16_t word;
-
-			word = memory[pc_start + j];
-			if (tracedisas) {
-				if (j == 0)
-					fprintf(tracefile, "%s",
-					    synacor_instr[i].name);
-				else
-					printarg(tracefile, word,
-					    j == (instr_size - 1));
-			} else if (tracehex) {
-				fprintf(tracefile, "%04x ", (uns)word);
-			} else {
-				size_t wr;
-				wr = fwrite(&word, 2, 1, tracefile);
-				ASSERT(wr == 1, "fwrite: %s", strerror(errno));
-			}
-		}
-		if (tracehex || tracedisas)
-			fprintf(tracefile, "\n");
+	} else if (!onlydisas) {
+		if (!emulate1_exec(i, &idc))
+			return;
 	}
+	pc += instr_size;
+	emulate1_hooks(i, &idc);
 
 out:
 	if (onlydisas || onlytranspile) {
 		if (onlytranspile && pc > 6073)
 			halted = true;
-		else if (pc >= ARRAYLEN(memory))
+		else if (pc >= MEMWORDS)
 			halted = true;
 	} else
-		ASSERT(pc < ARRAYLEN(memory), "overflow pc");
+		GUEST_ASSERT(pc < MEMWORDS, "overflow pc");
+
+	insns++;
+}
+
+/*
+ * The decode-cached engine.  The interpreter above decodes every instruction
+ * it executes; this one remembers the decode (opcode, length and operand
+ * words) per address, so a loop is decoded once.  Anything that changes
+ * memory under a cached instruction must call dcache_inval().  Each machine
+ * has its own cache, allocated on first use, which vm_switch() swaps with
+ * 'memory'; a different 'memory' under the same cache empties it.
+ */
+struct dcache_ent {
+	uint8_t		de_op;
+	uint8_t		de_size;	/* 0: not cached */
+	uint16_t	de_args[3];
+};
+
+__thread bool		 dcache_on;
+__thread struct dcache_ent *dcache;	/* MEMWORDS entries, or NULL */
+__thread uint16_t	*dcache_mem;
 
+void
+dcache_flush(void)
+{
+
+	if (dcache == NULL) {
+		dcache = malloc(MEMWORDS * sizeof(*dcache));
+		ASSERT(dcache != NULL, "malloc");
+	}
+	memset(dcache, 0, MEMWORDS * sizeof(*dcache));
+	dcache_mem = memory;
+}
+
+/* 'addr' changed; drop every cached instruction that covers it. */
+void
+dcache_inval(uint32_t addr)
+{
+	uint32_t a;
+
+	if (dcache == NULL)
+		return;
+	for (a = addr >= 3 ? addr - 3 : 0; a <= addr; a++)
+		dcache[a].de_size = 0;
+}
+
+static void
+dcache_fill(struct dcache_ent *de)
+{
+	uint16_t instr;
+	size_t i, j;
+
+	instr = memory[pc];
+	for (i = 0; i < ARRAYLEN(synacor_instr); i++)
+		if (synacor_instr[i].icode == instr)
+			break;
+	if (i == ARRAYLEN(synacor_instr))
+		illins(instr);
+
+	memset(de->de_args, 0, sizeof(de->de_args));
+	de->de_op = i;
+	de->de_size = 1 + synacor_instr[i].arguments;
+	for (j = 0; j < synacor_instr[i].arguments; j++)
+		de->de_args[j] = memory[pc + 1 + j];
+}
+
+/* One instruction, with the same effects and hooks as emulate1(). */
+void
+emulate1_cached(void)
+{
+	struct instr_decode_common idc;
+	struct dcache_ent *de;
+
+	CYC_LAP(CYC_LOOP);
+	if (unlikely(memory != dcache_mem))
+		dcache_flush();
+	pc_start = pc;
+	de = &dcache[pc];
+	if (unlikely(de->de_size == 0))
+		dcache_fill(de);
+
+	idc.instr = synacor_instr[de->de_op].icode;
+	memcpy(idc.args, de->de_args, sizeof(idc.args));
+	instr_size = de->de_size;
+
+	if (!emulate1_exec(de->de_op, &idc))
+		return;
+	pc += instr_size;
+	emulate1_hooks(de->de_op, &idc);
+
+	GUEST_ASSERT(pc < MEMWORDS, "overflow pc");
 	insns++;
 }
 
@@ -661,35 +1352,30 @@ void
 emulate(void)
 {
 
-#ifndef QUIET
-	printf("Initial register state:\n");
-	print_regs();
-	printf("============================================\n\n");
+	in_blocked = false;
+#ifdef EMU_CYCLES
+	cyc_start();
 #endif
-
 	while (true) {
 		if (ctrlc) {
 			printf("Got ^C, stopping...\n");
 			abort_nodump();
 		}
 
-#ifndef EMU_CHECK
 		if (replay_mode && insns >= insnreplaylim) {
 			replay_mode = false;
 			insnreplaylim = 0;
+			trace_start();
+			btrace_start();
+			prof_start();
 		}
 
-		if (replay_mode && insnreplaylim < insns) {
-			init();
-			pc = 0;
-			continue;
-		}
-#endif
-
-		if (halted)
-			break;
-
-		emulate1();
+		if (unlikely(insns >= rec_next_ckpt))
+			record_checkpoint();
+		if (unlikely(insns >= trace_next))
+			trace_update();
+		if (unlikely(insns >= shm_next))
+			shm_publish();
 
 		if (halted)
 			break;
@@ -698,6 +1384,14 @@ emulate(void)
 			printf("\nXXX Hit insn limit, halting XXX\n");
 			break;
 		}
+
+		if (dcache_on)
+			emulate1_cached();
+		else
+			emulate1();
+
+		if (halted || in_blocked)
+			break;
 	}
 }
 
@@ -705,6 +1399,8 @@ void __dead2
 _unhandled(const char *f, unsigned l, uint16_t instr)
 {
 
+	if (guest_fault != NULL)
+		longjmp(*guest_fault, 1);
 	printf("%s:%u: Instruction: %#04x @PC=%#06x is not implemented\n",
 	    f, l, (unsigned)instr, (unsigned)pc_start);
 	printf("Raw at PC: ");
@@ -718,6 +1414,8 @@ void __dead2
 _illins(const char *f, unsigned l, uint16_t instr)
 {
 
+	if (guest_fault != NULL)
+		longjmp(*guest_fault, 1);
 	printf("%s:%u: ILLEGAL Instruction: %u @PC=%u\n",
 	    f, l, (unsigned)instr, (unsigned)pc_start);
 	printf("Raw at PC: ");
@@ -733,6 +1431,18 @@ abort_nodump(void)
 
 	print_regs();
 	print_ips();
+	fflush(stdout);
+	flight_dump(STDERR_FILENO);
+#ifdef EMU_CYCLES
+	cyc_report(stderr);
+#endif
+	stats_stop();
+	shm_close();
+	sample_stop();
+	heat_close();
+	prof_close();
+	btrace_close();
+	trace_close();
 
 	exit(1);
 }
@@ -799,7 +1509,7 @@ now(void)
 	struct timespec ts;
 	int rc;
 
-	rc = clock_gettime(CLOCK_REALTIME, &ts);
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
 	ASSERT(rc == 0, "clock_gettime: %d:%s", errno, strerror(errno));
 
 	return ((uint64_t)sec * ts.tv_sec + (ts.tv_nsec / 1000));
@@ -0,0 +1,326 @@
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Execution profiler.
+ *
+ * Counting happens only at control transfers: emulate1() calls prof_branch()
+ * after each jmp, jt, jf, call or ret, which counts an entry into the
+ * straight-line run starting at the new pc, the jt/jf outcome, and call/ret
+ * on a shadow call stack for per-target inclusive and exclusive instruction
+ * counts.  Per-instruction counts are recovered when the report is written by
+ * walking each run forward from its start, which assumes the code wasn't
+ * rewritten while it ran.  The run in progress when profiling stops is only
+ * walked as far as pc.
+ */
+
+struct prof_frame {
+	uint64_t	 pf_entry;	/* insns at the call */
+	uint64_t	 pf_child;	/* Instructions in nested calls */
+	uint16_t	 pf_target;
+};
+
+bool				 prof_on;
+
+static FILE			*proffile;
+static uint64_t			 prof_first;
+static uint32_t			 prof_last;	/* Start of the current run */
+static uint64_t			*prof_entries;
+static uint64_t			*prof_taken;
+static uint64_t			*prof_nottaken;
+static uint64_t			*prof_calls;
+static uint64_t			*prof_incl;
+static uint64_t			*prof_excl;
+static struct prof_frame	*frames;
+static size_t			 nframes;
+static size_t			 aframes;
+
+static uint64_t *
+prof_array(void)
+{
+	uint64_t *a;
+
+	a = calloc(MEMWORDS, sizeof(*a));
+	ASSERT(a != NULL, "calloc");
+	return (a);
+}
+
+/* Profile the run, writing the report to 'f' at prof_close(). */
+void
+prof_open(FILE *f)
+{
+
+	proffile = f;
+	prof_entries = prof_array();
+	prof_taken = prof_array();
+	prof_nottaken = prof_array();
+	prof_calls = prof_array();
+	prof_incl = prof_array();
+	prof_excl = prof_array();
+}
+
+/* Start counting at the current instruction. */
+void
+prof_start(void)
+{
+
+	if (proffile == NULL || prof_on)
+		return;
+	prof_on = true;
+	prof_first = insns;
+	prof_entries[pc]++;
+	prof_last = pc;
+}
+
+static void
+prof_ret(uint64_t now)
+{
+	struct prof_frame *pf;
+	uint64_t incl;
+
+	pf = &frames[--nframes];
+	incl = now - pf->pf_entry;
+	prof_calls[pf->pf_target]++;
+	prof_incl[pf->pf_target] += incl;
+	prof_excl[pf->pf_target] += incl - pf->pf_child;
+	if (nframes > 0)
+		frames[nframes - 1].pf_child += incl;
+}
+
+/* Called by emulate1() after a control transfer, with pc at its target. */
+void
+prof_branch(unsigned op)
+{
+
+	switch (op) {
+	case 7:		/* jt */
+	case 8:		/* jf */
+		if (pc != pc_start + 3)
+			prof_taken[pc_start]++;
+		else
+			prof_nottaken[pc_start]++;
+		break;
+	case 17:	/* call */
+		if (nframes == aframes) {
+			aframes = aframes ? aframes * 2 : 64;
+			frames = realloc(frames, aframes * sizeof(*frames));
+			ASSERT(frames != NULL, "realloc");
+		}
+		frames[nframes].pf_entry = insns;
+		frames[nframes].pf_child = 0;
+		frames[nframes].pf_target = pc;
+		nframes++;
+		break;
+	case 18:	/* ret */
+		/* A ret without a call we saw has no target to charge. */
+		if (nframes > 0)
+			prof_ret(insns);
+		break;
+	}
+
+	if (!halted) {
+		prof_entries[pc]++;
+		prof_last = pc;
+	}
+}
+
+/* synacor_instr[] index of the instruction at 'addr', or -1. */
+static int
+prof_decode(uint32_t addr)
+{
+
+	if (memory[addr] >= SYNACOR_NINSTR)
+		return (-1);
+	if (addr + synacor_instr[memory[addr]].arguments >= MEMWORDS)
+		return (-1);
+	return (memory[addr]);
+}
+
+/*
+ * Instructions in the straight-line run starting at 'addr', stopping short of
+ * 'end' if the run reaches it.
+ */
+static unsigned
+prof_runlen(uint32_t addr, uint32_t end, uint64_t *counts, uint64_t n)
+{
+	unsigned len;
+	int op;
+
+	for (len = 0; addr < MEMWORDS && addr != end; len++) {
+		op = prof_decode(addr);
+		if (op < 0)
+			break;
+		if (counts != NULL)
+			counts[addr] += n;
+		if (op == 0 || INSTR_ENDSBLOCK(op)) {
+			len++;
+			break;
+		}
+		addr += 1 + synacor_instr[op].arguments;
+	}
+	return (len);
+}
+
+static void
+prof_disas(char *buf, size_t sz, uint32_t addr)
+{
+	size_t n;
+	int op;
+	unsigned j;
+
+	op = prof_decode(addr);
+	if (op < 0) {
+		snprintf(buf, sz, "illegal %u", (uns)memory[addr]);
+		return;
+	}
+	n = snprintf(buf, sz, "%s", synacor_instr[op].name);
+	for (j = 0; j < synacor_instr[op].arguments; j++)
+		n += fmtarg(buf + n, memory[addr + 1 + j],
+		    j == synacor_instr[op].arguments - 1u);
+	buf[n] = 0;
+}
+
+/* Print the 'n' addresses with the largest nonzero 'key'. */
+static void
+prof_top(const uint64_t *key, unsigned n, void (*print)(uint32_t))
+{
+	uint64_t *k, best;
+	uint32_t a, besta;
+	unsigned i;
+
+	k = malloc(MEMWORDS * sizeof(*k));
+	ASSERT(k != NULL, "malloc");
+	memcpy(k, key, MEMWORDS * sizeof(*k));
+	for (i = 0; i < n; i++) {
+		best = 0;
+		besta = 0;
+		for (a = 0; a < MEMWORDS; a++)
+			if (k[a] > best) {
+				best = k[a];
+				besta = a;
+			}
+		if (best == 0)
+			break;
+		print(besta);
+		k[besta] = 0;
+	}
+	free(k);
+}
+
+static uint64_t	*blockcost;
+static uint64_t	*icounts;
+
+static void
+prof_printblock(uint32_t a)
+{
+	char dis[128];
+
+	prof_disas(dis, sizeof(dis), a);
+	fprintf(proffile, "%14ju %10ju x %-5u %05u: %s\n",
+	    (uintmax_t)blockcost[a], (uintmax_t)prof_entries[a],
+	    prof_runlen(a, MEMWORDS, NULL, 0), (uns)a, dis);
+}
+
+static void
+prof_printcall(uint32_t a)
+{
+
+	fprintf(proffile, "%14ju %14ju %10ju %05u\n", (uintmax_t)prof_incl[a],
+	    (uintmax_t)prof_excl[a], (uintmax_t)prof_calls[a], (uns)a);
+}
+
+/* Write the report and stop profiling. */
+void
+prof_close(void)
+{
+	uint64_t total, top, full;
+	uint32_t a;
+	char dis[128], note[160];
+	size_t n;
+	bool gap;
+	int op;
+
+	if (proffile == NULL)
+		return;
+
+	/* Charge calls still open, outermost last. */
+	while (nframes > 0)
+		prof_ret(insns);
+
+	blockcost = prof_array();
+	icounts = prof_array();
+	for (a = 0; a < MEMWORDS; a++) {
+		if (prof_entries[a] == 0)
+			continue;
+		/* The last run stopped at pc (-l, ^C or 'in'), maybe early. */
+		full = prof_entries[a];
+		if (a == prof_last) {
+			full--;
+			blockcost[a] = prof_runlen(a, pc, icounts, 1);
+		}
+		blockcost[a] += full * prof_runlen(a, MEMWORDS, icounts, full);
+	}
+
+	total = insns - prof_first;
+	top = total;
+	for (a = 0; a < MEMWORDS; a++)
+		top -= prof_excl[a];
+
+	fprintf(proffile, "Profile of %ju instructions, %ju outside any "
+	    "call.\n\n", (uintmax_t)total, (uintmax_t)top);
+	fprintf(proffile, "Hottest blocks:\n%14s %10s   %-5s %s\n",
+	    "insns", "entries", "len", "start");
+	prof_top(blockcost, 20, prof_printblock);
+	fprintf(proffile, "\nHottest call targets:\n%14s %14s %10s %s\n",
+	    "inclusive", "exclusive", "calls", "target");
+	prof_top(prof_incl, 20, prof_printcall);
+
+	fprintf(proffile, "\nListing:\n");
+	gap = false;
+	for (a = 0; a < MEMWORDS; ) {
+		if (icounts[a] == 0) {
+			gap = true;
+			a++;
+			continue;
+		}
+		if (gap)
+			fprintf(proffile, "%14s\n", "...");
+		gap = false;
+
+		note[0] = 0;
+		n = 0;
+		if (prof_calls[a] > 0)
+			n += snprintf(note + n, sizeof(note) - n,
+			    " ; called %ju, incl %ju, excl %ju",
+			    (uintmax_t)prof_calls[a], (uintmax_t)prof_incl[a],
+			    (uintmax_t)prof_excl[a]);
+		if (prof_taken[a] + prof_nottaken[a] > 0)
+			snprintf(note + n, sizeof(note) - n,
+			    " ; taken %ju, not taken %ju",
+			    (uintmax_t)prof_taken[a],
+			    (uintmax_t)prof_nottaken[a]);
+		prof_disas(dis, sizeof(dis), a);
+		fprintf(proffile, "%14ju %05u: %-*s%s\n", (uintmax_t)icounts[a],
+		    (uns)a, note[0] ? 32 : 0, dis, note);
+
+		op = prof_decode(a);
+		a += op < 0 ? 1 : 1 + synacor_instr[op].arguments;
+	}
+
+	if (fclose(proffile) != 0)
+		fprintf(stderr, "Failed to write profile: %s\n",
+		    strerror(errno));
+	proffile = NULL;
+	prof_on = false;
+	free(blockcost);
+	free(icounts);
+	free(prof_entries);
+	free(prof_taken);
+	free(prof_nottaken);
+	free(prof_calls);
+	free(prof_incl);
+	free(prof_excl);
+	free(frames);
+	frames = NULL;
+	nframes = aframes = 0;
+}
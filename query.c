@@ -0,0 +1,417 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "emu.h"
+#include "instr.h"
+#include "trace.h"
+
+/*
+ * synacor-query: filter and aggregate columnar (-C) traces.
+ *
+ * A query is a conjunction of range filters on columns, plus an optional
+ * group-by column.  Each chunk inflates just the columns the query names and
+ * builds a row mask with SIMD range compares; counting and grouping then read
+ * the mask.  Chunks are independent, so they are spread over threads.
+ */
+
+typedef uint16_t v16 __attribute__((vector_size(32)));
+#define	VLANES		(sizeof(v16) / sizeof(uint16_t))
+
+struct filter {
+	enum tcol	 fi_col;
+	uint16_t	 fi_lo;
+	uint16_t	 fi_hi;
+};
+
+struct worker {
+	pthread_t	 wk_thread;
+	uint64_t	 wk_next;	/* Chunk */
+	uint64_t	 wk_stride;
+	uint64_t	 wk_count;
+	uint64_t	*wk_groups;	/* Indexed by group column value */
+	v16		*wk_cols[TC_NCOLS];
+	v16		*wk_mask;
+};
+
+static const char *colnames[TC_NCOLS] = {
+	[TC_PC] = "pc",
+	[TC_OP] = "op",
+	[TC_A] = "a",
+	[TC_B] = "b",
+	[TC_C] = "c",
+	[TC_R0] = "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+	[TC_RW] = "rw",
+	[TC_RWVAL] = "rwval",
+	[TC_MWADDR] = "mwaddr",
+	[TC_MWVAL] = "mwval",
+};
+
+static struct tmap		 tm;
+static const struct tcol_entry	*idx;
+static struct filter		 filters[TC_NCOLS * 2];
+static unsigned			 nfilters;
+static int			 groupcol = -1;
+static uint64_t			 first, last = UINT64_MAX;
+
+static void __dead2
+qusage(void)
+{
+
+	printf("usage: synacor-query FLAGS tracefile\n"
+		"\n"
+		"  FLAGS:\n"
+		"    -g=COL        Count matching rows per value of COL\n"
+		"    -i=<N>        Start at instruction N\n"
+		"    -j=<N>        Stop before instruction N\n"
+		"    -l            List matching rows\n"
+		"    -n=<N>        Print at most N rows or groups (default 20)\n"
+		"    -w=COL=V[:W]  Only rows where COL is V (or in [V, W])\n"
+		"\n"
+		"  COL is one of pc op a b c r0..r7 rw rwval mwaddr mwval.\n"
+		"  Values are numbers, instruction names, or rN (register N).\n");
+	exit(1);
+}
+
+static int
+parsecol(const char *name, size_t len)
+{
+	unsigned c;
+
+	for (c = 0; c < TC_NCOLS; c++)
+		if (strlen(colnames[c]) == len &&
+		    strncmp(colnames[c], name, len) == 0)
+			return (c);
+	fprintf(stderr, "Unknown column `%.*s'\n", (int)len, name);
+	qusage();
+}
+
+static uint16_t
+parseval(enum tcol col, const char *val)
+{
+	unsigned i;
+	char *end;
+	long v;
+
+	for (i = 0; i < SYNACOR_NINSTR; i++)
+		if (col == TC_OP && strcmp(synacor_instr[i].name, val) == 0)
+			return (synacor_instr[i].icode);
+
+	/* Registers are numbered 0-7 in rw, and encoded in operands. */
+	if (val[0] == 'r' && val[1] >= '0' && val[1] <= '7' && val[2] == 0)
+		return ((col == TC_RW ? 0 : 32768) + val[1] - '0');
+
+	v = strtol(val, &end, 0);
+	if (*end != 0 || v < 0 || v > UINT16_MAX) {
+		fprintf(stderr, "Bad value `%s'\n", val);
+		qusage();
+	}
+	return (v);
+}
+
+static void
+parsefilter(char *arg)
+{
+	struct filter *fi;
+	char *eq, *colon;
+
+	eq = strchr(arg, '=');
+	if (eq == NULL || nfilters == ARRAYLEN(filters))
+		qusage();
+	fi = &filters[nfilters++];
+	fi->fi_col = parsecol(arg, eq - arg);
+	colon = strchr(eq + 1, ':');
+	if (colon != NULL)
+		*colon = 0;
+	fi->fi_lo = parseval(fi->fi_col, eq + 1);
+	fi->fi_hi = colon != NULL ? parseval(fi->fi_col, colon + 1) : fi->fi_lo;
+}
+
+static bool
+needcol(unsigned c)
+{
+	unsigned i;
+
+	if ((int)c == groupcol)
+		return (true);
+	for (i = 0; i < nfilters; i++)
+		if (filters[i].fi_col == c)
+			return (true);
+	return (false);
+}
+
+static void
+loadcol(struct worker *wk, uint64_t chunk, unsigned c)
+{
+	const struct tcol_entry *te;
+	uLongf rawlen;
+	int rc;
+
+	te = &idx[chunk];
+	ASSERT(te->tc_off[c] + te->tc_len[c] <= tm.tm_len &&
+	    te->tc_nrows <= TIDX_CHUNK, "corrupt chunk %ju",
+	    (uintmax_t)chunk);
+	rawlen = te->tc_nrows * sizeof(uint16_t);
+	rc = uncompress((void *)wk->wk_cols[c], &rawlen,
+	    tm.tm_map + te->tc_off[c], te->tc_len[c]);
+	ASSERT(rc == Z_OK && rawlen == te->tc_nrows * sizeof(uint16_t),
+	    "corrupt chunk %ju", (uintmax_t)chunk);
+}
+
+/* Build the row mask of 'chunk'; returns the number of mask vectors. */
+static size_t
+filterchunk(struct worker *wk, uint64_t chunk)
+{
+	const struct tcol_entry *te;
+	const struct filter *fi;
+	const v16 *col;
+	v16 base, span;
+	uint16_t *m;
+	uint64_t lo, hi, r;
+	size_t nv, v;
+	unsigned c, i;
+
+	te = &idx[chunk];
+	for (c = 0; c < TC_NCOLS; c++)
+		if (needcol(c))
+			loadcol(wk, chunk, c);
+
+	/* Rows past the end of the chunk or outside [first, last) are off. */
+	nv = (te->tc_nrows + VLANES - 1) / VLANES;
+	lo = first > te->tc_insn ? first - te->tc_insn : 0;
+	hi = min(last - te->tc_insn, (uint64_t)te->tc_nrows);
+	m = (uint16_t *)wk->wk_mask;
+	for (r = 0; r < nv * VLANES; r++)
+		m[r] = (r >= lo && r < hi) ? 0xffff : 0;
+
+	for (i = 0; i < nfilters; i++) {
+		fi = &filters[i];
+		col = wk->wk_cols[fi->fi_col];
+		/* One unsigned compare tests lo <= x <= hi. */
+		base = fi->fi_lo - (v16){};
+		span = (uint16_t)(fi->fi_hi - fi->fi_lo) - (v16){};
+		for (v = 0; v < nv; v++)
+			wk->wk_mask[v] &= (v16)((col[v] - base) <= span);
+	}
+	return (nv);
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *wk = arg;
+	const uint16_t *m, *g;
+	v16 acc;
+	uint64_t chunk;
+	size_t nv, v, r;
+	unsigned j;
+
+	for (chunk = wk->wk_next; chunk < tm.tm_nchunks;
+	    chunk += wk->wk_stride) {
+		if (idx[chunk].tc_insn >= last ||
+		    idx[chunk].tc_insn + idx[chunk].tc_nrows <= first)
+			continue;
+		nv = filterchunk(wk, chunk);
+
+		if (groupcol < 0) {
+			/*
+			 * Lanes are 0 or 0xffff; sum the low bits.  A chunk
+			 * is too short for a lane to overflow.
+			 */
+			acc = (v16){};
+			for (v = 0; v < nv; v++)
+				acc += wk->wk_mask[v] & 1;
+			for (j = 0; j < VLANES; j++)
+				wk->wk_count += acc[j];
+			continue;
+		}
+
+		m = (const uint16_t *)wk->wk_mask;
+		g = (const uint16_t *)wk->wk_cols[groupcol];
+		for (r = 0; r < nv * VLANES; r++)
+			if (m[r] != 0) {
+				wk->wk_groups[g[r]]++;
+				wk->wk_count++;
+			}
+	}
+	return (NULL);
+}
+
+static struct worker *
+worker_new(uint64_t next, uint64_t stride)
+{
+	struct worker *wk;
+	unsigned c;
+
+	wk = calloc(1, sizeof(*wk));
+	ASSERT(wk != NULL, "calloc");
+	wk->wk_next = next;
+	wk->wk_stride = stride;
+	for (c = 0; c < TC_NCOLS; c++) {
+		if (!needcol(c))
+			continue;
+		wk->wk_cols[c] = aligned_alloc(sizeof(v16),
+		    TIDX_CHUNK * sizeof(uint16_t));
+		ASSERT(wk->wk_cols[c] != NULL, "aligned_alloc");
+	}
+	wk->wk_mask = aligned_alloc(sizeof(v16), TIDX_CHUNK * sizeof(uint16_t));
+	ASSERT(wk->wk_mask != NULL, "aligned_alloc");
+	if (groupcol >= 0) {
+		wk->wk_groups = calloc(UINT16_MAX + 1, sizeof(uint64_t));
+		ASSERT(wk->wk_groups != NULL, "calloc");
+	}
+	return (wk);
+}
+
+static void
+printrow(const struct worker *wk, uint64_t chunk, size_t r)
+{
+	unsigned c;
+
+	printf("%ju", (uintmax_t)(idx[chunk].tc_insn + r));
+	for (c = 0; c < TC_NCOLS; c++) {
+		if (wk->wk_cols[c] == NULL)
+			continue;
+		printf(" %s=%u", colnames[c],
+		    (uns)((const uint16_t *)wk->wk_cols[c])[r]);
+	}
+	printf("\n");
+}
+
+/* Print matching rows in order, with every column. */
+static void
+listrows(uint64_t limit)
+{
+	struct worker *wk;
+	const uint16_t *m;
+	uint64_t chunk, n;
+	size_t nv, r;
+	unsigned c;
+	bool loaded;
+
+	wk = worker_new(0, 1);
+	for (c = 0; c < TC_NCOLS; c++)
+		if (wk->wk_cols[c] == NULL) {
+			wk->wk_cols[c] = aligned_alloc(sizeof(v16),
+			    TIDX_CHUNK * sizeof(uint16_t));
+			ASSERT(wk->wk_cols[c] != NULL, "aligned_alloc");
+		}
+
+	n = 0;
+	for (chunk = 0; chunk < tm.tm_nchunks && n < limit; chunk++) {
+		if (idx[chunk].tc_insn >= last ||
+		    idx[chunk].tc_insn + idx[chunk].tc_nrows <= first)
+			continue;
+		nv = filterchunk(wk, chunk);
+		m = (const uint16_t *)wk->wk_mask;
+		loaded = false;
+		for (r = 0; r < nv * VLANES && n < limit; r++) {
+			if (m[r] == 0)
+				continue;
+			/* Only chunks with a match need the other columns. */
+			if (!loaded) {
+				for (c = 0; c < TC_NCOLS; c++)
+					if (!needcol(c))
+						loadcol(wk, chunk, c);
+				loaded = true;
+			}
+			printrow(wk, chunk, r);
+			n++;
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct worker **wks;
+	uint64_t *groups, count, limit, best;
+	unsigned nthreads, t, k;
+	size_t g, bestg;
+	bool list;
+	long ncpu;
+	int opt, rc;
+
+	list = false;
+	limit = 20;
+	while ((opt = getopt(argc, argv, "g:i:j:ln:w:")) != -1) {
+		switch (opt) {
+		case 'g':
+			groupcol = parsecol(optarg, strlen(optarg));
+			break;
+		case 'i':
+			first = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			last = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			parsefilter(optarg);
+			break;
+		default:
+			qusage();
+			break;
+		}
+	}
+	if (optind != argc - 1 || (list && groupcol >= 0))
+		qusage();
+
+	tmap_open(&tm, argv[optind], TCOL_MAGIC, sizeof(struct tcol_entry));
+	idx = tm.tm_idx;
+
+	if (list) {
+		listrows(limit);
+		return (0);
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? min((uint64_t)ncpu, tm.tm_nchunks) : 1;
+	if (nthreads == 0)
+		nthreads = 1;
+	wks = calloc(nthreads, sizeof(*wks));
+	ASSERT(wks != NULL, "calloc");
+	for (t = 0; t < nthreads; t++) {
+		wks[t] = worker_new(t, nthreads);
+		rc = pthread_create(&wks[t]->wk_thread, NULL, worker_run,
+		    wks[t]);
+		ASSERT(rc == 0, "pthread_create: %s", strerror(rc));
+	}
+
+	count = 0;
+	groups = wks[0]->wk_groups;
+	for (t = 0; t < nthreads; t++) {
+		pthread_join(wks[t]->wk_thread, NULL);
+		count += wks[t]->wk_count;
+		if (groupcol >= 0 && t > 0)
+			for (g = 0; g <= UINT16_MAX; g++)
+				groups[g] += wks[t]->wk_groups[g];
+	}
+
+	printf("%ju rows\n", (uintmax_t)count);
+	if (groupcol < 0)
+		return (0);
+
+	/* Top 'limit' groups by count. */
+	for (k = 0; k < limit; k++) {
+		best = 0;
+		bestg = 0;
+		for (g = 0; g <= UINT16_MAX; g++)
+			if (groups[g] > best) {
+				best = groups[g];
+				bestg = g;
+			}
+		if (best == 0)
+			break;
+		printf("%s=%zu\t%ju\n", colnames[groupcol], bestg,
+		    (uintmax_t)best);
+		groups[bestg] = 0;
+	}
+	return (0);
+}
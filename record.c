@@ -0,0 +1,367 @@
+#include <zlib.h>
+
+#include "emu.h"
+
+/*
+ * Input record and replay.
+ *
+ * A run is deterministic given its starting state and the bytes 'in' returns,
+ * so the log holds exactly that: a checkpoint of the machine when recording
+ * starts, every input byte tagged with the instruction that consumed it, and
+ * further checkpoints every rec_interval instructions so that a replay can
+ * seek by restoring the nearest one instead of executing from the start.
+ *
+ * File format is:
+ *
+ * magic:u32 || interval:u64 || record*
+ *
+ * Each record starts with a varint holding (delta << 1 | is_checkpoint), where
+ * delta is the instruction count since the previous record.  Then:
+ *
+ * input:      byte:u8
+ * checkpoint: ckpt_write() image
+ */
+#define	REC_MAGIC		0x524e5953	/* "SYNR" */
+
+FILE		*recfile;
+uint64_t	 rec_interval = 100000000;
+uint64_t	 rec_next_ckpt = UINT64_MAX;
+static uint64_t	 rec_last;
+
+FILE		*replayfile;
+static uint64_t	 replay_last;
+
+struct ckpt {
+	uint64_t	 ck_insn;
+	off_t		 ck_off;	/* Of the record */
+};
+
+static void
+putvarint(FILE *f, uint64_t v)
+{
+
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static bool
+getvarint(FILE *f, uint64_t *v)
+{
+	unsigned shift;
+	int c;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		c = fgetc(f);
+		if (c == EOF)
+			return (false);
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+static size_t
+ckpt_rawsize(size_t depth)
+{
+
+	return (sizeof(uint64_t) + sizeof(uint32_t) + MEMBYTES +
+	    sizeof(regs) + depth * sizeof(*stack));
+}
+
+/*
+ * Write the machine state to 'f' as len:u32 || zlib(stack_depth:u64 || pc:u32
+ * || memory[] || regs[] || stack[]).
+ */
+void
+ckpt_write(FILE *f)
+{
+	unsigned char *raw, *z, *p;
+	uint64_t sd;
+	uint32_t pc_tmp, zlen32;
+	uLongf zlen;
+	size_t rawlen;
+	int rc;
+
+	rawlen = ckpt_rawsize(stack_depth);
+	zlen = compressBound(rawlen);
+	raw = malloc(rawlen);
+	z = malloc(zlen);
+	ASSERT(raw != NULL && z != NULL, "malloc");
+
+	p = raw;
+	sd = stack_depth;
+	memcpy(p, &sd, sizeof(sd));
+	p += sizeof(sd);
+	pc_tmp = pc;
+	memcpy(p, &pc_tmp, sizeof(pc_tmp));
+	p += sizeof(pc_tmp);
+	memcpy(p, memory, MEMBYTES);
+	p += MEMBYTES;
+	memcpy(p, regs, sizeof(regs));
+	p += sizeof(regs);
+	if (stack_depth > 0)
+		memcpy(p, stack, stack_depth * sizeof(*stack));
+
+	rc = compress2(z, &zlen, raw, rawlen, Z_BEST_SPEED);
+	ASSERT(rc == Z_OK, "compress2: %d", rc);
+
+	zlen32 = zlen;
+	fwrite(&zlen32, sizeof(zlen32), 1, f);
+	fwrite(z, 1, zlen, f);
+
+	free(raw);
+	free(z);
+}
+
+void
+record_checkpoint(void)
+{
+
+	putvarint(recfile, (insns - rec_last) << 1 | 1);
+	ckpt_write(recfile);
+	rec_last = insns;
+	rec_next_ckpt = insns + rec_interval;
+}
+
+/* Start logging input to 'f', checkpointing every 'interval' instructions. */
+void
+record_start(FILE *f, uint64_t interval)
+{
+	uint64_t iv;
+	uint32_t magic;
+
+	ASSERT(interval > 0, "checkpoint interval must be positive");
+
+	recfile = f;
+	rec_interval = interval;
+	magic = REC_MAGIC;
+	iv = interval;
+	fwrite(&magic, sizeof(magic), 1, recfile);
+	fwrite(&iv, sizeof(iv), 1, recfile);
+
+	rec_last = insns;
+	record_checkpoint();
+}
+
+/* Called by instr_in() for each byte consumed. */
+void
+record_input(uint8_t c)
+{
+
+	putvarint(recfile, (insns - rec_last) << 1);
+	fputc(c, recfile);
+	rec_last = insns;
+}
+
+void
+record_stop(void)
+{
+
+	if (recfile == NULL)
+		return;
+	if (fclose(recfile) != 0)
+		fprintf(stderr, "Failed to write input log: %s\n",
+		    strerror(errno));
+	recfile = NULL;
+	rec_next_ckpt = UINT64_MAX;
+}
+
+/* Load a ckpt_write() image from 'f'; returns NULL or an error. */
+const char *
+ckpt_read(FILE *f)
+{
+	unsigned char *raw, *z, *p;
+	uint64_t sd;
+	uint32_t pc_tmp, zlen32;
+	uLongf rawlen;
+	int rc;
+
+	if (fread(&zlen32, sizeof(zlen32), 1, f) != 1)
+		return ("short checkpoint");
+	z = malloc(zlen32);
+	ASSERT(z != NULL, "malloc");
+	if (fread(z, 1, zlen32, f) != zlen32) {
+		free(z);
+		return ("short checkpoint");
+	}
+
+	/* Inflate the fixed part first to learn the stack depth. */
+	rawlen = ckpt_rawsize(0);
+	raw = malloc(rawlen);
+	ASSERT(raw != NULL, "malloc");
+	rc = uncompress(raw, &rawlen, z, zlen32);
+	if (rc == Z_BUF_ERROR) {
+		memcpy(&sd, raw, sizeof(sd));
+		if (sd > SIZE_MAX / sizeof(*stack) - ckpt_rawsize(0)) {
+			free(raw);
+			free(z);
+			return ("corrupt checkpoint");
+		}
+		rawlen = ckpt_rawsize(sd);
+		raw = realloc(raw, rawlen);
+		ASSERT(raw != NULL, "realloc");
+		rc = uncompress(raw, &rawlen, z, zlen32);
+	}
+	free(z);
+	if (rc != Z_OK) {
+		free(raw);
+		return ("corrupt checkpoint");
+	}
+
+	p = raw;
+	memcpy(&sd, p, sizeof(sd));
+	p += sizeof(sd);
+	if (rawlen != ckpt_rawsize(sd)) {
+		free(raw);
+		return ("corrupt checkpoint");
+	}
+	memcpy(&pc_tmp, p, sizeof(pc_tmp));
+	p += sizeof(pc_tmp);
+	memcpy(memory, p, MEMBYTES);
+	if (dcache_on)
+		dcache_flush();
+	p += MEMBYTES;
+	memcpy(regs, p, sizeof(regs));
+	p += sizeof(regs);
+
+	pc = pc_tmp;
+	halted = false;
+	stack_depth = sd;
+	if (stack_alloc < sd) {
+		stack_alloc = sd;
+		stack = realloc(stack, stack_alloc * sizeof(*stack));
+		ASSERT(stack != NULL, "realloc");
+	}
+	if (sd > 0)
+		memcpy(stack, p, sd * sizeof(*stack));
+
+	free(raw);
+	return (NULL);
+}
+
+/*
+ * Prepare to replay the log 'f': restore the last checkpoint at or before
+ * instruction 'target', and feed 'in' from the log from there on.  Replay is
+ * silent (untraced) until 'target'.
+ */
+void
+replay_open(FILE *f, uint64_t target)
+{
+	struct ckpt *ckpts;
+	size_t nckpts, ackpts, i;
+	const char *error;
+	uint64_t v, insn, iv;
+	uint32_t magic, len;
+	off_t off;
+
+	if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != REC_MAGIC ||
+	    fread(&iv, sizeof(iv), 1, f) != 1) {
+		fprintf(stderr, "Couldn't read input log: bad header\n");
+		exit(1);
+	}
+
+	/* Index the checkpoints, hopping over their payloads. */
+	ckpts = NULL;
+	nckpts = ackpts = 0;
+	insn = 0;
+	while (true) {
+		off = ftello(f);
+		if (!getvarint(f, &v))
+			break;
+		insn += v >> 1;
+		if ((v & 1) == 0) {
+			if (fgetc(f) == EOF)
+				break;
+			continue;
+		}
+
+		if (nckpts == ackpts) {
+			ackpts = ackpts ? ackpts * 2 : 16;
+			ckpts = realloc(ckpts, ackpts * sizeof(*ckpts));
+			ASSERT(ckpts != NULL, "realloc");
+		}
+		ckpts[nckpts].ck_insn = insn;
+		ckpts[nckpts].ck_off = off;
+		nckpts++;
+
+		if (fread(&len, sizeof(len), 1, f) != 1 ||
+		    fseeko(f, len, SEEK_CUR) != 0)
+			break;
+	}
+	if (nckpts == 0) {
+		fprintf(stderr, "Couldn't read input log: no checkpoint\n");
+		exit(1);
+	}
+
+	for (i = nckpts; i > 1; i--)
+		if (ckpts[i - 1].ck_insn <= target)
+			break;
+	i--;
+
+	clearerr(f);
+	if (fseeko(f, ckpts[i].ck_off, SEEK_SET) != 0 ||
+	    !getvarint(f, &v)) {
+		fprintf(stderr, "Couldn't read input log: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+	error = ckpt_read(f);
+	if (error != NULL) {
+		fprintf(stderr, "Couldn't read input log: %s\n", error);
+		exit(1);
+	}
+	insns = ckpts[i].ck_insn;
+	replay_last = insns;
+	printf("Resumed from checkpoint at instruction %ju of %zu.\n",
+	    (uintmax_t)insns, nckpts);
+
+	free(ckpts);
+	replayfile = f;
+	replay_mode = (target > insns);
+	insnreplaylim = target;
+}
+
+static void
+replay_close(void)
+{
+
+	fclose(replayfile);
+	replayfile = NULL;
+}
+
+/* Called by instr_in() in place of reading 'infile' while replaying. */
+int
+replay_getc(void)
+{
+	uint64_t v;
+	uint32_t len;
+	int c;
+
+	while (getvarint(replayfile, &v)) {
+		replay_last += v >> 1;
+		if (v & 1) {
+			if (fread(&len, sizeof(len), 1, replayfile) != 1 ||
+			    fseeko(replayfile, len, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+
+		c = fgetc(replayfile);
+		if (c == EOF)
+			break;
+		if (replay_last != insns)
+			fprintf(stderr, "Replay diverged: logged input at "
+			    "instruction %ju, read at %ju.\n",
+			    (uintmax_t)replay_last, (uintmax_t)insns);
+		return (c);
+	}
+
+	fprintf(stderr, "End of input log; reading live input.\n");
+	replay_close();
+	return (fgetc(infile));
+}
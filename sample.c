@@ -0,0 +1,174 @@
+#include <sys/time.h>
+
+#include <signal.h>
+
+#include "emu.h"
+
+/*
+ * Sampling call-stack profiler.
+ *
+ * Return addresses on stack[] are mixed with data, so instr_call() and
+ * instr_ret() keep a shadow stack of call targets while sampling is on.  A
+ * SIGPROF timer interrupts the emulator; the handler looks the current shadow
+ * stack up in a preallocated hash table and bumps its count, so a run of any
+ * length needs memory only for its distinct stacks.  The table is written out
+ * as collapsed stacks ("top;f1;f2;pc count", outermost first, ending with the
+ * sampled instruction) for flame graph tools.
+ */
+
+#define	SHADOW_MAX	1024
+#define	SAMPLE_DEPTH	64		/* Frames kept per sample */
+#define	SAMPLE_SLOTS	(1 << 16)	/* Power of two */
+
+struct shadow_frame {
+	uint16_t	 sf_target;
+	size_t		 sf_sdepth;	/* stack_depth after the call */
+};
+
+struct sample_slot {
+	uint64_t	 ss_count;
+	uint16_t	 ss_depth;
+	uint16_t	 ss_frames[SAMPLE_DEPTH];
+};
+
+bool				 shadow_on;
+
+static struct shadow_frame	 shadow[SHADOW_MAX];
+static volatile size_t		 shadow_depth;
+static struct sample_slot	*slots;
+static uint64_t			 sample_lost;	/* Table was full */
+static FILE			*samplefile;
+
+/* Called by instr_call() after pushing the return address. */
+void
+shadow_call(uint16_t target)
+{
+	size_t d;
+
+	d = shadow_depth;
+	if (d == SHADOW_MAX)
+		return;
+	shadow[d].sf_target = target;
+	shadow[d].sf_sdepth = stack_depth;
+	/* The handler must not see the frame before it is filled in. */
+	__asm__ __volatile__("" ::: "memory");
+	shadow_depth = d + 1;
+}
+
+/* Called by instr_ret() after popping; unwinds any frames it abandons. */
+void
+shadow_ret(void)
+{
+	size_t d;
+
+	d = shadow_depth;
+	while (d > 0 && shadow[d - 1].sf_sdepth > stack_depth)
+		d--;
+	shadow_depth = d;
+}
+
+static void
+sample_handler(int s)
+{
+	uint16_t frames[SAMPLE_DEPTH];
+	struct sample_slot *ss;
+	uint64_t h;
+	size_t d, i, j;
+
+	(void)s;
+
+	/* Outermost call targets, then the interrupted instruction. */
+	d = min((size_t)shadow_depth, (size_t)SAMPLE_DEPTH - 1);
+	for (i = 0; i < d; i++)
+		frames[i] = shadow[i].sf_target;
+	frames[d++] = pc_start;
+
+	/* FNV-1a */
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < d; i++)
+		h = (h ^ frames[i]) * 0x100000001b3ULL;
+
+	for (j = 0; j < SAMPLE_SLOTS; j++) {
+		ss = &slots[(h + j) & (SAMPLE_SLOTS - 1)];
+		if (ss->ss_count == 0) {
+			ss->ss_depth = d;
+			memcpy(ss->ss_frames, frames, d * sizeof(frames[0]));
+			ss->ss_count = 1;
+			return;
+		}
+		if (ss->ss_depth == d &&
+		    memcmp(ss->ss_frames, frames, d * sizeof(frames[0])) == 0) {
+			ss->ss_count++;
+			return;
+		}
+	}
+	sample_lost++;
+}
+
+/* Sample 'hz' times per second of CPU time, writing stacks to 'f'. */
+void
+sample_start(FILE *f, unsigned hz)
+{
+	struct itimerval it;
+	struct sigaction sa;
+	int rc;
+
+	ASSERT(hz > 0 && hz <= 1000000, "bad sample rate %u", hz);
+
+	slots = calloc(SAMPLE_SLOTS, sizeof(*slots));
+	ASSERT(slots != NULL, "calloc");
+	samplefile = f;
+	shadow_depth = 0;
+	shadow_on = true;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sample_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	rc = sigaction(SIGPROF, &sa, NULL);
+	ASSERT(rc == 0, "sigaction: %s", strerror(errno));
+
+	memset(&it, 0, sizeof(it));
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / hz;
+	it.it_value = it.it_interval;
+	rc = setitimer(ITIMER_PROF, &it, NULL);
+	ASSERT(rc == 0, "setitimer: %s", strerror(errno));
+}
+
+/* Stop sampling and write the collapsed stacks. */
+void
+sample_stop(void)
+{
+	struct itimerval it;
+	const struct sample_slot *ss;
+	size_t i, j;
+
+	if (samplefile == NULL)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	(void)setitimer(ITIMER_PROF, &it, NULL);
+	signal(SIGPROF, SIG_IGN);
+	shadow_on = false;
+
+	for (i = 0; i < SAMPLE_SLOTS; i++) {
+		ss = &slots[i];
+		if (ss->ss_count == 0)
+			continue;
+		fprintf(samplefile, "top");
+		for (j = 0; j < ss->ss_depth; j++)
+			fprintf(samplefile, ";%05u", (uns)ss->ss_frames[j]);
+		fprintf(samplefile, " %ju\n", (uintmax_t)ss->ss_count);
+	}
+	if (sample_lost > 0)
+		fprintf(stderr, "Sample table full; %ju samples lost.\n",
+		    (uintmax_t)sample_lost);
+
+	if (fclose(samplefile) != 0)
+		fprintf(stderr, "Failed to write samples: %s\n",
+		    strerror(errno));
+	samplefile = NULL;
+	free(slots);
+	slots = NULL;
+}
@@ -0,0 +1,241 @@
+#define	_GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+/*
+ * Parallel r7 search.
+ *
+ * Every candidate starts from an image of the machine as it stands when the
+ * search begins, after boot (or a restored save), so boot runs once rather
+ * than once per candidate.  Worker threads claim candidates from a shared
+ * counter.  For each one a worker installs a fresh copy-on-write instance of
+ * the image (vm.c) on its own thread-local machine, sets r7 and runs the
+ * interpreter on the search's input until the goal is met.  The candidate
+ * fails if it halts, runs out of input, faults, or uses up its -l budget.  The
+ * first success sets sr_done, which every worker checks at least every
+ * SEARCH_SLICE instructions, so the rest of the search stops promptly.
+ */
+
+#define	SEARCH_SLICE	65536
+
+static __thread jmp_buf	 sr_fault;
+
+/* Goal: reach pc sr_pc, or write sr_out. */
+static int32_t		 sr_pc = -1;
+static char		*sr_out;
+static size_t		 sr_outlen;
+
+static struct vm_image	*sr_image;
+static char		*sr_input;
+static size_t		 sr_inlen;
+static uint32_t		 sr_hi;
+
+static atomic_uint	 sr_next;
+static atomic_uint	 sr_tried;
+static atomic_bool	 sr_done;
+static uint32_t		 sr_found;
+static uint64_t		 sr_found_insns;
+
+/* Parse a goal, "pc=ADDR" or "out=TEXT"; it replaces any earlier one. */
+bool
+search_goal(const char *spec)
+{
+	unsigned long v;
+	char *end;
+
+	if (strncmp(spec, "pc=", 3) == 0) {
+		v = strtoul(spec + 3, &end, 0);
+		if (end == spec + 3 || *end != 0 || v >= MEMWORDS)
+			return (false);
+		sr_pc = v;
+		free(sr_out);
+		sr_out = NULL;
+		return (true);
+	}
+	if (strncmp(spec, "out=", 4) == 0 && spec[4] != 0) {
+		free(sr_out);
+		sr_out = strdup(spec + 4);
+		ASSERT(sr_out != NULL, "strdup");
+		sr_outlen = strlen(sr_out);
+		sr_pc = -1;
+		return (true);
+	}
+	return (false);
+}
+
+/* Whether the output so far contains the goal text; 'checked' advances. */
+static bool
+search_output(const char *out, size_t len, size_t *checked)
+{
+	size_t from;
+
+	if (len < *checked + sr_outlen)
+		return (false);
+	from = *checked;
+	/* A match may straddle this check and the next. */
+	*checked = len - sr_outlen + 1;
+	return (memmem(out + from, len - from, sr_out, sr_outlen) != NULL);
+}
+
+static bool
+search_try(uint16_t r7, uint64_t *ninsns)
+{
+	struct vm *vm;
+	uint64_t begin, end, lim;
+	size_t outlen, checked;
+	char *out;
+	bool met;
+
+	vm = vm_create(sr_image);
+	vm_switch(vm);
+	regs[7] = r7;
+	begin = insns;
+	lim = insnlimit ? begin + insnlimit : UINT64_MAX;
+
+	if (sr_inlen > 0)
+		infile = fmemopen(sr_input, sr_inlen, "r");
+	else
+		infile = fopen("/dev/null", "r");
+	ASSERT(infile != NULL, "fmemopen: %s", strerror(errno));
+	out = NULL;
+	outlen = 0;
+	outfile = open_memstream(&out, &outlen);
+	ASSERT(outfile != NULL, "open_memstream: %s", strerror(errno));
+	/* Out of input: park rather than complain, and give up. */
+	in_yield = true;
+
+	met = false;
+	checked = 0;
+	if (setjmp(sr_fault) != 0)
+		met = false;
+	else {
+		while (!met && !halted && !in_blocked && insns < lim) {
+			end = min(insns + SEARCH_SLICE, lim);
+			if (sr_pc >= 0) {
+				while (insns < end && !halted && !in_blocked) {
+					/* Met when about to execute sr_pc. */
+					if (pc == (uint32_t)sr_pc) {
+						met = true;
+						break;
+					}
+					emulate1();
+				}
+			} else {
+				while (insns < end && !halted && !in_blocked)
+					emulate1();
+				fflush(outfile);
+				met = search_output(out, outlen, &checked);
+			}
+			if (atomic_load_explicit(&sr_done,
+			    memory_order_relaxed) || ctrlc)
+				break;
+		}
+	}
+	*ninsns = insns - begin;
+
+	fclose(infile);
+	fclose(outfile);
+	free(out);
+	infile = outfile = NULL;
+	in_yield = false;
+	vm_switch(NULL);
+	vm_destroy(vm);
+	return (met);
+}
+
+static void *
+search_main(void *arg __unused)
+{
+	uint64_t n;
+	uint32_t r7;
+
+	/* A guest fault fails the candidate instead of the process. */
+	guest_fault = &sr_fault;
+	while (!atomic_load_explicit(&sr_done, memory_order_relaxed) &&
+	    !ctrlc) {
+		r7 = atomic_fetch_add_explicit(&sr_next, 1,
+		    memory_order_relaxed);
+		if (r7 > sr_hi)
+			break;
+		if (search_try(r7, &n) &&
+		    !atomic_exchange_explicit(&sr_done, true,
+		    memory_order_acq_rel)) {
+			sr_found = r7;
+			sr_found_insns = n;
+		}
+		atomic_fetch_add_explicit(&sr_tried, 1, memory_order_relaxed);
+	}
+	return (NULL);
+}
+
+/*
+ * Try r7 = lo..hi from the current machine on 'nthreads' threads, reading the
+ * input for every candidate from infile up front.  Returns true, having
+ * reported the winner, if any candidate met the goal.
+ */
+bool
+search_run(uint32_t lo, uint32_t hi, unsigned nthreads)
+{
+	pthread_t *th;
+	uint64_t t0, t;
+	size_t alloc, rd;
+	unsigned i;
+	bool found;
+	int rc;
+
+	ASSERT(sr_pc >= 0 || sr_out != NULL, "no search goal");
+	alloc = 4096;
+	sr_input = malloc(alloc);
+	ASSERT(sr_input != NULL, "malloc");
+	while ((rd = fread(sr_input + sr_inlen, 1, alloc - sr_inlen,
+	    infile)) > 0) {
+		sr_inlen += rd;
+		if (sr_inlen == alloc) {
+			alloc *= 2;
+			sr_input = realloc(sr_input, alloc);
+			ASSERT(sr_input != NULL, "realloc");
+		}
+	}
+
+	sr_image = vm_image_create();
+	sr_hi = hi;
+	atomic_store(&sr_next, lo);
+	atomic_store(&sr_tried, 0);
+	atomic_store(&sr_done, false);
+	t0 = now();
+
+	th = calloc(nthreads, sizeof(*th));
+	ASSERT(th != NULL, "calloc");
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_create(&th[i], NULL, search_main, NULL);
+		ASSERT(rc == 0, "pthread_create: %s", strerror(rc));
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(th[i], NULL);
+	t = now() - t0;
+
+	found = atomic_load(&sr_done);
+	if (found)
+		printf("Search: r7=%u meets the goal after %ju instructions "
+		    "(%u candidates run, %ju.%03us).\n", (uns)sr_found,
+		    (uintmax_t)sr_found_insns, (uns)atomic_load(&sr_tried),
+		    (uintmax_t)(t / sec), (uns)(t % sec / 1000));
+	else if (ctrlc)
+		printf("Search: interrupted after %u candidates.\n",
+		    (uns)atomic_load(&sr_tried));
+	else
+		printf("Search: no r7 in [%u, %u] meets the goal "
+		    "(%ju.%03us).\n", (uns)lo, (uns)hi, (uintmax_t)(t / sec),
+		    (uns)(t % sec / 1000));
+
+	free(th);
+	vm_image_destroy(sr_image);
+	sr_image = NULL;
+	free(sr_input);
+	sr_input = NULL;
+	sr_inlen = 0;
+	return (found);
+}
@@ -0,0 +1,648 @@
+#define	_GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+/*
+ * Multi-session server.
+ *
+ * One process serves many players over a UNIX domain socket; each connection
+ * is a session with its own copy-on-write instance (vm.c) of the loaded
+ * machine.  The machine boots once, up to its first 'in', and every session
+ * starts from that image with the boot output already queued to it.
+ *
+ * Everything runs on one thread around epoll.  Bytes from the socket are
+ * buffered and read by the session's 'in' through a stdio cookie; what it
+ * prints collects in an output buffer that is sent as the socket takes it.
+ * A session with input runs in turns of SRV_SLICE instructions, round-robin
+ * with the others, until 'in' finds its buffer empty (in_yield).  It is then
+ * parked, costing nothing until more input arrives.  A session parked for
+ * longer than the idle timeout is written out in the save file format, next
+ * to the socket, and its instance is freed; new input restores it.
+ *
+ * Latency is measured from the input that wakes a parked session to the
+ * moment it parks again, having produced its response.  When a session ends,
+ * its metrics are printed as one JSON object per line.
+ */
+
+#define	SRV_SLICE	(1 << 20)	/* Instructions per turn */
+#define	SRV_MAXEV	64
+#define	SRV_INMAX	(64 * 1024)	/* Input buffered before reads stop */
+#define	SRV_OUTMAX	(1024 * 1024)	/* Output pending before turns stop */
+#define	SRV_NLAT	32		/* log2(us) latency buckets */
+
+enum srv_state {
+	SS_RUN,				/* On srv_runq */
+	SS_PARKED,			/* On srv_parked, in 'in' */
+	SS_SAVED,			/* Parked, and written out */
+	SS_OUTPUT,			/* Waiting for its output to drain */
+	SS_DONE,			/* Halted, faulted or hung up */
+};
+
+struct session {
+	unsigned		 s_id;
+	int			 s_fd;
+	enum srv_state		 s_state;
+	uint32_t		 s_events;
+	bool			 s_eof;
+	const char		*s_end;		/* Why it is done */
+	struct vm		*s_vm;		/* NULL while saved */
+
+	FILE			*s_in;
+	char			*s_inbuf;
+	size_t			 s_inpos, s_inlen, s_inalloc;
+	FILE			*s_out;
+	char			*s_outbuf;
+	size_t			 s_outpos, s_outlen, s_outalloc;
+
+	uint64_t		 s_connected;
+	uint64_t		 s_idle;	/* Parked since, us */
+	uint64_t		 s_wake;	/* Input arrived, us, or 0 */
+	uint64_t		 s_insns;
+	uint64_t		 s_bytes_in, s_bytes_out;
+	unsigned		 s_saves;
+	uint64_t		 s_nlat, s_lat_sum, s_lat_max;
+	uint64_t		 s_lat[SRV_NLAT];
+
+	TAILQ_ENTRY(session)	 s_link;	/* srv_runq or srv_parked */
+	LIST_ENTRY(session)	 s_all;
+};
+
+TAILQ_HEAD(srv_queue, session);
+
+static struct srv_queue		 srv_runq = TAILQ_HEAD_INITIALIZER(srv_runq);
+static struct srv_queue		 srv_parked =
+    TAILQ_HEAD_INITIALIZER(srv_parked);
+static LIST_HEAD(, session)	 srv_all = LIST_HEAD_INITIALIZER(srv_all);
+
+static const char		*srv_path;
+static uint64_t			 srv_idle_us;
+static int			 srv_ep = -1;
+static int			 srv_lfd = -1;
+static unsigned			 srv_next_id;
+static unsigned			 srv_nsessions;
+static struct vm_image		*srv_image;
+static bool			 srv_boot_halted;
+static char			*srv_boot_out;
+static size_t			 srv_boot_outlen;
+static jmp_buf			 srv_fault;
+
+static void
+srv_append(char **buf, size_t *len, size_t *alloc, const void *data,
+    size_t n)
+{
+
+	if (*len + n > *alloc) {
+		*alloc = max(*alloc * 2, *len + n);
+		*buf = realloc(*buf, *alloc);
+		ASSERT(*buf != NULL, "realloc");
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+static ssize_t
+srv_cread(void *cookie, char *buf, size_t size)
+{
+	struct session *s = cookie;
+	size_t n;
+
+	n = min(size, s->s_inlen - s->s_inpos);
+	memcpy(buf, s->s_inbuf + s->s_inpos, n);
+	s->s_inpos += n;
+	if (s->s_inpos == s->s_inlen)
+		s->s_inpos = s->s_inlen = 0;
+	return (n);
+}
+
+static ssize_t
+srv_cwrite(void *cookie, const char *buf, size_t size)
+{
+	struct session *s = cookie;
+
+	srv_append(&s->s_outbuf, &s->s_outlen, &s->s_outalloc, buf, size);
+	return (size);
+}
+
+static void
+srv_savepath(const struct session *s, char *buf, size_t sz)
+{
+
+	snprintf(buf, sz, "%s.%u.save", srv_path, s->s_id);
+}
+
+/* Keep epoll's interest in 's' in line with its buffers. */
+static void
+srv_interest(struct session *s)
+{
+	struct epoll_event ev;
+	uint32_t events;
+	int rc;
+
+	/* After the peer's EOF, RDHUP would stay ready and spin the loop. */
+	events = 0;
+	if (!s->s_eof) {
+		events |= EPOLLRDHUP;
+		if (s->s_inlen - s->s_inpos < SRV_INMAX)
+			events |= EPOLLIN;
+	}
+	if (s->s_outpos < s->s_outlen)
+		events |= EPOLLOUT;
+	if (events == s->s_events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = s;
+	rc = epoll_ctl(srv_ep, EPOLL_CTL_MOD, s->s_fd, &ev);
+	ASSERT(rc == 0, "epoll_ctl: %s", strerror(errno));
+	s->s_events = events;
+}
+
+static unsigned
+srv_bucket(uint64_t us)
+{
+	unsigned b;
+
+	for (b = 0; us > 1 && b < SRV_NLAT - 1; b++)
+		us >>= 1;
+	return (b);
+}
+
+/* Upper bound of the bucket holding the 'pct'th percentile latency. */
+static uint64_t
+srv_percentile(const struct session *s, unsigned pct)
+{
+	uint64_t seen, want;
+	unsigned b;
+
+	if (s->s_nlat == 0)
+		return (0);
+	want = (s->s_nlat * pct + 99) / 100;
+	seen = 0;
+	for (b = 0; b < SRV_NLAT - 1; b++) {
+		seen += s->s_lat[b];
+		if (seen >= want)
+			break;
+	}
+	return (min((uint64_t)2 << b, s->s_lat_max));
+}
+
+static void
+srv_report(const struct session *s, uint64_t t)
+{
+
+	printf("{\"session\": %u, \"end\": \"%s\", \"connected_us\": %ju, "
+	    "\"insns\": %ju, \"bytes_in\": %ju, \"bytes_out\": %ju, "
+	    "\"saves\": %u, \"inputs\": %ju, \"lat_avg_us\": %ju, "
+	    "\"lat_p50_us\": %ju, \"lat_p99_us\": %ju, \"lat_max_us\": %ju}\n",
+	    s->s_id, s->s_end != NULL ? s->s_end : "hangup",
+	    (uintmax_t)(t - s->s_connected), (uintmax_t)s->s_insns,
+	    (uintmax_t)s->s_bytes_in, (uintmax_t)s->s_bytes_out, s->s_saves,
+	    (uintmax_t)s->s_nlat,
+	    (uintmax_t)(s->s_nlat ? s->s_lat_sum / s->s_nlat : 0),
+	    (uintmax_t)srv_percentile(s, 50),
+	    (uintmax_t)srv_percentile(s, 99), (uintmax_t)s->s_lat_max);
+	fflush(stdout);
+}
+
+static void
+srv_unlist(struct session *s)
+{
+
+	if (s->s_state == SS_RUN)
+		TAILQ_REMOVE(&srv_runq, s, s_link);
+	else if (s->s_state == SS_PARKED)
+		TAILQ_REMOVE(&srv_parked, s, s_link);
+}
+
+static void
+srv_close(struct session *s)
+{
+	char path[PATH_MAX];
+
+	srv_report(s, now());
+	srv_unlist(s);
+	LIST_REMOVE(s, s_all);
+	epoll_ctl(srv_ep, EPOLL_CTL_DEL, s->s_fd, NULL);
+	close(s->s_fd);
+	if (s->s_state == SS_SAVED) {
+		srv_savepath(s, path, sizeof(path));
+		unlink(path);
+	}
+	vm_destroy(s->s_vm);
+	fclose(s->s_in);
+	fclose(s->s_out);
+	free(s->s_inbuf);
+	free(s->s_outbuf);
+	free(s);
+	srv_nsessions--;
+}
+
+static void
+srv_setstate(struct session *s, enum srv_state state)
+{
+
+	srv_unlist(s);
+	s->s_state = state;
+	if (state == SS_RUN)
+		TAILQ_INSERT_TAIL(&srv_runq, s, s_link);
+	else if (state == SS_PARKED) {
+		s->s_idle = now();
+		TAILQ_INSERT_TAIL(&srv_parked, s, s_link);
+	}
+}
+
+/* Send what the socket will take.  False if the peer is gone. */
+static bool
+srv_flush(struct session *s)
+{
+	ssize_t rc;
+
+	while (s->s_outpos < s->s_outlen) {
+		rc = send(s->s_fd, s->s_outbuf + s->s_outpos,
+		    s->s_outlen - s->s_outpos, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 0)
+			return (false);
+		s->s_outpos += rc;
+		s->s_bytes_out += rc;
+	}
+	if (s->s_outpos == s->s_outlen)
+		s->s_outpos = s->s_outlen = 0;
+	return (true);
+}
+
+/* Write a parked session out and free its instance. */
+static void
+srv_save(struct session *s)
+{
+	char path[PATH_MAX];
+	int fd, rc;
+
+	srv_savepath(s, path, sizeof(path));
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		/* Keep it in memory; try again after another timeout. */
+		srv_setstate(s, SS_PARKED);
+		return;
+	}
+	vm_switch(s->s_vm);
+	rc = writesave(fd);
+	vm_switch(NULL);
+	if (close(fd) != 0 || rc != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		unlink(path);
+		srv_setstate(s, SS_PARKED);
+		return;
+	}
+
+	vm_destroy(s->s_vm);
+	s->s_vm = NULL;
+	s->s_saves++;
+	srv_setstate(s, SS_SAVED);
+}
+
+static bool
+srv_restore(struct session *s)
+{
+	char path[PATH_MAX];
+	const char *error;
+	FILE *f;
+
+	srv_savepath(s, path, sizeof(path));
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (false);
+	}
+	s->s_vm = vm_create(srv_image);
+	vm_switch(s->s_vm);
+	error = readsave(f);
+	vm_switch(NULL);
+	fclose(f);
+	if (error != NULL) {
+		fprintf(stderr, "%s: %s\n", path, error);
+		return (false);
+	}
+	unlink(path);
+	return (true);
+}
+
+/* Input arrived for 's'. */
+static void
+srv_wake(struct session *s)
+{
+
+	if (s->s_state != SS_PARKED && s->s_state != SS_SAVED)
+		return;
+	if (s->s_wake == 0)
+		s->s_wake = now();
+	if (s->s_state == SS_SAVED && !srv_restore(s)) {
+		s->s_end = "restore";
+		srv_setstate(s, SS_DONE);
+		return;
+	}
+	srv_setstate(s, SS_RUN);
+}
+
+static void
+srv_read(struct session *s)
+{
+	char buf[4096];
+	ssize_t rc;
+
+	while (!s->s_eof && s->s_inlen - s->s_inpos < SRV_INMAX) {
+		rc = recv(s->s_fd, buf, sizeof(buf), 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc <= 0) {
+			s->s_eof = true;
+			break;
+		}
+		srv_append(&s->s_inbuf, &s->s_inlen, &s->s_inalloc, buf, rc);
+		s->s_bytes_in += rc;
+	}
+	if (s->s_inlen > s->s_inpos)
+		srv_wake(s);
+}
+
+/* Run the installed machine up to 'end'.  False if the guest faulted. */
+static bool
+srv_exec(uint64_t end)
+{
+
+	if (setjmp(srv_fault) != 0)
+		return (false);
+	while (insns < end && !halted && !in_blocked)
+		emulate1();
+	return (true);
+}
+
+/* Give the session at the head of the run queue one turn. */
+static void
+srv_turn(struct session *s)
+{
+	uint64_t begin, t;
+	bool ok;
+
+	vm_switch(s->s_vm);
+	infile = s->s_in;
+	outfile = s->s_out;
+	in_blocked = false;
+	begin = insns;
+	ok = srv_exec(insns + SRV_SLICE);
+	fflush(outfile);
+	s->s_insns += insns - begin;
+	infile = stdin;
+	outfile = stdout;
+
+	if (!ok || halted) {
+		s->s_end = ok ? "halt" : "fault";
+		srv_setstate(s, SS_DONE);
+	} else if (in_blocked) {
+		if (s->s_wake != 0) {
+			t = now() - s->s_wake;
+			s->s_wake = 0;
+			s->s_nlat++;
+			s->s_lat_sum += t;
+			s->s_lat_max = max(s->s_lat_max, t);
+			s->s_lat[srv_bucket(t)]++;
+		}
+		srv_setstate(s, s->s_eof ? SS_DONE : SS_PARKED);
+	} else if (s->s_outlen - s->s_outpos > SRV_OUTMAX)
+		srv_setstate(s, SS_OUTPUT);
+	else
+		srv_setstate(s, SS_RUN);
+	vm_switch(NULL);
+}
+
+/* After any event or turn: send, and retire finished sessions. */
+static void
+srv_settle(struct session *s)
+{
+
+	if (!srv_flush(s)) {
+		srv_close(s);
+		return;
+	}
+	if (s->s_state == SS_OUTPUT && s->s_outlen - s->s_outpos <= SRV_OUTMAX)
+		srv_setstate(s, SS_RUN);
+	if (s->s_state == SS_PARKED && s->s_eof)
+		srv_setstate(s, SS_DONE);
+	if (s->s_state == SS_DONE && s->s_outpos == s->s_outlen) {
+		srv_close(s);
+		return;
+	}
+	srv_interest(s);
+}
+
+static void
+srv_accept(void)
+{
+	struct epoll_event ev;
+	struct session *s;
+	cookie_io_functions_t inio = { .read = srv_cread };
+	cookie_io_functions_t outio = { .write = srv_cwrite };
+	int fd, rc;
+
+	while (true) {
+		fd = accept4(srv_lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0 && errno == EINTR)
+			continue;
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "accept: %s\n",
+				    strerror(errno));
+			return;
+		}
+
+		s = calloc(1, sizeof(*s));
+		ASSERT(s != NULL, "calloc");
+		s->s_id = srv_next_id++;
+		s->s_fd = fd;
+		s->s_connected = now();
+		s->s_vm = vm_create(srv_image);
+		s->s_in = fopencookie(s, "r", inio);
+		s->s_out = fopencookie(s, "w", outio);
+		ASSERT(s->s_in != NULL && s->s_out != NULL, "fopencookie");
+		srv_append(&s->s_outbuf, &s->s_outlen, &s->s_outalloc,
+		    srv_boot_out, srv_boot_outlen);
+		LIST_INSERT_HEAD(&srv_all, s, s_all);
+		srv_nsessions++;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = s->s_events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = s;
+		rc = epoll_ctl(srv_ep, EPOLL_CTL_ADD, fd, &ev);
+		ASSERT(rc == 0, "epoll_ctl: %s", strerror(errno));
+
+		/* Not on a list yet. */
+		s->s_state = SS_DONE;
+		if (srv_boot_halted)
+			s->s_end = "halt";
+		else
+			srv_setstate(s, SS_PARKED);
+		srv_settle(s);
+	}
+}
+
+/* Save sessions parked for longer than the idle timeout. */
+static int
+srv_idle(void)
+{
+	struct session *s;
+	uint64_t t;
+
+	if (srv_idle_us == 0)
+		return (-1);
+	t = now();
+	while ((s = TAILQ_FIRST(&srv_parked)) != NULL &&
+	    t - s->s_idle >= srv_idle_us)
+		srv_save(s);
+	if (s == NULL)
+		return (-1);
+	/* Milliseconds until the next one is due, rounded up. */
+	return ((s->s_idle + srv_idle_us - t + 999) / 1000);
+}
+
+static void
+srv_listen(void)
+{
+	struct sockaddr_un sun;
+	struct epoll_event ev;
+	struct stat sb;
+	int rc;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	ASSERT(strlen(srv_path) < sizeof(sun.sun_path), "socket path too long");
+	strcpy(sun.sun_path, srv_path);
+	/* A socket left behind by an earlier server. */
+	if (stat(srv_path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(srv_path);
+
+	srv_lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	ASSERT(srv_lfd >= 0, "socket: %s", strerror(errno));
+	rc = bind(srv_lfd, (struct sockaddr *)&sun, sizeof(sun));
+	ASSERT(rc == 0, "bind %s: %s", srv_path, strerror(errno));
+	rc = listen(srv_lfd, SOMAXCONN);
+	ASSERT(rc == 0, "listen: %s", strerror(errno));
+
+	srv_ep = epoll_create1(EPOLL_CLOEXEC);
+	ASSERT(srv_ep >= 0, "epoll_create1: %s", strerror(errno));
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	rc = epoll_ctl(srv_ep, EPOLL_CTL_ADD, srv_lfd, &ev);
+	ASSERT(rc == 0, "epoll_ctl: %s", strerror(errno));
+}
+
+/* Run the loaded machine up to its first 'in'; sessions start there. */
+static void
+srv_boot(void)
+{
+	FILE *bootin, *out;
+
+	bootin = fopen("/dev/null", "rb");
+	ASSERT(bootin != NULL, "fopen: %s", strerror(errno));
+	out = open_memstream(&srv_boot_out, &srv_boot_outlen);
+	ASSERT(out != NULL, "open_memstream: %s", strerror(errno));
+	infile = bootin;
+	outfile = out;
+	in_yield = true;
+
+	emulate();
+
+	fclose(out);
+	fclose(bootin);
+	infile = stdin;
+	outfile = stdout;
+	srv_boot_halted = halted;
+	srv_image = vm_image_create();
+}
+
+/*
+ * Serve sessions of the loaded machine on UNIX socket 'path' until ^C.  Parked
+ * sessions are saved after 'idle_sec' seconds; 0 keeps them in memory.
+ */
+void
+server_run(const char *path, unsigned idle_sec)
+{
+	struct epoll_event evs[SRV_MAXEV];
+	struct session *s, *last;
+	int n, i, timeout;
+	bool done;
+
+	srv_path = path;
+	srv_idle_us = idle_sec * sec;
+	srv_boot();
+	srv_listen();
+	printf("Serving on %s, %zu bytes of boot output%s.\n", srv_path,
+	    srv_boot_outlen, srv_boot_halted ? " (halted)" : "");
+	fflush(stdout);
+
+	guest_fault = &srv_fault;
+	while (!ctrlc) {
+		timeout = srv_idle();
+		if (!TAILQ_EMPTY(&srv_runq))
+			timeout = 0;
+		n = epoll_wait(srv_ep, evs, SRV_MAXEV, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		ASSERT(n >= 0, "epoll_wait: %s", strerror(errno));
+
+		for (i = 0; i < n; i++) {
+			s = evs[i].data.ptr;
+			if (s == NULL) {
+				srv_accept();
+				continue;
+			}
+			if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+			    EPOLLERR))
+				srv_read(s);
+			if ((evs[i].events & (EPOLLHUP | EPOLLERR)) &&
+			    !(evs[i].events & EPOLLIN))
+				s->s_eof = true;
+			srv_settle(s);
+		}
+
+		/* One turn each for the sessions that were runnable. */
+		last = TAILQ_LAST(&srv_runq, srv_queue);
+		while ((s = TAILQ_FIRST(&srv_runq)) != NULL) {
+			done = s == last;
+			srv_turn(s);
+			srv_settle(s);
+			if (done)
+				break;
+		}
+	}
+	guest_fault = NULL;
+
+	printf("Got ^C, closing %u sessions.\n", srv_nsessions);
+	while ((s = LIST_FIRST(&srv_all)) != NULL) {
+		if (s->s_end == NULL)
+			s->s_end = "shutdown";
+		srv_close(s);
+	}
+	close(srv_lfd);
+	close(srv_ep);
+	unlink(srv_path);
+	vm_image_destroy(srv_image);
+	free(srv_boot_out);
+}
@@ -0,0 +1,120 @@
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "shm.h"
+
+bool			 shm_on;
+uint64_t		 shm_next = UINT64_MAX;
+
+static struct shm_state	*shm;
+static char		*shmname;
+static uint16_t		*shm_prev;	/* memory before the export */
+static uint64_t		 shm_interval;
+
+/* Make the segment odd: readers retry until shm_end(). */
+void
+shm_begin(void)
+{
+
+	__atomic_store_n(&shm->ss_seq, shm->ss_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Publish the machine state as of pc 'npc' after 'ninsns', and make it even. */
+void
+shm_end(uint32_t npc, uint64_t ninsns)
+{
+	size_t i;
+
+	shm->ss_insns = ninsns;
+	shm->ss_pc = npc;
+	shm->ss_halted = halted;
+	memcpy(shm->ss_regs, regs, sizeof(shm->ss_regs));
+	shm->ss_stack_depth = stack_depth;
+	for (i = 0; i < SHM_STACK; i++)
+		shm->ss_stack[i] = i < stack_depth ?
+		    stack[stack_depth - 1 - i] : 0;
+	__atomic_store_n(&shm->ss_seq, shm->ss_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Publish the state at the current instruction boundary. */
+void
+shm_publish(void)
+{
+
+	shm_begin();
+	shm_end(pc, insns);
+	shm_next = insns + shm_interval;
+}
+
+/*
+ * Export the machine to shared memory object 'name', publishing at least every
+ * 'interval' instructions.  Guest memory moves into the segment.
+ */
+void
+shm_export(const char *name, uint64_t interval)
+{
+	int fd, rc;
+
+	ASSERT(interval > 0, "bad publish interval");
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT(fd >= 0, "shm_open %s: %s", name, strerror(errno));
+	rc = ftruncate(fd, sizeof(*shm));
+	ASSERT(rc == 0, "ftruncate: %s", strerror(errno));
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	ASSERT(shm != MAP_FAILED, "mmap: %s", strerror(errno));
+	close(fd);
+
+	shmname = strdup(name);
+	ASSERT(shmname != NULL, "strdup");
+	shm->ss_magic = SHM_MAGIC;
+	shm->ss_version = SHM_VERSION;
+	memcpy(shm->ss_memory, memory, MEMBYTES);
+	shm_prev = memory;
+	memory = shm->ss_memory;
+	shm_interval = interval;
+	shm_on = true;
+	shm_publish();
+}
+
+/* Publish the final state, move memory back out and remove the object. */
+void
+shm_close(void)
+{
+
+	if (shm == NULL)
+		return;
+
+	shm_publish();
+	memcpy(shm_prev, memory, MEMBYTES);
+	memory = shm_prev;
+	shm_on = false;
+	shm_next = UINT64_MAX;
+
+	shm_unlink(shmname);
+	munmap(shm, sizeof(*shm));
+	free(shmname);
+	shm = NULL;
+	shmname = NULL;
+}
+
+/* Copy a consistent snapshot of the exported state 'ss' into 'out'. */
+void
+shm_snapshot(const struct shm_state *ss, struct shm_state *out)
+{
+	uint64_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&ss->ss_seq, __ATOMIC_ACQUIRE)) &
+		    1)
+			sched_yield();
+		memcpy(out, (const void *)ss, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&ss->ss_seq, __ATOMIC_RELAXED) != seq);
+	out->ss_seq = seq;
+}
@@ -0,0 +1,38 @@
+#ifndef	__SHM_H__
+#define	__SHM_H__
+
+/*
+ * Live VM state exported to a POSIX shared memory object (-o).
+ *
+ * Guest memory is ss_memory itself: the emulator runs on it in place.  The
+ * rest of the machine state is published at instruction boundaries.  ss_seq is
+ * a seqlock: the emulator makes it odd before changing anything in the
+ * segment and even again after, so a reader that sees the same even value
+ * before and after copying what it needs has a consistent machine state.
+ * shm_snapshot() does this.
+ *
+ * Every wmem publishes the state after it, and the emulator also publishes
+ * every -O instructions and before blocking in 'in', so a snapshot is the
+ * exact state at some recent instruction boundary.
+ */
+#define	SHM_MAGIC	0x534e5953	/* "SYNS" */
+#define	SHM_VERSION	1
+#define	SHM_STACK	16		/* Top stack words published */
+
+struct shm_state {
+	uint32_t	 ss_magic;
+	uint32_t	 ss_version;
+	uint64_t	 ss_seq;
+	uint64_t	 ss_insns;
+	uint32_t	 ss_pc;
+	uint32_t	 ss_halted;
+	uint16_t	 ss_regs[8];
+	uint64_t	 ss_stack_depth;
+	/* ss_stack[0] is the top of the stack. */
+	uint16_t	 ss_stack[SHM_STACK];
+	uint16_t	 ss_memory[MEMWORDS] __aligned(4096);
+};
+
+void	shm_snapshot(const struct shm_state *ss, struct shm_state *out);
+
+#endif
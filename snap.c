@@ -0,0 +1,243 @@
+#include "emu.h"
+
+/*
+ * In-memory snapshot ring.
+ *
+ * Each snapshot carries an undo log that reverts the machine from the next
+ * snapshot (or, for the newest one, from the live state) back to itself.
+ * instr_wmem() journals the old value of a word the first time it is written
+ * after a capture, and popval() journals stack words as they are popped below
+ * the low-water mark.  Capture and restore therefore cost time proportional to
+ * the number of words touched, not the size of memory or the stack.
+ */
+
+struct snap_word {
+	uint16_t	 sw_addr;
+	uint16_t	 sw_val;
+};
+
+struct snap {
+	uint64_t	 sn_id;
+	uint64_t	 sn_insns;
+	uint32_t	 sn_pc;
+	bool		 sn_halted;
+	uint16_t	 sn_regs[8];
+	size_t		 sn_stack_depth;
+
+	/* Undo log back to this snapshot */
+	struct snap_word *sn_mem;
+	size_t		 sn_nmem;
+	size_t		 sn_memalloc;
+	/* Stack words, from sn_stack_depth - 1 downward */
+	uint16_t	*sn_stk;
+	size_t		 sn_nstk;
+	size_t		 sn_stkalloc;
+};
+
+bool		 snap_tracking;
+size_t		 stack_lowat;
+
+static struct snap	*snaps;
+static unsigned		 nsnaps;
+static uint64_t		 snap_next;	/* Next id to hand out */
+static uint64_t		 snap_count;	/* Live snapshots in ring */
+static uint64_t		 dirty[MEMWORDS / 64];
+
+static struct snap *
+snap_get(uint64_t id)
+{
+
+	return (&snaps[id % nsnaps]);
+}
+
+static struct snap *
+snap_cur(void)
+{
+
+	return (snap_get(snap_next - 1));
+}
+
+void
+snap_init(unsigned n)
+{
+
+	ASSERT(n > 0, "snapshot ring must hold at least one snapshot");
+
+	snap_destroy();
+	snaps = calloc(n, sizeof(*snaps));
+	ASSERT(snaps != NULL, "calloc");
+	nsnaps = n;
+	snap_next = 1;
+	snap_count = 0;
+	memset(dirty, 0, sizeof(dirty));
+}
+
+void
+snap_destroy(void)
+{
+	unsigned i;
+
+	for (i = 0; i < nsnaps; i++) {
+		free(snaps[i].sn_mem);
+		free(snaps[i].sn_stk);
+	}
+	free(snaps);
+	snaps = NULL;
+	nsnaps = 0;
+	snap_count = 0;
+	snap_tracking = false;
+	stack_lowat = 0;
+}
+
+/* Called by instr_wmem() before memory[addr] is overwritten. */
+void
+snap_dirty(uint16_t addr)
+{
+	struct snap *sn;
+	uint64_t bit;
+
+	bit = 1ULL << (addr % 64);
+	if (dirty[addr / 64] & bit)
+		return;
+	dirty[addr / 64] |= bit;
+
+	sn = snap_cur();
+	if (sn->sn_nmem == sn->sn_memalloc) {
+		sn->sn_memalloc = sn->sn_memalloc ? sn->sn_memalloc * 2 : 64;
+		sn->sn_mem = realloc(sn->sn_mem,
+		    sn->sn_memalloc * sizeof(*sn->sn_mem));
+		ASSERT(sn->sn_mem != NULL, "realloc");
+	}
+	sn->sn_mem[sn->sn_nmem].sw_addr = addr;
+	sn->sn_mem[sn->sn_nmem].sw_val = memory[addr];
+	sn->sn_nmem++;
+}
+
+/* Called by popval() when the stack drops below the low-water mark. */
+void
+snap_stackpop(uint16_t val)
+{
+	struct snap *sn;
+
+	stack_lowat = stack_depth;
+
+	sn = snap_cur();
+	if (sn->sn_nstk == sn->sn_stkalloc) {
+		sn->sn_stkalloc = sn->sn_stkalloc ? sn->sn_stkalloc * 2 : 64;
+		sn->sn_stk = realloc(sn->sn_stk,
+		    sn->sn_stkalloc * sizeof(*sn->sn_stk));
+		ASSERT(sn->sn_stk != NULL, "realloc");
+	}
+	sn->sn_stk[sn->sn_nstk++] = val;
+}
+
+static void
+snap_cleardirty(struct snap *sn)
+{
+	size_t i;
+
+	for (i = 0; i < sn->sn_nmem; i++)
+		dirty[sn->sn_mem[i].sw_addr / 64] &=
+		    ~(1ULL << (sn->sn_mem[i].sw_addr % 64));
+}
+
+/*
+ * Record the current machine state.  Returns an id usable with
+ * snap_restore() until it ages out of the ring.
+ */
+uint64_t
+snap_capture(void)
+{
+	struct snap *sn;
+
+	ASSERT(nsnaps > 0, "snap_init() not called");
+
+	/* Seal the previous snapshot's undo log. */
+	if (snap_count > 0)
+		snap_cleardirty(snap_cur());
+
+	sn = snap_get(snap_next);
+	sn->sn_id = snap_next++;
+	sn->sn_insns = insns;
+	sn->sn_pc = pc;
+	sn->sn_halted = halted;
+	memcpy(sn->sn_regs, regs, sizeof(sn->sn_regs));
+	sn->sn_stack_depth = stack_depth;
+	sn->sn_nmem = 0;
+	sn->sn_nstk = 0;
+
+	if (snap_count < nsnaps)
+		snap_count++;
+
+	stack_lowat = stack_depth;
+	snap_tracking = true;
+	return (sn->sn_id);
+}
+
+static void
+snap_undo(struct snap *sn)
+{
+	size_t i;
+
+	for (i = sn->sn_nmem; i > 0; i--) {
+		const struct snap_word *sw = &sn->sn_mem[i - 1];
+
+		if (unlikely(statehash_on))
+			statehash_set(SH_MEM, sw->sw_addr, memory[sw->sw_addr],
+			    sw->sw_val);
+		if (unlikely(dcache_on))
+			dcache_inval(sw->sw_addr);
+		memory[sw->sw_addr] = sw->sw_val;
+	}
+	for (i = 0; i < sn->sn_nstk; i++)
+		stack[sn->sn_stack_depth - 1 - i] = sn->sn_stk[i];
+}
+
+/*
+ * Rewind the machine to snapshot 'id'.  Snapshots newer than 'id' are
+ * discarded.  Returns false if 'id' has aged out of the ring.
+ */
+bool
+snap_restore(uint64_t id)
+{
+	struct snap *sn;
+	uint64_t j;
+	size_t i, lo;
+
+	if (snap_count == 0 || id >= snap_next || id < snap_next - snap_count)
+		return (false);
+
+	/* Stack slots below 'lo' are the same now as at the snapshot. */
+	lo = stack_depth;
+	for (j = snap_next - 1; j >= id; j--) {
+		sn = snap_get(j);
+		lo = min(lo, sn->sn_stack_depth - sn->sn_nstk);
+	}
+	if (unlikely(statehash_on))
+		for (i = lo; i < stack_depth; i++)
+			statehash_acc ^= statehash_term(SH_STK, i, stack[i]);
+
+	snap_cleardirty(snap_cur());
+	for (j = snap_next - 1; j >= id; j--)
+		snap_undo(snap_get(j));
+
+	sn = snap_get(id);
+	insns = sn->sn_insns;
+	pc = sn->sn_pc;
+	halted = sn->sn_halted;
+	if (unlikely(statehash_on))
+		for (i = 0; i < ARRAYLEN(regs); i++)
+			statehash_set(SH_REG, i, regs[i], sn->sn_regs[i]);
+	memcpy(regs, sn->sn_regs, sizeof(regs));
+	stack_depth = sn->sn_stack_depth;
+	if (unlikely(statehash_on))
+		for (i = lo; i < stack_depth; i++)
+			statehash_acc ^= statehash_term(SH_STK, i, stack[i]);
+	sn->sn_nmem = 0;
+	sn->sn_nstk = 0;
+
+	snap_count -= snap_next - 1 - id;
+	snap_next = id + 1;
+	stack_lowat = stack_depth;
+	return (true);
+}
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <signal.h>
+
+#include "emu.h"
+#include "instr.h"
+
+/*
+ * Live runtime statistics.
+ *
+ * The emulator thread only ever bumps plain counters: insns, stats_ops[],
+ * stack_hwm and the time spent waiting in 'in'.  They are per-thread, like the
+ * machine, so stats_start() notes where the main thread's are.  A stats thread
+ * reads them with relaxed atomic loads, so it never takes a lock the emulator
+ * could wait on; the numbers in one report may be a few instructions apart,
+ * nothing worse.  Every STATS_TICK the thread samples insns into a ring to
+ * compute instructions per second over the last STATS_WINDOW ticks.  It prints
+ * a report to stderr on SIGUSR2 and, with -e, rewrites the stats file every
+ * period.  Reports are one JSON object per line.
+ */
+
+#define	STATS_TICK	100000		/* us */
+#define	STATS_WINDOW	50		/* Ticks: 5 seconds */
+
+struct stats_sample {
+	uint64_t	 ss_time;
+	uint64_t	 ss_insns;
+};
+
+__thread uint64_t		 stats_ops[SYNACOR_NINSTR];
+__thread size_t			 stack_hwm;
+__thread uint64_t		 in_wait;	/* us blocked in 'in' */
+__thread uint64_t		 in_since;	/* Start of current wait, or 0 */
+
+/* The main thread's machine and counters. */
+static const uint64_t		*st_insns, *st_ops, *st_in_wait, *st_in_since;
+static const uint32_t		*st_pc;
+static const size_t		*st_stack_depth, *st_stack_hwm;
+
+static pthread_t		 stats_thread;
+static bool			 stats_running;
+static bool			 stats_done;
+static char			*statsname;
+static uint64_t			 stats_period;	/* us */
+static struct stats_sample	 window[STATS_WINDOW];
+static unsigned			 nwindow;
+
+#define	LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static void
+stats_tick(uint64_t t)
+{
+
+	memmove(&window[1], &window[0], (STATS_WINDOW - 1) * sizeof(window[0]));
+	window[0].ss_time = t;
+	window[0].ss_insns = LOAD(*st_insns);
+	if (nwindow < STATS_WINDOW)
+		nwindow++;
+}
+
+static void
+stats_write(FILE *f, uint64_t t)
+{
+	const struct stats_sample *old;
+	uint64_t ips, wait, since;
+	unsigned i;
+
+	ips = 0;
+	old = &window[nwindow - 1];
+	if (nwindow > 1 && window[0].ss_time > old->ss_time)
+		ips = (window[0].ss_insns - old->ss_insns) * 1000000 /
+		    (window[0].ss_time - old->ss_time);
+	wait = LOAD(*st_in_wait);
+	since = LOAD(*st_in_since);
+	if (since != 0 && t > since)
+		wait += t - since;
+
+	fprintf(f, "{\"time\": %ju, \"insns\": %ju, \"ips\": %ju, "
+	    "\"pc\": %u, \"stack_depth\": %zu, \"stack_hwm\": %zu, "
+	    "\"in_wait_us\": %ju, \"in_waiting\": %s, \"ops\": {",
+	    (uintmax_t)t, (uintmax_t)LOAD(*st_insns), (uintmax_t)ips,
+	    (uns)LOAD(*st_pc), (size_t)LOAD(*st_stack_depth),
+	    (size_t)LOAD(*st_stack_hwm),
+	    (uintmax_t)wait, since != 0 ? "true" : "false");
+	for (i = 0; i < SYNACOR_NINSTR; i++)
+		fprintf(f, "%s\"%s\": %ju", i ? ", " : "",
+		    synacor_instr[i].name, (uintmax_t)LOAD(st_ops[i]));
+	fprintf(f, "}}\n");
+	fflush(f);
+}
+
+/* Replace the stats file, so readers never see a partial report. */
+static void
+stats_export(uint64_t t)
+{
+	char tmp[4096];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", statsname);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open `%s': %s\n", tmp,
+		    strerror(errno));
+		return;
+	}
+	stats_write(f, t);
+	if (fclose(f) != 0 || rename(tmp, statsname) != 0)
+		fprintf(stderr, "Failed to write `%s': %s\n", statsname,
+		    strerror(errno));
+}
+
+static void *
+stats_main(void *arg __unused)
+{
+	struct timespec tick = { 0, STATS_TICK * 1000 };
+	sigset_t usr2;
+	uint64_t t, next;
+	int s;
+
+	sigemptyset(&usr2);
+	sigaddset(&usr2, SIGUSR2);
+
+	next = 0;
+	while (!__atomic_load_n(&stats_done, __ATOMIC_ACQUIRE)) {
+		s = sigtimedwait(&usr2, NULL, &tick);
+		if (__atomic_load_n(&stats_done, __ATOMIC_ACQUIRE))
+			break;
+		t = now();
+		stats_tick(t);
+		if (s == SIGUSR2)
+			stats_write(stderr, t);
+		if (statsname != NULL && t >= next) {
+			stats_export(t);
+			next = t + stats_period;
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Serve SIGUSR2 reports, and export to 'name' (if not NULL) every 'period_ms'.
+ * Threads started later inherit the blocked SIGUSR2, leaving it to sigwait.
+ */
+void
+stats_start(const char *name, unsigned period_ms)
+{
+	sigset_t usr2, all, old;
+	int rc;
+
+	if (name != NULL) {
+		statsname = strdup(name);
+		ASSERT(statsname != NULL, "strdup");
+	}
+	stats_period = (uint64_t)period_ms * 1000;
+	st_insns = &insns;
+	st_ops = stats_ops;
+	st_in_wait = &in_wait;
+	st_in_since = &in_since;
+	st_pc = &pc;
+	st_stack_depth = &stack_depth;
+	st_stack_hwm = &stack_hwm;
+	stack_hwm = stack_depth;
+	stats_tick(now());
+
+	sigemptyset(&usr2);
+	sigaddset(&usr2, SIGUSR2);
+	rc = pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+	ASSERT(rc == 0, "pthread_sigmask: %s", strerror(rc));
+
+	/*
+	 * The other handlers read the emulator's thread-local machine, so the
+	 * stats thread takes nothing but SIGUSR2, and that only by sigwait.
+	 */
+	__atomic_store_n(&stats_done, false, __ATOMIC_RELEASE);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&stats_thread, NULL, stats_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	ASSERT(rc == 0, "pthread_create: %s", strerror(rc));
+	stats_running = true;
+}
+
+/* Stop the stats thread, leaving a final report in the stats file. */
+void
+stats_stop(void)
+{
+
+	if (!stats_running)
+		return;
+	__atomic_store_n(&stats_done, true, __ATOMIC_RELEASE);
+	pthread_kill(stats_thread, SIGUSR2);
+	pthread_join(stats_thread, NULL);
+	stats_running = false;
+
+	if (statsname != NULL) {
+		stats_tick(now());
+		stats_export(now());
+		free(statsname);
+		statsname = NULL;
+	}
+}
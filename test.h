@@ -1,7 +1,27 @@
 #ifndef	__TEST_H__
 #define	__TEST_H__
 
+#include "emu.h"
+
+Suite	*suite_asm(void);
+Suite	*suite_batch(void);
 Suite	*suite_emu(void);
+Suite	*suite_flight(void);
+Suite	*suite_hash(void);
 Suite	*suite_instr(void);
+Suite	*suite_lockstep(void);
+Suite	*suite_search(void);
+Suite	*suite_server(void);
+Suite	*suite_shm(void);
+Suite	*suite_snap(void);
+Suite	*suite_vm(void);
+
+/* Copy 'sz' bytes of code into memory at 'addr'. */
+static inline void
+install_words(const uint16_t *code, uint32_t addr, size_t sz)
+{
+
+	memcpy(&memory[addr], code, sz);
+}
 
 #endif
@@ -3,8 +3,18 @@
 #include "test.h"
 
 static Suite *(*suites[])(void) = {
+	suite_asm,
+	suite_batch,
 	suite_emu,
+	suite_flight,
+	suite_hash,
 	suite_instr,
+	suite_lockstep,
+	suite_search,
+	suite_server,
+	suite_shm,
+	suite_snap,
+	suite_vm,
 	NULL,
 };
 
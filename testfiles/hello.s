@@ -0,0 +1,31 @@
+; count down, print a message, call a subroutine
+	.equ COUNT, 3
+.macro dec reg
+	add \reg, \reg, -1
+.endm
+.macro print str
+	mov r0, \str
+loop\@:	rmem r1, r0
+	jf r1, done\@
+	out r1
+	add r0, r0, 1
+	jmp loop\@
+done\@:
+.endm
+
+start:	mov r7, COUNT
+again:	call greet
+	dec r7
+	jt r7, again
+	print bye
+	halt
+
+greet:	push r0
+	print msg
+	pop r0
+	ret
+
+msg:	.stringz "hello, 'world'\n"
+bye:	.stringz "bye\n"
+table:	.word 1, 2, msg+1, -1, 'x'
+	.fill 3, 7
@@ -0,0 +1,974 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include <zlib.h>
+
+#include "emu.h"
+#include "instr.h"
+#include "trace.h"
+
+/*
+ * Instruction tracing.
+ *
+ * emulate1() hands each executed instruction to trace_insn(), which copies it
+ * into a single-producer/single-consumer ring.  A writer thread drains the
+ * ring, does the hex or disassembly formatting, and writes the result either
+ * straight to the trace file or through zlib.  The emulation thread never
+ * formats or blocks on I/O unless the ring fills up.
+ *
+ * The disassembly listing (-D) shares stdout with other output and is
+ * formatted synchronously to keep the two in order.
+ *
+ * With -i the writer instead packs records into chunks and ends the file with
+ * an index (see trace.h), so that a reader can seek by instruction or pc.
+ * With -C it splits them into per-field columns for the query tool.
+ */
+
+struct trace_rec {
+	uint16_t	 tr_pc;
+	uint8_t		 tr_size;
+	uint8_t		 tr_op;		/* Index into synacor_instr[] */
+	uint16_t	 tr_words[4];
+	/* Filled in for columnar traces only */
+	uint16_t	 tr_rw;
+	uint16_t	 tr_rwval;
+	uint16_t	 tr_mwaddr;
+	uint16_t	 tr_mwval;
+};
+
+#define	TRACE_RING	(1 << 16)	/* Records; power of two */
+#define	TRACE_BUF	(1 << 16)	/* Formatted bytes per write */
+
+bool			 tracehex;
+bool			 tracedisas;
+bool			 tracez;
+bool			 tracepc;
+bool			 traceidx;
+bool			 tracecols;
+FILE			*tracefile;
+
+static struct trace_rec	 ring[TRACE_RING];
+static _Atomic size_t	 ring_head;	/* Written by emulation thread */
+static _Atomic size_t	 ring_tail;	/* Written by writer thread */
+static atomic_bool	 ring_done;
+static size_t		 head_local;
+static size_t		 tail_cache;
+
+static bool		 trace_async;
+static pthread_t	 writer;
+static gzFile		 tracegz;
+static char		 obuf[TRACE_BUF];
+static size_t		 olen;
+static bool		 trace_failed;
+static uint64_t		 trace_first;	/* Instruction number of first record */
+static uint16_t		 trace_regs[8];	/* Registers before it */
+
+static struct tidx_entry *tidx;
+static size_t		 ntidx;
+static size_t		 atidx;
+static uint16_t		 chunk[TIDX_CHUNK * 5];
+static size_t		 chunklen;	/* Words */
+static uint64_t		 chunkoff;
+
+static struct tcol_entry *tcol;
+static size_t		 ntcol;
+static size_t		 atcol;
+static uint16_t		 cols[TC_NCOLS][TIDX_CHUNK];
+static size_t		 nrows;
+
+static void
+trace_flush(void)
+{
+	size_t wr;
+
+	if (olen == 0 || trace_failed)
+		goto out;
+
+	if (tracegz != NULL)
+		wr = gzwrite(tracegz, obuf, olen) == (int)olen ? olen : 0;
+	else
+		wr = fwrite(obuf, 1, olen, tracefile);
+	if (wr != olen) {
+		/* Keep draining so the emulator doesn't wedge. */
+		fprintf(stderr, "Failed to write trace: %s\n",
+		    strerror(errno));
+		trace_failed = true;
+	}
+out:
+	olen = 0;
+}
+
+static void
+trace_put(const void *buf, size_t len)
+{
+
+	if (olen + len > sizeof(obuf))
+		trace_flush();
+	memcpy(obuf + olen, buf, len);
+	olen += len;
+}
+
+static void
+trace_write(const void *buf, size_t len)
+{
+
+	if (trace_failed)
+		return;
+	if (fwrite(buf, 1, len, tracefile) != len) {
+		fprintf(stderr, "Failed to write trace: %s\n",
+		    strerror(errno));
+		trace_failed = true;
+	}
+	chunkoff += len;
+}
+
+static void
+tidx_flush(void)
+{
+	struct tidx_entry *te;
+	unsigned char *z;
+	uLongf zlen;
+	int rc;
+
+	te = &tidx[ntidx - 1];
+	if (te->te_ninsns == 0)
+		return;
+
+	te->te_off = chunkoff;
+	te->te_rawlen = chunklen * sizeof(chunk[0]);
+	if (tracez) {
+		zlen = compressBound(te->te_rawlen);
+		z = malloc(zlen);
+		ASSERT(z != NULL, "malloc");
+		rc = compress2(z, &zlen, (void *)chunk, te->te_rawlen,
+		    Z_BEST_SPEED);
+		ASSERT(rc == Z_OK, "compress2: %d", rc);
+		te->te_len = zlen;
+		trace_write(z, zlen);
+		free(z);
+	} else {
+		te->te_len = te->te_rawlen;
+		trace_write(chunk, te->te_rawlen);
+	}
+	chunklen = 0;
+}
+
+/* Append 'tr' to the current chunk, starting a new one if it is full. */
+static void
+tidx_put(const struct trace_rec *tr)
+{
+	struct tidx_entry *te;
+	unsigned j;
+
+	te = ntidx > 0 ? &tidx[ntidx - 1] : NULL;
+	if (te == NULL || te->te_ninsns == TIDX_CHUNK) {
+		if (te != NULL)
+			tidx_flush();
+		if (ntidx == atidx) {
+			atidx = atidx ? atidx * 2 : 64;
+			tidx = realloc(tidx, atidx * sizeof(*tidx));
+			ASSERT(tidx != NULL, "realloc");
+		}
+		te = &tidx[ntidx];
+		memset(te, 0, sizeof(*te));
+		te->te_insn = trace_first + (uint64_t)ntidx * TIDX_CHUNK;
+		ntidx++;
+	}
+
+	te->te_ninsns++;
+	te->te_pcmap[tr->tr_pc >> TIDX_PCSHIFT >> 6] |=
+	    1ULL << ((tr->tr_pc >> TIDX_PCSHIFT) & 63);
+	chunk[chunklen++] = tr->tr_pc;
+	chunk[chunklen++] = tr->tr_op;
+	for (j = 1; j < tr->tr_size; j++)
+		chunk[chunklen++] = tr->tr_words[j];
+}
+
+static void
+tidx_finish(void)
+{
+	struct tidx_trailer tt;
+
+	if (ntidx > 0)
+		tidx_flush();
+
+	memset(&tt, 0, sizeof(tt));
+	tt.tt_index = chunkoff;
+	tt.tt_nchunks = ntidx;
+	tt.tt_insns = ntidx > 0 ? tidx[ntidx - 1].te_insn +
+	    tidx[ntidx - 1].te_ninsns - trace_first : 0;
+	tt.tt_flags = tracez ? TIDX_Z : 0;
+	tt.tt_magic = TIDX_MAGIC;
+	trace_write(tidx, ntidx * sizeof(*tidx));
+	trace_write(&tt, sizeof(tt));
+
+	free(tidx);
+	tidx = NULL;
+	ntidx = atidx = 0;
+}
+
+static void
+tcol_flush(void)
+{
+	struct tcol_entry *te;
+	unsigned char *z;
+	uLongf zlen;
+	unsigned c;
+	int rc;
+
+	if (nrows == 0)
+		return;
+
+	if (ntcol == atcol) {
+		atcol = atcol ? atcol * 2 : 64;
+		tcol = realloc(tcol, atcol * sizeof(*tcol));
+		ASSERT(tcol != NULL, "realloc");
+	}
+	te = &tcol[ntcol];
+	memset(te, 0, sizeof(*te));
+	te->tc_insn = trace_first + (uint64_t)ntcol * TIDX_CHUNK;
+	te->tc_nrows = nrows;
+	ntcol++;
+
+	z = malloc(compressBound(sizeof(cols[0])));
+	ASSERT(z != NULL, "malloc");
+	for (c = 0; c < TC_NCOLS; c++) {
+		zlen = compressBound(sizeof(cols[0]));
+		rc = compress2(z, &zlen, (void *)cols[c],
+		    nrows * sizeof(cols[c][0]), Z_BEST_SPEED);
+		ASSERT(rc == Z_OK, "compress2: %d", rc);
+		te->tc_off[c] = chunkoff;
+		te->tc_len[c] = zlen;
+		trace_write(z, zlen);
+	}
+	free(z);
+	nrows = 0;
+}
+
+static void
+tcol_put(const struct trace_rec *tr)
+{
+	unsigned j;
+
+	cols[TC_PC][nrows] = tr->tr_pc;
+	cols[TC_OP][nrows] = tr->tr_op;
+	for (j = 0; j < 3; j++)
+		cols[TC_A + j][nrows] = j + 1 < tr->tr_size ?
+		    tr->tr_words[j + 1] : 0;
+	for (j = 0; j < 8; j++)
+		cols[TC_R0 + j][nrows] = trace_regs[j];
+	cols[TC_RW][nrows] = tr->tr_rw;
+	cols[TC_RWVAL][nrows] = tr->tr_rwval;
+	cols[TC_MWADDR][nrows] = tr->tr_mwaddr;
+	cols[TC_MWVAL][nrows] = tr->tr_mwval;
+
+	if (tr->tr_rw != TC_NONE)
+		trace_regs[tr->tr_rw] = tr->tr_rwval;
+	if (++nrows == TIDX_CHUNK)
+		tcol_flush();
+}
+
+static void
+tcol_finish(void)
+{
+	struct tidx_trailer tt;
+
+	tcol_flush();
+
+	memset(&tt, 0, sizeof(tt));
+	tt.tt_index = chunkoff;
+	tt.tt_nchunks = ntcol;
+	tt.tt_insns = ntcol > 0 ? tcol[ntcol - 1].tc_insn +
+	    tcol[ntcol - 1].tc_nrows - trace_first : 0;
+	tt.tt_magic = TCOL_MAGIC;
+	trace_write(tcol, ntcol * sizeof(*tcol));
+	trace_write(&tt, sizeof(tt));
+
+	free(tcol);
+	tcol = NULL;
+	ntcol = atcol = 0;
+}
+
+static void
+trace_format(const struct trace_rec *tr)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *name;
+	char line[128];
+	size_t len;
+	unsigned j;
+
+	if (traceidx) {
+		tidx_put(tr);
+		return;
+	}
+	if (tracecols) {
+		tcol_put(tr);
+		return;
+	}
+	if (!tracehex && !tracedisas) {
+		if (tracepc)
+			trace_put(&tr->tr_pc, sizeof(tr->tr_pc));
+		trace_put(tr->tr_words, tr->tr_size * sizeof(tr->tr_words[0]));
+		return;
+	}
+
+	len = 0;
+	if (onlydisas || tracepc)
+		len += snprintf(line, sizeof(line), "%05u: ", (uns)tr->tr_pc);
+	for (j = 0; j < tr->tr_size; j++) {
+		if (tracedisas && j == 0) {
+			name = synacor_instr[tr->tr_op].name;
+			memcpy(line + len, name, strlen(name));
+			len += strlen(name);
+		} else if (tracedisas)
+			len += fmtarg(line + len, tr->tr_words[j],
+			    j == (unsigned)tr->tr_size - 1);
+		else {
+			line[len++] = hex[tr->tr_words[j] >> 12];
+			line[len++] = hex[(tr->tr_words[j] >> 8) & 0xf];
+			line[len++] = hex[(tr->tr_words[j] >> 4) & 0xf];
+			line[len++] = hex[tr->tr_words[j] & 0xf];
+			line[len++] = ' ';
+		}
+	}
+	line[len++] = '\n';
+	trace_put(line, len);
+}
+
+static void *
+trace_writer(void *arg __unused)
+{
+	struct timespec nap = { 0, 100000 };
+	size_t head, tail;
+	bool done;
+
+	tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	while (true) {
+		done = atomic_load_explicit(&ring_done, memory_order_acquire);
+		head = atomic_load_explicit(&ring_head, memory_order_acquire);
+		if (head == tail) {
+			if (done)
+				break;
+			trace_flush();
+			nanosleep(&nap, NULL);
+			continue;
+		}
+
+		for (; tail != head; tail++)
+			trace_format(&ring[tail % TRACE_RING]);
+		atomic_store_explicit(&ring_tail, tail, memory_order_release);
+	}
+	trace_flush();
+	return (NULL);
+}
+
+/* Start tracing to 'tracefile' in the format selected by the trace flags. */
+void
+trace_open(void)
+{
+	sigset_t all, old;
+	int fd, rc;
+
+	if (tracefile == NULL)
+		return;
+
+	if (traceidx || tracecols) {
+		struct tidx_header th;
+
+		th.th_magic = traceidx ? TIDX_MAGIC : TCOL_MAGIC;
+		th.th_flags = traceidx && tracez ? TIDX_Z : 0;
+		chunkoff = 0;
+		trace_write(&th, sizeof(th));
+	} else if (tracez) {
+		fd = dup(fileno(tracefile));
+		ASSERT(fd >= 0, "dup: %s", strerror(errno));
+		tracegz = gzdopen(fd, "wb1");
+		ASSERT(tracegz != NULL, "gzdopen");
+	}
+
+	trace_async = !onlydisas;
+	if (!trace_async)
+		return;
+
+	atomic_store(&ring_head, 0);
+	atomic_store(&ring_tail, 0);
+	atomic_store(&ring_done, false);
+	head_local = tail_cache = 0;
+
+	/* Signals, SIGPROF samples especially, belong to the emulator. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&writer, NULL, trace_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	ASSERT(rc == 0, "pthread_create: %s", strerror(rc));
+}
+
+/* Drain outstanding records and close the trace. */
+void
+trace_close(void)
+{
+
+	if (tracefile == NULL)
+		return;
+
+	if (trace_async) {
+		atomic_store_explicit(&ring_done, true, memory_order_release);
+		pthread_join(writer, NULL);
+		trace_async = false;
+	} else
+		trace_flush();
+
+	if (traceidx)
+		tidx_finish();
+	else if (tracecols)
+		tcol_finish();
+	if (tracegz != NULL) {
+		if (gzclose(tracegz) != Z_OK)
+			fprintf(stderr, "Failed to write trace\n");
+		tracegz = NULL;
+	}
+	if (tracefile != stdout)
+		fclose(tracefile);
+	else
+		fflush(tracefile);
+	tracefile = NULL;
+	trace_on = false;
+}
+
+/*
+ * Trace filters.
+ *
+ * The insn window and the call filter decide whether tracing is on at all;
+ * while it is off, emulate1() skips the trace hook entirely.  They change
+ * state only at known points, so trace_update() reevaluates them when insns
+ * reaches trace_next, and the call and ret hooks force that early.  The pc
+ * and opcode filters are per instruction and are checked in trace_insn().
+ */
+bool			 trace_on;
+uint64_t		 trace_next = UINT64_MAX;
+int32_t			 trace_callee = -1;
+bool			 trace_incall;
+size_t			 trace_calldepth;
+
+static bool		 trace_live;
+static bool		 trace_begun;
+static uint64_t		 trace_win_lo;
+static uint64_t		 trace_win_hi = UINT64_MAX;
+static bool		 trace_filtered;
+static uint32_t		 trace_opmask = UINT32_MAX;
+static uint64_t		 trace_pcmap[MEMWORDS / 64];
+static bool		 trace_pcset;
+
+/* Parse filter 'spec' (see usage()); returns false if it is malformed. */
+bool
+trace_filter(const char *spec)
+{
+	unsigned long lo, hi, i;
+	const char *p;
+	char *end;
+	size_t len;
+
+	if (strncmp(spec, "insn=", 5) == 0) {
+		trace_win_lo = strtoull(spec + 5, &end, 0);
+		if (*end != ':')
+			return (false);
+		trace_win_hi = UINT64_MAX;
+		if (*++end != 0)
+			trace_win_hi = strtoull(end, &end, 0);
+		return (*end == 0 && trace_win_lo < trace_win_hi);
+	}
+
+	if (strncmp(spec, "pc=", 3) == 0) {
+		lo = hi = strtoul(spec + 3, &end, 0);
+		if (*end == ':')
+			hi = strtoul(end + 1, &end, 0);
+		if (*end != 0 || lo > hi || hi >= MEMWORDS)
+			return (false);
+		if (!trace_pcset)
+			memset(trace_pcmap, 0, sizeof(trace_pcmap));
+		for (i = lo; i <= hi; i++)
+			trace_pcmap[i / 64] |= 1ULL << (i % 64);
+		trace_pcset = trace_filtered = true;
+		return (true);
+	}
+
+	if (strncmp(spec, "op=", 3) == 0) {
+		trace_opmask = 0;
+		for (p = spec + 3; *p != 0; p += len + (p[len] == ',')) {
+			len = strcspn(p, ",");
+			for (i = 0; i < SYNACOR_NINSTR; i++)
+				if (strlen(synacor_instr[i].name) == len &&
+				    strncmp(synacor_instr[i].name, p, len) == 0)
+					break;
+			if (i == SYNACOR_NINSTR)
+				return (false);
+			trace_opmask |= 1u << i;
+		}
+		trace_filtered = true;
+		return (trace_opmask != 0);
+	}
+
+	if (strncmp(spec, "call=", 5) == 0) {
+		lo = strtoul(spec + 5, &end, 0);
+		if (*end != 0 || lo >= MEMWORDS)
+			return (false);
+		trace_callee = lo;
+		return (true);
+	}
+	return (false);
+}
+
+/* True if only the insn window filter is in use. */
+bool
+trace_contiguous(void)
+{
+
+	return (!trace_filtered && trace_callee < 0);
+}
+
+/* Reevaluate the insn window and call filters. */
+void
+trace_update(void)
+{
+	bool on;
+
+	if (trace_incall && stack_depth <= trace_calldepth)
+		trace_incall = false;
+
+	on = tracefile != NULL && trace_live && insns >= trace_win_lo &&
+	    insns < trace_win_hi && (trace_callee < 0 || trace_incall);
+	if (on && !trace_begun) {
+		/* Published to the writer by the first record. */
+		trace_begun = true;
+		trace_first = insns;
+		memcpy(trace_regs, regs, sizeof(trace_regs));
+	}
+	trace_on = on;
+
+	if (insns < trace_win_lo)
+		trace_next = trace_win_lo;
+	else if (insns < trace_win_hi)
+		trace_next = trace_win_hi;
+	else
+		trace_next = UINT64_MAX;
+}
+
+/*
+ * main() calls this before the first instruction that may be traced, and
+ * emulate() again once a silent replay catches up.
+ */
+void
+trace_start(void)
+{
+
+	trace_live = true;
+	trace_update();
+}
+
+/* Fill in the register and memory stores of the just-executed 'tr'. */
+static void
+trace_stores(struct trace_rec *tr)
+{
+	uint16_t a;
+
+	tr->tr_rw = tr->tr_mwaddr = TC_NONE;
+	tr->tr_rwval = tr->tr_mwval = 0;
+	if (INSTR_SETSREG(tr->tr_op) && tr->tr_words[1] > INT16_MAX &&
+	    tr->tr_words[1] - 32768u < ARRAYLEN(regs)) {
+		tr->tr_rw = tr->tr_words[1] - 32768;
+		tr->tr_rwval = regs[tr->tr_rw];
+	} else if (tr->tr_op == 16) {	/* wmem */
+		a = tr->tr_words[1];
+		if (a > INT16_MAX)
+			a = regs[(a - 32768) % ARRAYLEN(regs)];
+		tr->tr_mwaddr = a % MEMWORDS;
+		tr->tr_mwval = memory[tr->tr_mwaddr];
+	}
+}
+
+/* Record the instruction at 'addr', instr_decode index 'op', 'size' words. */
+void
+trace_insn(uint32_t addr, unsigned op, unsigned size)
+{
+	struct trace_rec *tr, rec;
+	unsigned j;
+
+	ASSERT(size > 0 && size < 5, "instr_size: %u", size);
+
+	if (unlikely(trace_filtered) && ((trace_opmask & (1u << op)) == 0 ||
+	    (trace_pcset &&
+	    (trace_pcmap[addr / 64] & (1ULL << (addr % 64))) == 0)))
+		return;
+
+	if (!trace_async)
+		tr = &rec;
+	else {
+		if (head_local - tail_cache == TRACE_RING) {
+			while ((tail_cache = atomic_load_explicit(&ring_tail,
+			    memory_order_acquire)) + TRACE_RING == head_local)
+				sched_yield();
+		}
+		tr = &ring[head_local % TRACE_RING];
+	}
+
+	tr->tr_pc = addr;
+	tr->tr_size = size;
+	tr->tr_op = op;
+	for (j = 0; j < size; j++)
+		tr->tr_words[j] = memory[addr + j];
+	if (tracecols)
+		trace_stores(tr);
+
+	if (!trace_async) {
+		trace_format(tr);
+		trace_flush();
+		return;
+	}
+	head_local++;
+	atomic_store_explicit(&ring_head, head_local, memory_order_release);
+}
+
+/*
+ * Compact branch trace.
+ *
+ * Execution is deterministic given the starting state and the bytes 'in'
+ * returns, so a compact trace only needs those plus enough to check that a
+ * decoder re-executing the run follows the same path: one bit per jt/jf
+ * outcome, the target of each register-indirect jump or call and of each
+ * ret, and each input byte.  Events are packed into a bit stream with no
+ * tags (the decoder always knows which event comes next) and deflated.
+ *
+ * File format is:
+ *
+ * magic:u32 || insns:u64 || ckpt_write() image || deflate(events) ||
+ * end_insns:u64
+ *
+ * Decoding (-u) restores the image, re-executes with 'in' fed from the
+ * trace and every branch checked against it, and produces the full trace.
+ */
+#define	BTRACE_MAGIC	0x544e5953	/* "SYNT" */
+
+FILE			*btracefile;
+bool			 btrace_active;
+bool			 btrace_decoding;
+
+static z_stream		 bz;
+static unsigned char	 bzbuf[TRACE_BUF];
+static unsigned char	 bzbytes[TRACE_BUF];
+static size_t		 bzlen;		/* Bytes in bzbytes (write side) */
+static size_t		 bzpos;		/* Next byte in bzbytes (read side) */
+static uint64_t		 bzbits;
+static unsigned		 bznbits;
+
+static void
+btrace_deflate(int flush)
+{
+	int rc;
+
+	bz.next_in = bzbytes;
+	bz.avail_in = bzlen;
+	do {
+		bz.next_out = bzbuf;
+		bz.avail_out = sizeof(bzbuf);
+		rc = deflate(&bz, flush);
+		ASSERT(rc != Z_STREAM_ERROR, "deflate");
+		fwrite(bzbuf, 1, sizeof(bzbuf) - bz.avail_out, btracefile);
+	} while (bz.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+	bzlen = 0;
+}
+
+static void
+putbits(uint32_t v, unsigned n)
+{
+
+	bzbits |= (uint64_t)v << bznbits;
+	bznbits += n;
+	while (bznbits >= 8) {
+		bzbytes[bzlen++] = bzbits;
+		bzbits >>= 8;
+		bznbits -= 8;
+		if (bzlen == sizeof(bzbytes))
+			btrace_deflate(Z_NO_FLUSH);
+	}
+}
+
+static uint32_t
+getbits(unsigned n)
+{
+	int rc;
+
+	while (bznbits < n) {
+		if (bzpos == bzlen) {
+			bz.next_out = bzbytes;
+			bz.avail_out = sizeof(bzbytes);
+			do {
+				if (bz.avail_in == 0) {
+					bz.next_in = bzbuf;
+					bz.avail_in = fread(bzbuf, 1,
+					    sizeof(bzbuf), btracefile);
+				}
+				rc = inflate(&bz, Z_NO_FLUSH);
+				if (rc != Z_OK && rc != Z_STREAM_END) {
+					fprintf(stderr, "Corrupt branch trace "
+					    "at instruction %ju\n",
+					    (uintmax_t)insns);
+					abort_nodump();
+				}
+			} while (bz.avail_out == sizeof(bzbytes) &&
+			    rc != Z_STREAM_END);
+			bzpos = 0;
+			bzlen = sizeof(bzbytes) - bz.avail_out;
+			if (bzlen == 0) {
+				fprintf(stderr, "Branch trace ends early at "
+				    "instruction %ju\n", (uintmax_t)insns);
+				abort_nodump();
+			}
+		}
+		bzbits |= (uint64_t)bzbytes[bzpos++] << bznbits;
+		bznbits += 8;
+	}
+
+	rc = bzbits & ((1ULL << n) - 1);
+	bzbits >>= n;
+	bznbits -= n;
+	return (rc);
+}
+
+/* Begin the compact trace at the current machine state. */
+void
+btrace_start(void)
+{
+	uint64_t insns_tmp;
+	uint32_t magic;
+	int rc;
+
+	if (btracefile == NULL || btrace_active)
+		return;
+
+	magic = BTRACE_MAGIC;
+	insns_tmp = insns;
+	fwrite(&magic, sizeof(magic), 1, btracefile);
+	fwrite(&insns_tmp, sizeof(insns_tmp), 1, btracefile);
+	ckpt_write(btracefile);
+
+	memset(&bz, 0, sizeof(bz));
+	rc = deflateInit(&bz, Z_BEST_SPEED);
+	ASSERT(rc == Z_OK, "deflateInit: %d", rc);
+	bzlen = 0;
+	bzbits = 0;
+	bznbits = 0;
+	btrace_active = true;
+}
+
+void
+btrace_close(void)
+{
+	uint64_t insns_tmp;
+
+	if (btracefile == NULL)
+		return;
+
+	if (btrace_active && !btrace_decoding) {
+		if (bznbits > 0)
+			putbits(0, 8 - bznbits);
+		btrace_deflate(Z_FINISH);
+		deflateEnd(&bz);
+		insns_tmp = insns;
+		fwrite(&insns_tmp, sizeof(insns_tmp), 1, btracefile);
+		if (fclose(btracefile) != 0)
+			fprintf(stderr, "Failed to write branch trace: %s\n",
+			    strerror(errno));
+	} else if (btrace_decoding) {
+		inflateEnd(&bz);
+		fclose(btracefile);
+	} else
+		fclose(btracefile);
+	btracefile = NULL;
+	btrace_active = btrace_decoding = false;
+}
+
+static void
+btrace_check(uint32_t want, uint32_t got, const char *what)
+{
+
+	if (likely(want == got))
+		return;
+	fprintf(stderr, "Branch trace diverged at instruction %ju, pc %u: "
+	    "%s recorded %u, executed %u\n", (uintmax_t)insns,
+	    (uns)pc_start, what, (uns)want, (uns)got);
+	abort_nodump();
+}
+
+/*
+ * Called by emulate1() after each instruction while recording or decoding a
+ * compact trace.
+ */
+void
+btrace_insn(const struct instr_decode_common *idc)
+{
+	uint32_t taken, target;
+	bool indirect;
+
+	switch (idc->instr) {
+	case 7:		/* jt */
+	case 8:		/* jf */
+		taken = (pc != pc_start + 3);
+		indirect = taken && idc->args[1] > INT16_MAX;
+		break;
+	case 6:		/* jmp */
+	case 17:	/* call */
+		taken = 1;
+		indirect = idc->args[0] > INT16_MAX;
+		break;
+	case 18:	/* ret */
+		taken = 1;
+		indirect = !halted;
+		break;
+	case 20:	/* in */
+		if (!btrace_decoding) {
+			putbits(halted, 1);
+			putbits(regs[idc->args[0] - 32768] & 0xff, 8);
+		}
+		return;
+	default:
+		return;
+	}
+	target = pc;
+
+	if (btrace_decoding) {
+		if (idc->instr == 7 || idc->instr == 8)
+			btrace_check(getbits(1), taken, "branch");
+		if (indirect)
+			btrace_check(getbits(16), target, "target");
+		return;
+	}
+
+	if (idc->instr == 7 || idc->instr == 8)
+		putbits(taken, 1);
+	if (indirect)
+		putbits(target, 16);
+}
+
+/* Called by instr_in() in place of reading 'infile' while decoding. */
+int
+btrace_getc(void)
+{
+	uint32_t eof, c;
+
+	eof = getbits(1);
+	c = getbits(8);
+	return (eof ? EOF : (int)c);
+}
+
+/*
+ * Load the starting state of compact trace 'f' and arrange for the run to be
+ * re-executed from it.
+ */
+void
+btrace_decode_open(FILE *f)
+{
+	const char *error;
+	uint64_t start, end;
+	uint32_t magic;
+	off_t off;
+	int rc;
+
+	error = "bad header";
+	if (fread(&magic, sizeof(magic), 1, f) != 1 ||
+	    magic != BTRACE_MAGIC ||
+	    fread(&start, sizeof(start), 1, f) != 1)
+		goto out;
+	error = ckpt_read(f);
+	if (error != NULL)
+		goto out;
+
+	error = "truncated";
+	off = ftello(f);
+	if (off < 0 || fseeko(f, -(off_t)sizeof(end), SEEK_END) != 0 ||
+	    fread(&end, sizeof(end), 1, f) != 1 ||
+	    fseeko(f, off, SEEK_SET) != 0 || end < start)
+		goto out;
+	error = NULL;
+
+out:
+	if (error != NULL) {
+		fprintf(stderr, "Couldn't read branch trace: %s\n", error);
+		exit(1);
+	}
+
+	memset(&bz, 0, sizeof(bz));
+	rc = inflateInit(&bz);
+	ASSERT(rc == Z_OK, "inflateInit: %d", rc);
+	bzpos = bzlen = 0;
+	bzbits = 0;
+	bznbits = 0;
+
+	btracefile = f;
+	btrace_active = btrace_decoding = true;
+	insns = start;
+	if (insnlimit == 0 || end < insnlimit)
+		insnlimit = end;
+	printf("Decoding instructions %ju to %ju.\n", (uintmax_t)start,
+	    (uintmax_t)end);
+}
+
+/*
+ * Map trace file 'name' and locate its index of 'entsize'-byte entries;
+ * exits on error.
+ */
+void
+tmap_open(struct tmap *tm, const char *name, uint32_t magic, size_t entsize)
+{
+	const struct tidx_header *th;
+	const struct tidx_trailer *tt;
+	struct stat sb;
+	const char *error;
+	int fd;
+
+	memset(tm, 0, sizeof(*tm));
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		fprintf(stderr, "Failed to open trace `%s': %s\n", name,
+		    strerror(errno));
+		exit(1);
+	}
+
+	error = "wrong kind of trace";
+	if ((size_t)sb.st_size < sizeof(*th) + sizeof(*tt))
+		goto out;
+	tm->tm_len = sb.st_size;
+	tm->tm_map = mmap(NULL, tm->tm_len, PROT_READ, MAP_SHARED, fd, 0);
+	ASSERT(tm->tm_map != MAP_FAILED, "mmap: %s", strerror(errno));
+	close(fd);
+
+	th = (const void *)tm->tm_map;
+	tt = (const void *)(tm->tm_map + tm->tm_len - sizeof(*tt));
+	if (th->th_magic != magic || tt->tt_magic != magic)
+		goto out;
+	error = "corrupt index";
+	if (tt->tt_index > tm->tm_len - sizeof(*tt) ||
+	    tt->tt_nchunks != (tm->tm_len - sizeof(*tt) - tt->tt_index) /
+	    entsize)
+		goto out;
+
+	tm->tm_idx = tm->tm_map + tt->tt_index;
+	tm->tm_nchunks = tt->tt_nchunks;
+	tm->tm_insns = tt->tt_insns;
+	tm->tm_flags = tt->tt_flags;
+	error = NULL;
+
+out:
+	if (error != NULL) {
+		fprintf(stderr, "Failed to read trace `%s': %s\n", name,
+		    error);
+		exit(1);
+	}
+}
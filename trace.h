@@ -0,0 +1,96 @@
+#ifndef	__TRACE_H__
+#define	__TRACE_H__
+
+/*
+ * Indexed trace file layout (-i).
+ *
+ * header || chunk* || tidx_entry[nchunks] || tidx_trailer
+ *
+ * Each chunk holds up to TIDX_CHUNK consecutive instructions, optionally
+ * zlib-compressed (TIDX_Z).  An instruction is pc:u16 || op:u16 || args, where
+ * op is the executed synacor_instr[] index and the number of args follows
+ * from it.  The index sits at the end so the file can be written in one pass;
+ * readers find it through the fixed-size trailer.
+ */
+#define	TIDX_MAGIC	0x584e5953	/* "SYNX" */
+#define	TIDX_CHUNK	65536		/* Instructions per chunk */
+#define	TIDX_PCSHIFT	4		/* Words per pc map bit: 16 */
+#define	TIDX_PCMAP	(MEMWORDS >> TIDX_PCSHIFT >> 6)
+
+#define	TIDX_Z		0x1
+
+struct tidx_header {
+	uint32_t	 th_magic;
+	uint32_t	 th_flags;
+};
+
+struct tidx_entry {
+	uint64_t	 te_insn;	/* First instruction in chunk */
+	uint64_t	 te_off;
+	uint32_t	 te_len;	/* On disk */
+	uint32_t	 te_rawlen;
+	uint32_t	 te_ninsns;
+	uint32_t	 te_pad;
+	/* Bit (pc >> TIDX_PCSHIFT) is set if the chunk executes near pc. */
+	uint64_t	 te_pcmap[TIDX_PCMAP];
+};
+
+struct tidx_trailer {
+	uint64_t	 tt_index;	/* Offset of tidx_entry[0] */
+	uint64_t	 tt_nchunks;
+	uint64_t	 tt_insns;	/* Total instructions */
+	uint32_t	 tt_flags;
+	uint32_t	 tt_magic;
+};
+
+/*
+ * Columnar trace file layout (-C).
+ *
+ * header || (column[TC_NCOLS])* || tcol_entry[nchunks] || tidx_trailer
+ *
+ * Chunks hold TIDX_CHUNK rows, one per instruction.  Each column is an array
+ * of u16, one per row, compressed on its own so that a reader inflates only
+ * the columns a query touches.  A..C are the raw argument words (0 if the
+ * instruction has fewer); R0..R7 are the registers on entry to the
+ * instruction; RW is the register the instruction writes, and MWADDR the word
+ * it stores to, or TC_NONE.
+ */
+#define	TCOL_MAGIC	0x434e5953	/* "SYNC" */
+#define	TC_NONE		0xffff
+
+enum tcol {
+	TC_PC,
+	TC_OP,
+	TC_A,
+	TC_B,
+	TC_C,
+	TC_R0,
+	TC_RW = TC_R0 + 8,
+	TC_RWVAL,
+	TC_MWADDR,
+	TC_MWVAL,
+	TC_NCOLS
+};
+
+struct tcol_entry {
+	uint64_t	 tc_insn;	/* First instruction in chunk */
+	uint32_t	 tc_nrows;
+	uint32_t	 tc_pad;
+	uint64_t	 tc_off[TC_NCOLS];
+	uint32_t	 tc_len[TC_NCOLS];
+};
+
+/* A mapped indexed or columnar trace, for the reader tools. */
+struct tmap {
+	const unsigned char	*tm_map;
+	size_t			 tm_len;
+	const void		*tm_idx;	/* Index entries */
+	uint64_t		 tm_nchunks;
+	uint64_t		 tm_insns;
+	uint32_t		 tm_flags;
+};
+
+void	tmap_open(struct tmap *tm, const char *name, uint32_t magic,
+	    size_t entsize);
+
+#endif
@@ -0,0 +1,457 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "emu.h"
+#include "instr.h"
+#include "trace.h"
+
+/*
+ * synacor-tracediff: find the first instruction where two traces differ.
+ *
+ * Both traces are mapped and compared with wide vector compares, which run at
+ * memory bandwidth; records are only decoded around the divergence.  Indexed
+ * (-i) traces are compared chunk by chunk on disk, so identical chunks are
+ * skipped without inflating them, and report pcs.  Plain binary (-t) traces
+ * hold only instruction words: the differing byte is found the same way, then
+ * the prefix is walked once to count instructions.
+ */
+
+#define	DREC_WORDS	5
+#define	MAXCONTEXT	100000
+
+struct drec {
+	uint64_t	 dr_insn;
+	int32_t		 dr_pc;		/* -1 in plain traces */
+	uint16_t	 dr_op;
+	uint16_t	 dr_args[3];
+};
+
+struct dtrace {
+	const char		*dt_name;
+	bool			 dt_indexed;
+
+	/* Plain: the whole file.  Indexed: the decoded chunk. */
+	const uint16_t		*dt_words;
+	size_t			 dt_nwords;
+
+	struct tmap		 dt_tm;
+	const struct tidx_entry	*dt_idx;
+	uint16_t		*dt_buf;
+};
+
+/* A position in a trace. */
+struct dcur {
+	struct dtrace		*dc_t;
+	uint64_t		 dc_chunk;
+	size_t			 dc_off;	/* Words into dt_words */
+	uint64_t		 dc_insn;
+};
+
+static unsigned	 context = 3;
+
+static void
+dusage(void)
+{
+
+	printf("usage: synacor-tracediff [-c N] trace1 trace2\n"
+		"\n"
+		"  Compares two indexed (-i) or two plain binary (-t) traces and\n"
+		"  prints the first instruction where they differ, with N\n"
+		"  instructions of context (default 3, at most 100000).  Exits 0\n"
+		"  if the traces match, 1 if they differ.\n");
+	exit(2);
+}
+
+/* Offset of the first byte where 'a' and 'b' differ, or 'len'. */
+static size_t
+firstdiff(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	uint64_t x, y;
+	size_t i;
+
+	i = 0;
+#if defined(__AVX2__)
+	for (; i + 128 <= len; i += 128) {
+		__m256i d0, d1, d2, d3;
+
+		d0 = _mm256_xor_si256(_mm256_loadu_si256((const void *)(a + i)),
+		    _mm256_loadu_si256((const void *)(b + i)));
+		d1 = _mm256_xor_si256(
+		    _mm256_loadu_si256((const void *)(a + i + 32)),
+		    _mm256_loadu_si256((const void *)(b + i + 32)));
+		d2 = _mm256_xor_si256(
+		    _mm256_loadu_si256((const void *)(a + i + 64)),
+		    _mm256_loadu_si256((const void *)(b + i + 64)));
+		d3 = _mm256_xor_si256(
+		    _mm256_loadu_si256((const void *)(a + i + 96)),
+		    _mm256_loadu_si256((const void *)(b + i + 96)));
+		d0 = _mm256_or_si256(_mm256_or_si256(d0, d1),
+		    _mm256_or_si256(d2, d3));
+		if (!_mm256_testz_si256(d0, d0))
+			break;
+	}
+#elif defined(__SSE2__)
+	for (; i + 64 <= len; i += 64) {
+		__m128i e0, e1, e2, e3;
+
+		e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(a + i)),
+		    _mm_loadu_si128((const void *)(b + i)));
+		e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(a + i + 16)),
+		    _mm_loadu_si128((const void *)(b + i + 16)));
+		e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(a + i + 32)),
+		    _mm_loadu_si128((const void *)(b + i + 32)));
+		e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(a + i + 48)),
+		    _mm_loadu_si128((const void *)(b + i + 48)));
+		e0 = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+		if (_mm_movemask_epi8(e0) != 0xffff)
+			break;
+	}
+#endif
+	/* The rest, or the block that differs. */
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			break;
+	}
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return (i);
+}
+
+static void
+dtrace_open(struct dtrace *dt, const char *name)
+{
+	const struct tidx_header *th;
+	struct stat sb;
+	void *map;
+	int fd;
+
+	memset(dt, 0, sizeof(*dt));
+	dt->dt_name = name;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		fprintf(stderr, "Failed to open trace `%s': %s\n", name,
+		    strerror(errno));
+		exit(2);
+	}
+	map = NULL;
+	if (sb.st_size > 0) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		ASSERT(map != MAP_FAILED, "mmap: %s", strerror(errno));
+	}
+	close(fd);
+
+	th = map;
+	if ((size_t)sb.st_size >= sizeof(*th) && th->th_magic == TIDX_MAGIC) {
+		munmap(map, sb.st_size);
+		tmap_open(&dt->dt_tm, name, TIDX_MAGIC,
+		    sizeof(struct tidx_entry));
+		dt->dt_indexed = true;
+		dt->dt_idx = dt->dt_tm.tm_idx;
+		dt->dt_buf = malloc(TIDX_CHUNK * DREC_WORDS * sizeof(uint16_t));
+		ASSERT(dt->dt_buf != NULL, "malloc");
+		return;
+	}
+
+	/* Text and compressed traces don't start with an opcode word. */
+	if (sb.st_size % 2 != 0 ||
+	    (sb.st_size > 0 && ((const uint16_t *)map)[0] >= SYNACOR_NINSTR)) {
+		fprintf(stderr, "`%s' is neither an indexed nor a plain binary "
+		    "trace.\n", name);
+		exit(2);
+	}
+	dt->dt_words = map;
+	dt->dt_nwords = sb.st_size / 2;
+}
+
+static void
+dtrace_load(struct dtrace *dt, uint64_t c)
+{
+	const struct tidx_entry *te;
+	uLongf rawlen;
+	int rc;
+
+	te = &dt->dt_idx[c];
+	ASSERT(te->te_off + te->te_len <= dt->dt_tm.tm_len &&
+	    te->te_rawlen <= TIDX_CHUNK * DREC_WORDS * sizeof(uint16_t),
+	    "%s: corrupt chunk %ju", dt->dt_name, (uintmax_t)c);
+	if (dt->dt_tm.tm_flags & TIDX_Z) {
+		rawlen = te->te_rawlen;
+		rc = uncompress((void *)dt->dt_buf, &rawlen,
+		    dt->dt_tm.tm_map + te->te_off, te->te_len);
+		ASSERT(rc == Z_OK && rawlen == te->te_rawlen,
+		    "%s: corrupt chunk %ju", dt->dt_name, (uintmax_t)c);
+		dt->dt_words = dt->dt_buf;
+	} else
+		dt->dt_words = (const void *)(dt->dt_tm.tm_map + te->te_off);
+	dt->dt_nwords = te->te_rawlen / sizeof(uint16_t);
+}
+
+static void
+dcur_init(struct dcur *dc, struct dtrace *dt, uint64_t chunk)
+{
+
+	memset(dc, 0, sizeof(*dc));
+	dc->dc_t = dt;
+	if (dt->dt_indexed) {
+		dc->dc_chunk = chunk;
+		if (chunk < dt->dt_tm.tm_nchunks) {
+			dtrace_load(dt, chunk);
+			dc->dc_insn = dt->dt_idx[chunk].te_insn;
+		} else
+			dt->dt_nwords = 0;
+	}
+}
+
+/* Words in the record at the cursor, or 0 at the end of the trace. */
+static unsigned
+dcur_size(struct dcur *dc)
+{
+	struct dtrace *dt = dc->dc_t;
+	unsigned hdr, n;
+	uint16_t op;
+
+	while (dc->dc_off == dt->dt_nwords) {
+		if (!dt->dt_indexed ||
+		    dc->dc_chunk + 1 >= dt->dt_tm.tm_nchunks)
+			return (0);
+		dcur_init(dc, dt, dc->dc_chunk + 1);
+	}
+
+	hdr = dt->dt_indexed ? 2 : 1;
+	op = dt->dt_words[dc->dc_off + hdr - 1];
+	ASSERT(op < SYNACOR_NINSTR, "%s: corrupt record at instruction %ju",
+	    dt->dt_name, (uintmax_t)dc->dc_insn);
+	n = hdr + synacor_instr[op].arguments;
+	/* A trace cut off mid-record ends there. */
+	if (dc->dc_off + n > dt->dt_nwords)
+		return (0);
+	return (n);
+}
+
+/* Read the record at the cursor and advance; false at the end. */
+static bool
+dcur_next(struct dcur *dc, struct drec *dr)
+{
+	const uint16_t *w;
+	unsigned n, hdr, j;
+
+	n = dcur_size(dc);
+	if (n == 0)
+		return (false);
+
+	w = &dc->dc_t->dt_words[dc->dc_off];
+	hdr = dc->dc_t->dt_indexed ? 2 : 1;
+	memset(dr, 0, sizeof(*dr));
+	dr->dr_insn = dc->dc_insn;
+	dr->dr_pc = hdr == 2 ? w[0] : -1;
+	dr->dr_op = w[hdr - 1];
+	for (j = 0; j < n - hdr; j++)
+		dr->dr_args[j] = w[hdr + j];
+
+	dc->dc_off += n;
+	dc->dc_insn++;
+	return (true);
+}
+
+static bool
+drec_eq(const struct drec *a, const struct drec *b)
+{
+
+	return (a->dr_pc == b->dr_pc && a->dr_op == b->dr_op &&
+	    memcmp(a->dr_args, b->dr_args, sizeof(a->dr_args)) == 0);
+}
+
+static void
+drec_print(char mark, const struct drec *dr)
+{
+	unsigned j, n;
+
+	printf("%c %ju ", mark, (uintmax_t)dr->dr_insn);
+	if (dr->dr_pc >= 0)
+		printf("%05u: ", (uns)dr->dr_pc);
+	fputs(synacor_instr[dr->dr_op].name, stdout);
+	n = synacor_instr[dr->dr_op].arguments;
+	for (j = 0; j < n; j++)
+		printarg(stdout, dr->dr_args[j], j == n - 1);
+	putchar('\n');
+}
+
+/* First chunk whose on-disk bytes differ between the indexed traces. */
+static uint64_t
+skip_chunks(const struct dtrace *a, const struct dtrace *b)
+{
+	const struct tidx_entry *ea, *eb;
+	uint64_t c, n;
+
+	if (a->dt_tm.tm_flags != b->dt_tm.tm_flags)
+		return (0);
+	n = min(a->dt_tm.tm_nchunks, b->dt_tm.tm_nchunks);
+	for (c = 0; c < n; c++) {
+		ea = &a->dt_idx[c];
+		eb = &b->dt_idx[c];
+		if (ea->te_insn != eb->te_insn ||
+		    ea->te_ninsns != eb->te_ninsns || ea->te_len != eb->te_len ||
+		    ea->te_off + ea->te_len > a->dt_tm.tm_len ||
+		    eb->te_off + eb->te_len > b->dt_tm.tm_len ||
+		    firstdiff(a->dt_tm.tm_map + ea->te_off,
+		    b->dt_tm.tm_map + eb->te_off, ea->te_len) != ea->te_len)
+			break;
+	}
+	return (c);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct dtrace ta, tb;
+	struct dcur ca, cb;
+	struct drec ra, rb, *ring;
+	uint64_t c, nring, k;
+	size_t d, n, lim, off, mask, *offs;
+	unsigned long lv;
+	char *end;
+	bool ha, hb;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		switch (opt) {
+		case 'c':
+			errno = 0;
+			lv = strtoul(optarg, &end, 10);
+			if (!isdigit((unsigned char)optarg[0]) || *end != '\0' ||
+			    errno != 0 || lv > MAXCONTEXT)
+				dusage();
+			context = lv;
+			break;
+		default:
+			dusage();
+			break;
+		}
+	}
+	if (optind != argc - 2)
+		dusage();
+
+	dtrace_open(&ta, argv[optind]);
+	dtrace_open(&tb, argv[optind + 1]);
+	if (ta.dt_indexed != tb.dt_indexed) {
+		fprintf(stderr, "Can't compare an indexed trace with a plain "
+		    "one.\n");
+		return (2);
+	}
+
+	d = 0;
+	if (ta.dt_indexed) {
+		c = skip_chunks(&ta, &tb);
+		if (c == ta.dt_tm.tm_nchunks && c == tb.dt_tm.tm_nchunks) {
+			printf("Traces match (%ju instructions).\n",
+			    (uintmax_t)ta.dt_tm.tm_insns);
+			return (0);
+		}
+		/* Start a chunk early for the leading context. */
+		if (c > 0)
+			c--;
+		dcur_init(&ca, &ta, c);
+		dcur_init(&cb, &tb, c);
+	} else {
+		n = min(ta.dt_nwords, tb.dt_nwords) * sizeof(uint16_t);
+		d = firstdiff((const void *)ta.dt_words,
+		    (const void *)tb.dt_words, n);
+		if (d == n && ta.dt_nwords == tb.dt_nwords) {
+			printf("Traces match (%zu bytes).\n", n);
+			return (0);
+		}
+		dcur_init(&ca, &ta, 0);
+		dcur_init(&cb, &tb, 0);
+	}
+
+	ring = calloc(context + 1, sizeof(*ring));
+	ASSERT(ring != NULL, "calloc");
+	nring = 0;
+
+	/*
+	 * Plain records entirely before the differing byte match.  Count them
+	 * on one side, noting where the last few start, and decode only those.
+	 */
+	if (!ta.dt_indexed) {
+		for (mask = 1; mask <= context; mask <<= 1)
+			;
+		mask--;
+		offs = calloc(mask + 1, sizeof(*offs));
+		ASSERT(offs != NULL, "calloc");
+		lim = d / sizeof(uint16_t);
+		off = 0;
+		for (k = 0; off < lim; k++) {
+			ASSERT(ta.dt_words[off] < SYNACOR_NINSTR,
+			    "%s: corrupt record at instruction %ju", ta.dt_name,
+			    (uintmax_t)k);
+			n = 1 + synacor_instr[ta.dt_words[off]].arguments;
+			if (off + n > lim)
+				break;
+			offs[k & mask] = off;
+			off += n;
+		}
+		for (c = k > context ? k - context : 0; c < k; c++) {
+			ca.dc_off = offs[c & mask];
+			ca.dc_insn = c;
+			dcur_next(&ca, &ra);
+			ring[nring++ % context] = ra;
+		}
+		ca.dc_off = cb.dc_off = off;
+		ca.dc_insn = cb.dc_insn = k;
+		free(offs);
+	}
+
+	/* Walk in step, remembering the last 'context' matching records. */
+	while (true) {
+		ha = dcur_next(&ca, &ra);
+		hb = dcur_next(&cb, &rb);
+		if (!ha || !hb || !drec_eq(&ra, &rb))
+			break;
+		if (context > 0)
+			ring[nring++ % context] = ra;
+	}
+
+	if (!ha && !hb) {
+		/* Plain traces can differ only in a trailing partial record. */
+		printf("Traces match (%ju instructions).\n",
+		    (uintmax_t)ca.dc_insn);
+		return (0);
+	}
+
+	printf("Traces diverge at instruction %ju:\n",
+	    (uintmax_t)(ha ? ra.dr_insn : rb.dr_insn));
+	for (k = nring > context ? nring - context : 0; k < nring; k++)
+		drec_print(' ', &ring[k % context]);
+
+	printf("--- %s\n", ta.dt_name);
+	for (k = 0; k < context + 1 && ha; k++) {
+		drec_print('-', &ra);
+		ha = dcur_next(&ca, &ra);
+	}
+	if (k == 0)
+		printf("  (ends)\n");
+	printf("+++ %s\n", tb.dt_name);
+	for (k = 0; k < context + 1 && hb; k++) {
+		drec_print('+', &rb);
+		hb = dcur_next(&cb, &rb);
+	}
+	if (k == 0)
+		printf("  (ends)\n");
+	return (1);
+}
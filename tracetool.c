@@ -0,0 +1,239 @@
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "emu.h"
+#include "instr.h"
+#include "trace.h"
+
+/*
+ * synacor-trace: random access to indexed (-i) trace files.
+ *
+ * The file is mapped; the trailer locates the chunk index, a binary search
+ * over it finds the chunk holding an instruction, and a pc search skips every
+ * chunk whose pc map rules the pc out.  Only chunks actually visited are
+ * decoded.
+ */
+
+struct tfile {
+	struct tmap		 tf_tm;
+	const struct tidx_entry	*tf_idx;
+	uint64_t		 tf_nchunks;
+
+	/* Currently decoded chunk */
+	uint64_t		 tf_cur;
+	const uint16_t		*tf_words;
+	uint16_t		*tf_buf;
+};
+
+static bool	 hexout;
+
+static void
+tusage(void)
+{
+
+	printf("usage: synacor-trace FLAGS tracefile\n"
+		"\n"
+		"  FLAGS:\n"
+		"    -i=<N>        Start at instruction N\n"
+		"    -n=<N>        Print N instructions (default 16)\n"
+		"    -p=<PC>       Start at the next instruction executing at PC\n"
+		"    -x            Print hex instead of disassembly\n");
+	exit(1);
+}
+
+static void
+tfile_open(struct tfile *tf, const char *name)
+{
+
+	memset(tf, 0, sizeof(*tf));
+	tmap_open(&tf->tf_tm, name, TIDX_MAGIC, sizeof(struct tidx_entry));
+	tf->tf_idx = tf->tf_tm.tm_idx;
+	tf->tf_nchunks = tf->tf_tm.tm_nchunks;
+	tf->tf_cur = UINT64_MAX;
+	tf->tf_buf = malloc(TIDX_CHUNK * 5 * sizeof(uint16_t));
+	ASSERT(tf->tf_buf != NULL, "malloc");
+}
+
+static void
+tfile_load(struct tfile *tf, uint64_t c)
+{
+	const struct tidx_entry *te;
+	uLongf rawlen;
+	int rc;
+
+	if (c == tf->tf_cur)
+		return;
+
+	te = &tf->tf_idx[c];
+	ASSERT(te->te_off + te->te_len <= tf->tf_tm.tm_len &&
+	    te->te_rawlen <= TIDX_CHUNK * 5 * sizeof(uint16_t),
+	    "corrupt chunk %ju", (uintmax_t)c);
+	if (tf->tf_tm.tm_flags & TIDX_Z) {
+		rawlen = te->te_rawlen;
+		rc = uncompress((void *)tf->tf_buf, &rawlen,
+		    tf->tf_tm.tm_map + te->te_off, te->te_len);
+		ASSERT(rc == Z_OK && rawlen == te->te_rawlen,
+		    "corrupt chunk %ju", (uintmax_t)c);
+		tf->tf_words = tf->tf_buf;
+	} else
+		tf->tf_words = (const void *)(tf->tf_tm.tm_map + te->te_off);
+	tf->tf_cur = c;
+}
+
+/* Words in the record starting at 'w'. */
+static unsigned
+recsize(const uint16_t *w)
+{
+
+	ASSERT(w[1] < SYNACOR_NINSTR, "corrupt record");
+	return (2 + synacor_instr[w[1]].arguments);
+}
+
+/* Chunk holding instruction 'insn', or tf_nchunks if none. */
+static uint64_t
+tfile_find(const struct tfile *tf, uint64_t insn)
+{
+	uint64_t lo, hi, mid;
+
+	lo = 0;
+	hi = tf->tf_nchunks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tf->tf_idx[mid].te_insn <= insn)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (lo < tf->tf_nchunks && insn >= tf->tf_idx[lo].te_insn &&
+	    insn < tf->tf_idx[lo].te_insn + tf->tf_idx[lo].te_ninsns)
+		return (lo);
+	return (tf->tf_nchunks);
+}
+
+static void
+printrec(uint64_t insn, const uint16_t *w)
+{
+	char line[128];
+	size_t len;
+	unsigned j, n;
+
+	n = recsize(w) - 1;
+	len = snprintf(line, sizeof(line), "%ju %05u: ", (uintmax_t)insn,
+	    (uns)w[0]);
+	for (j = 0; j < n; j++) {
+		if (hexout)
+			len += snprintf(line + len, sizeof(line) - len,
+			    "%04x ", (uns)(j == 0 ? synacor_instr[w[1]].icode :
+			    w[1 + j]));
+		else if (j == 0)
+			len += snprintf(line + len, sizeof(line) - len, "%s",
+			    synacor_instr[w[1]].name);
+		else
+			len += fmtarg(line + len, w[1 + j], j == n - 1);
+	}
+	line[len++] = '\n';
+	fwrite(line, 1, len, stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct tidx_entry *te;
+	struct tfile tf;
+	const uint16_t *w;
+	uint64_t start, count, c, insn, k;
+	long pcarg;
+	bool havestart;
+	int opt;
+
+	havestart = false;
+	start = 0;
+	count = 16;
+	pcarg = -1;
+	while ((opt = getopt(argc, argv, "i:n:p:x")) != -1) {
+		switch (opt) {
+		case 'i':
+			start = strtoull(optarg, NULL, 0);
+			havestart = true;
+			break;
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			pcarg = strtol(optarg, NULL, 0);
+			if (pcarg < 0 || pcarg >= (long)MEMWORDS)
+				tusage();
+			break;
+		case 'x':
+			hexout = true;
+			break;
+		default:
+			tusage();
+			break;
+		}
+	}
+	if (optind != argc - 1)
+		tusage();
+
+	tfile_open(&tf, argv[optind]);
+	if (tf.tf_nchunks == 0) {
+		fprintf(stderr, "Empty trace.\n");
+		return (1);
+	}
+	if (!havestart)
+		start = tf.tf_idx[0].te_insn;
+
+	c = tfile_find(&tf, start);
+	if (c == tf.tf_nchunks) {
+		fprintf(stderr, "Instruction %ju not in trace (%ju to %ju).\n",
+		    (uintmax_t)start, (uintmax_t)tf.tf_idx[0].te_insn,
+		    (uintmax_t)(tf.tf_idx[0].te_insn + tf.tf_tm.tm_insns));
+		return (1);
+	}
+
+	/* Position w at instruction 'start' within chunk c. */
+	tfile_load(&tf, c);
+	w = tf.tf_words;
+	insn = tf.tf_idx[c].te_insn;
+	for (; insn < start; insn++)
+		w += recsize(w);
+
+	if (pcarg >= 0) {
+		for (; c < tf.tf_nchunks; c++) {
+			te = &tf.tf_idx[c];
+			if (c != tf.tf_cur) {
+				if ((te->te_pcmap[pcarg >> TIDX_PCSHIFT >> 6] &
+				    (1ULL << ((pcarg >> TIDX_PCSHIFT) & 63)))
+				    == 0)
+					continue;
+				tfile_load(&tf, c);
+				w = tf.tf_words;
+				insn = te->te_insn;
+			}
+			for (; insn < te->te_insn + te->te_ninsns; insn++) {
+				if (w[0] == pcarg)
+					goto found;
+				w += recsize(w);
+			}
+		}
+		fprintf(stderr, "pc %ld not executed after instruction %ju.\n",
+		    pcarg, (uintmax_t)start);
+		return (1);
+	}
+
+found:
+	for (k = 0; k < count && c < tf.tf_nchunks; k++) {
+		te = &tf.tf_idx[c];
+		if (insn == te->te_insn + te->te_ninsns) {
+			if (++c == tf.tf_nchunks)
+				break;
+			tfile_load(&tf, c);
+			w = tf.tf_words;
+		}
+		printrec(insn, w);
+		w += recsize(w);
+		insn++;
+	}
+	return (0);
+}
@@ -0,0 +1,218 @@
+#include "emu.h"
+
+/*
+ * Scripted session fan-out.
+ *
+ * Input scripts are sorted, which lays them out as the leaves of an implicit
+ * radix trie: any group of scripts sharing a prefix is contiguous, and the
+ * group's common prefix is the common prefix of its first and last members.
+ * The walk feeds each trie edge to the machine once, snapshots the machine
+ * where the trie branches, and rewinds to that snapshot for each sibling.
+ * Each script's output is the concatenation of its edges' outputs.
+ */
+
+struct script {
+	const char	*sc_name;
+	char		*sc_buf;
+	size_t		 sc_len;
+};
+
+static struct script	*scripts;
+static char		*pathout;	/* Output along the current path */
+static size_t		 pathlen;
+static size_t		 pathalloc;
+static uint64_t		 fedbytes;
+
+static void
+pathout_append(const char *buf, size_t len)
+{
+
+	if (pathlen + len > pathalloc) {
+		while (pathlen + len > pathalloc)
+			pathalloc = pathalloc ? pathalloc * 2 : 4096;
+		pathout = realloc(pathout, pathalloc);
+		ASSERT(pathout != NULL, "realloc");
+	}
+	memcpy(pathout + pathlen, buf, len);
+	pathlen += len;
+}
+
+/* Run the machine on 'len' bytes of input until it wants more. */
+static void
+feed(const char *buf, size_t len)
+{
+	char *out;
+	size_t outlen;
+
+	if (len > 0)
+		infile = fmemopen((void *)buf, len, "r");
+	else
+		infile = fopen("/dev/null", "r");
+	ASSERT(infile != NULL, "fmemopen: %s", strerror(errno));
+	outfile = open_memstream(&out, &outlen);
+	ASSERT(outfile != NULL, "open_memstream: %s", strerror(errno));
+
+	emulate();
+
+	fclose(outfile);
+	fclose(infile);
+	pathout_append(out, outlen);
+	free(out);
+	fedbytes += len;
+}
+
+static void
+script_read(struct script *sc, const char *name)
+{
+	FILE *f;
+	size_t alloc, rd;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open script `%s': %s\n", name,
+		    strerror(errno));
+		exit(1);
+	}
+
+	sc->sc_name = name;
+	sc->sc_buf = NULL;
+	sc->sc_len = alloc = 0;
+	do {
+		if (sc->sc_len == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			sc->sc_buf = realloc(sc->sc_buf, alloc);
+			ASSERT(sc->sc_buf != NULL, "realloc");
+		}
+		rd = fread(sc->sc_buf + sc->sc_len, 1, alloc - sc->sc_len, f);
+		sc->sc_len += rd;
+	} while (rd > 0);
+	ASSERT(!ferror(f), "fread: %s", strerror(errno));
+	fclose(f);
+}
+
+static void
+script_write(const struct script *sc)
+{
+	char name[4096];
+	FILE *f;
+	size_t wr;
+	int n;
+
+	n = snprintf(name, sizeof(name), "%s.out", sc->sc_name);
+	ASSERT(n >= 0 && (size_t)n < sizeof(name), "name too long");
+
+	f = fopen(name, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open output `%s': %s\n", name,
+		    strerror(errno));
+		exit(1);
+	}
+	wr = fwrite(pathout, 1, pathlen, f);
+	ASSERT(wr == pathlen, "fwrite: %s", strerror(errno));
+	fclose(f);
+}
+
+static int
+script_cmp(const void *a, const void *b)
+{
+	const struct script *sa = a, *sb = b;
+	int rc;
+
+	rc = memcmp(sa->sc_buf, sb->sc_buf, min(sa->sc_len, sb->sc_len));
+	if (rc != 0)
+		return (rc);
+	if (sa->sc_len != sb->sc_len)
+		return (sa->sc_len < sb->sc_len ? -1 : 1);
+	return (0);
+}
+
+/* Scripts [lo, hi) share their first 'depth' bytes, already fed. */
+static void
+trie_walk(size_t lo, size_t hi, size_t depth)
+{
+	const struct script *first, *last;
+	size_t lcp, mark, i, j, k;
+	uint64_t id;
+	bool branch;
+
+	first = &scripts[lo];
+	last = &scripts[hi - 1];
+	for (lcp = depth; lcp < first->sc_len && lcp < last->sc_len; lcp++)
+		if (first->sc_buf[lcp] != last->sc_buf[lcp])
+			break;
+
+	feed(first->sc_buf + depth, lcp - depth);
+
+	/* Scripts ending here sort before their extensions. */
+	for (i = lo; i < hi && scripts[i].sc_len == lcp; i++)
+		script_write(&scripts[i]);
+	if (i == hi)
+		return;
+
+	/* More than one child edge: remember where they fork. */
+	for (j = i + 1; j < hi; j++)
+		if (scripts[j].sc_buf[lcp] != scripts[i].sc_buf[lcp])
+			break;
+	branch = (j < hi);
+	id = 0;
+	if (branch)
+		id = snap_capture();
+
+	mark = pathlen;
+	for (j = i; j < hi; j = k) {
+		for (k = j + 1; k < hi; k++)
+			if (scripts[k].sc_buf[lcp] != scripts[j].sc_buf[lcp])
+				break;
+
+		if (j != i) {
+			ASSERT(snap_restore(id), "snapshot %ju lost",
+			    (uintmax_t)id);
+			pathlen = mark;
+		}
+		trie_walk(j, k, lcp);
+	}
+}
+
+/*
+ * Run each of the 'n' input scripts against the loaded machine, writing the
+ * output of script "foo" to "foo.out".
+ */
+void
+trie_run(char **names, unsigned n)
+{
+	uint64_t total;
+	unsigned i;
+
+	if (n == 0)
+		return;
+
+	scripts = calloc(n, sizeof(*scripts));
+	ASSERT(scripts != NULL, "calloc");
+	total = 0;
+	for (i = 0; i < n; i++) {
+		script_read(&scripts[i], names[i]);
+		total += scripts[i].sc_len;
+	}
+	qsort(scripts, n, sizeof(*scripts), script_cmp);
+
+	/* A path forks at most n - 1 times. */
+	snap_init(n);
+	in_yield = true;
+
+	trie_walk(0, n, 0);
+
+	in_yield = false;
+	infile = stdin;
+	outfile = stdout;
+
+	printf("Ran %u scripts: %ju input bytes, %ju executed.\n", n,
+	    (uintmax_t)total, (uintmax_t)fedbytes);
+
+	for (i = 0; i < n; i++)
+		free(scripts[i].sc_buf);
+	free(scripts);
+	scripts = NULL;
+	free(pathout);
+	pathout = NULL;
+	pathlen = pathalloc = 0;
+}
@@ -0,0 +1,194 @@
+#define	_GNU_SOURCE
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+/*
+ * VM instances sharing a copy-on-write base image.
+ *
+ * An image captures the machine state at the time it is created.  Memory goes
+ * into an anonymous shared memory object; each instance maps it MAP_PRIVATE,
+ * so instances share the image's pages until they write to them and the
+ * kernel gives them a private copy of just that page.  Registers, pc and the
+ * stack are small and are copied.
+ *
+ * The interpreter runs on the machine globals.  vm_switch() parks the current
+ * machine in its struct vm and installs another one; swapping 'memory' (and
+ * the machine's decode cache) is a pointer assignment, so switching is cheap.
+ */
+
+struct vm_image {
+	int		 vi_fd;
+	uint32_t	 vi_pc;
+	uint16_t	 vi_regs[8];
+	uint16_t	*vi_stack;
+	size_t		 vi_stack_depth;
+	uint64_t	 vi_insns;
+};
+
+struct vm {
+	uint16_t	*vm_memory;
+	uint32_t	 vm_pc;
+	bool		 vm_halted;
+	bool		 vm_in_blocked;
+	uint16_t	 vm_regs[8];
+	uint16_t	*vm_stack;
+	size_t		 vm_stack_depth;
+	size_t		 vm_stack_alloc;
+	uint64_t	 vm_insns;
+	uint64_t	 vm_statehash;
+	bool		 vm_statehash_valid;
+	struct dcache_ent *vm_dcache;
+	uint16_t	*vm_dcache_mem;
+};
+
+/*
+ * Each thread's own machine (the one main() set up, on the main thread),
+ * parked while another one runs.  vm_cur starts out NULL, for the default.
+ */
+static __thread struct vm	 vm_default;
+static __thread struct vm	*vm_cur;
+
+static int
+vm_shmfd(void)
+{
+
+#if defined(__FreeBSD__)
+	return (shm_open(SHM_ANON, O_RDWR | O_CLOEXEC, 0600));
+#else
+	return (memfd_create("synacor-image", MFD_CLOEXEC));
+#endif
+}
+
+/* Capture the running machine as a base image. */
+struct vm_image *
+vm_image_create(void)
+{
+	struct vm_image *vi;
+	size_t written;
+	ssize_t rc;
+
+	vi = calloc(1, sizeof(*vi));
+	ASSERT(vi != NULL, "calloc");
+
+	vi->vi_fd = vm_shmfd();
+	ASSERT(vi->vi_fd >= 0, "memfd_create: %s", strerror(errno));
+	rc = ftruncate(vi->vi_fd, MEMBYTES);
+	ASSERT(rc == 0, "ftruncate: %s", strerror(errno));
+	for (written = 0; written < MEMBYTES; written += rc) {
+		rc = pwrite(vi->vi_fd, (char *)memory + written,
+		    MEMBYTES - written, written);
+		ASSERT(rc > 0, "pwrite: %s", strerror(errno));
+	}
+
+	vi->vi_pc = pc;
+	vi->vi_insns = insns;
+	memcpy(vi->vi_regs, regs, sizeof(vi->vi_regs));
+	vi->vi_stack_depth = stack_depth;
+	if (stack_depth > 0) {
+		vi->vi_stack = malloc(stack_depth * sizeof(*stack));
+		ASSERT(vi->vi_stack != NULL, "malloc");
+		memcpy(vi->vi_stack, stack, stack_depth * sizeof(*stack));
+	}
+	return (vi);
+}
+
+void
+vm_image_destroy(struct vm_image *vi)
+{
+
+	if (vi == NULL)
+		return;
+	close(vi->vi_fd);
+	free(vi->vi_stack);
+	free(vi);
+}
+
+/* A new, parked instance starting from 'vi'. */
+struct vm *
+vm_create(const struct vm_image *vi)
+{
+	struct vm *vm;
+
+	vm = calloc(1, sizeof(*vm));
+	ASSERT(vm != NULL, "calloc");
+
+	vm->vm_memory = mmap(NULL, MEMBYTES, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, vi->vi_fd, 0);
+	ASSERT(vm->vm_memory != MAP_FAILED, "mmap: %s", strerror(errno));
+
+	vm->vm_pc = vi->vi_pc;
+	vm->vm_insns = vi->vi_insns;
+	memcpy(vm->vm_regs, vi->vi_regs, sizeof(vm->vm_regs));
+	vm->vm_stack_depth = vi->vi_stack_depth;
+	vm->vm_stack_alloc = vi->vi_stack_depth;
+	if (vi->vi_stack_depth > 0) {
+		vm->vm_stack = malloc(vi->vi_stack_depth * sizeof(*stack));
+		ASSERT(vm->vm_stack != NULL, "malloc");
+		memcpy(vm->vm_stack, vi->vi_stack,
+		    vi->vi_stack_depth * sizeof(*stack));
+	}
+	return (vm);
+}
+
+void
+vm_destroy(struct vm *vm)
+{
+
+	if (vm == NULL)
+		return;
+	ASSERT(vm != vm_cur, "destroying the running vm");
+	munmap(vm->vm_memory, MEMBYTES);
+	free(vm->vm_stack);
+	free(vm->vm_dcache);
+	free(vm);
+}
+
+/* Park the running machine and run 'vm'; NULL returns to the default. */
+void
+vm_switch(struct vm *vm)
+{
+	struct vm *old;
+
+	if (vm == NULL)
+		vm = &vm_default;
+	old = vm_cur != NULL ? vm_cur : &vm_default;
+	if (vm == old)
+		return;
+
+	old->vm_memory = memory;
+	old->vm_pc = pc;
+	old->vm_halted = halted;
+	old->vm_in_blocked = in_blocked;
+	memcpy(old->vm_regs, regs, sizeof(old->vm_regs));
+	old->vm_stack = stack;
+	old->vm_stack_depth = stack_depth;
+	old->vm_stack_alloc = stack_alloc;
+	old->vm_insns = insns;
+	old->vm_statehash = statehash_acc;
+	old->vm_statehash_valid = statehash_on;
+	old->vm_dcache = dcache;
+	old->vm_dcache_mem = dcache_mem;
+
+	memory = vm->vm_memory;
+	pc = vm->vm_pc;
+	halted = vm->vm_halted;
+	in_blocked = vm->vm_in_blocked;
+	memcpy(regs, vm->vm_regs, sizeof(regs));
+	stack = vm->vm_stack;
+	stack_depth = vm->vm_stack_depth;
+	stack_alloc = vm->vm_stack_alloc;
+	insns = vm->vm_insns;
+	dcache = vm->vm_dcache;
+	dcache_mem = vm->vm_dcache_mem;
+	vm_cur = vm;
+
+	/* A machine that ran untracked needs a full rehash. */
+	if (statehash_on && vm->vm_statehash_valid)
+		statehash_acc = vm->vm_statehash;
+	else if (statehash_on)
+		statehash_enable(true);
+}